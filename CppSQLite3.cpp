@@ -6,10 +6,28 @@
 */
 
 #include "CppSQLite3.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
 #include <cstdlib>
 #include <sstream>
-#include <iostream>
-#include <unistd.h>
+#include <limits>
+#include <random>
+#include <thread>
+
+#if !defined(CPPSQLITE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define CPPSQLITE_SSE2
+#include <emmintrin.h>
+// AVX2 is compiled per function and picked at run time, which needs GCC or Clang
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPPSQLITE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 using namespace std;
 
@@ -220,10 +238,8 @@ void CppSQLite3Binary::setEncoded(const unsigned char *pBuf)
 const unsigned char *CppSQLite3Binary::getEncoded()
 {
   if (!mbEncoded) {
-    unsigned char *ptmp = new unsigned char[mnBinaryLen];
-    memcpy(ptmp, mpBuf, mnBinaryLen);
-    mnEncodedLen = sqlite3_encode_binary(ptmp, mnBinaryLen, mpBuf);
-    delete[] ptmp;
+    // allocBuffer left room for the encoding
+    mnEncodedLen = static_cast<int>(CppSQLite3BinaryCodec::encodeInPlace(mpBuf, mnBinaryLen));
     mbEncoded = true;
   }
 
@@ -234,12 +250,7 @@ const unsigned char *CppSQLite3Binary::getBinary()
 {
   if (mbEncoded) {
     // in/out buffers can be the same
-    mnBinaryLen = sqlite3_decode_binary(mpBuf, mpBuf);
-
-    if (mnBinaryLen == -1) {
-      throw CppSQLite3Exception(CPPSQLITE_ERROR, "Cannot decode binary", DONT_DELETE_MSG);
-    }
-
+    mnBinaryLen = static_cast<int>(CppSQLite3BinaryCodec::decode(mpBuf, mnEncodedLen, mpBuf));
     mbEncoded = false;
   }
 
@@ -283,1025 +294,5225 @@ void CppSQLite3Binary::clear()
   }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Kernels for CppSQLite3BinaryCodec. Each one handles the longest run of bytes
+// that needs no escaping, a vector at a time, and returns its length, leaving
+// the byte after it and any short tail to the scalar code.
 ////////////////////////////////////////////////////////////////////////////////
 
-CppSQLite3Query::CppSQLite3Query()
-  : mpVM(NULL),
-    mbEof(true),
-    mnCols(0),
-    mbOwnVM(false),
-    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
-    mnRetryTimeUs(5000)     // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+namespace
 {
-}
+  struct CodecKernels
+  {
+    // Encodes forwards from pIn into pOut
+    size_t (*encodeRun)(const unsigned char *pIn, size_t nLen, unsigned char nOffset, unsigned char *pOut);
+    // Encodes backwards from just before pInEnd and pOutEnd, for in place use
+    size_t (*encodeRunBack)(const unsigned char *pInEnd, size_t nLen, unsigned char nOffset, unsigned char *pOutEnd);
+    // Decodes forwards from pIn into pOut, which may trail pIn in the same buffer
+    size_t (*decodeRun)(const unsigned char *pIn, size_t nLen, unsigned char nOffset, unsigned char *pOut);
+  };
+
+#ifndef CPPSQLITE_SSE2
+  size_t scalarRun(const unsigned char *, size_t, unsigned char, unsigned char *)
+  {
+    return 0;
+  }
+#else
+  inline int lowestBit(unsigned int nMask)
+  {
+#ifdef _MSC_VER
+    unsigned long nIndex;
+    _BitScanForward(&nIndex, nMask);
+    return static_cast<int>(nIndex);
+#else
+    return __builtin_ctz(nMask);
+#endif
+  }
 
-CppSQLite3Query::CppSQLite3Query(const CppSQLite3Query &rQuery)
-{
-  mpVM = rQuery.mpVM;
-  // Only one object can own the VM
-  const_cast<CppSQLite3Query&>(rQuery).mpVM = NULL;
-  mbEof = rQuery.mbEof;
-  mnCols = rQuery.mnCols;
-  mbOwnVM = rQuery.mbOwnVM;
-  mnMaxRetryCount = rQuery.mnMaxRetryCount;
-  mnRetryTimeUs = rQuery.mnRetryTimeUs;
+  inline int highestBit(unsigned int nMask)
+  {
+#ifdef _MSC_VER
+    unsigned long nIndex;
+    _BitScanReverse(&nIndex, nMask);
+    return static_cast<int>(nIndex);
+#else
+    return 31 - __builtin_clz(nMask);
+#endif
+  }
+
+  // Bytes that encode to 0x00, 0x01 or a quote once the offset is taken off
+  inline unsigned int encodeEscapes(__m128i c)
+  {
+    __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(c, _mm_set1_epi8(1)), c);
+    __m128i quote = _mm_cmpeq_epi8(c, _mm_set1_epi8('\''));
+    return static_cast<unsigned int>(_mm_movemask_epi8(_mm_or_si128(low, quote)));
+  }
+
+  size_t encodeRunSSE2(const unsigned char *pIn, size_t nLen, unsigned char nOffset, unsigned char *pOut)
+  {
+    const __m128i offset = _mm_set1_epi8(static_cast<char>(nOffset));
+    size_t i = 0;
+
+    for (; i + 16 <= nLen; i += 16) {
+      __m128i c = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + i)), offset);
+      // pOut has room for at least as many bytes as are left to encode
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + i), c);
+      unsigned int nMask = encodeEscapes(c);
+
+      if (nMask) {
+        return i + lowestBit(nMask);
+      }
+    }
+
+    return i;
+  }
+
+  size_t encodeRunBackSSE2(const unsigned char *pInEnd, size_t nLen, unsigned char nOffset, unsigned char *pOutEnd)
+  {
+    const __m128i offset = _mm_set1_epi8(static_cast<char>(nOffset));
+    size_t i = 0;
+
+    for (; i + 16 <= nLen; i += 16) {
+      __m128i c = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pInEnd - i - 16)), offset);
+      unsigned int nMask = encodeEscapes(c);
+
+      if (nMask) {
+        // Only the bytes after the last escape can be stored, as the rest of
+        // the output may overlap input still to be read
+        int nClean = 15 - highestBit(nMask);
+        unsigned char aTemp[16];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(aTemp), c);
+        memcpy(pOutEnd - i - nClean, aTemp + 16 - nClean, nClean);
+        return i + nClean;
+      }
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pOutEnd - i - 16), c);
+    }
+
+    return i;
+  }
+
+  size_t decodeRunSSE2(const unsigned char *pIn, size_t nLen, unsigned char nOffset, unsigned char *pOut)
+  {
+    const __m128i offset = _mm_set1_epi8(static_cast<char>(nOffset));
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+
+    for (; i + 16 <= nLen; i += 16) {
+      __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + i));
+      __m128i v = _mm_add_epi8(c, offset);
+      unsigned int nMask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(c, one), c)));
+
+      if (nMask) {
+        int nClean = lowestBit(nMask);
+        unsigned char aTemp[16];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(aTemp), v);
+        memcpy(pOut + i, aTemp, nClean);
+        return i + nClean;
+      }
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(pOut + i), v);
+    }
+
+    return i;
+  }
+
+#ifdef CPPSQLITE_AVX2
+  __attribute__((target("avx2")))
+  inline unsigned int encodeEscapesAVX2(__m256i c)
+  {
+    __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(c, _mm256_set1_epi8(1)), c);
+    __m256i quote = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\''));
+    return static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_or_si256(low, quote)));
+  }
+
+  __attribute__((target("avx2")))
+  size_t encodeRunAVX2(const unsigned char *pIn, size_t nLen, unsigned char nOffset, unsigned char *pOut)
+  {
+    const __m256i offset = _mm256_set1_epi8(static_cast<char>(nOffset));
+    size_t i = 0;
+
+    for (; i + 32 <= nLen; i += 32) {
+      __m256i c = _mm256_sub_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pIn + i)), offset);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(pOut + i), c);
+      unsigned int nMask = encodeEscapesAVX2(c);
+
+      if (nMask) {
+        return i + lowestBit(nMask);
+      }
+    }
+
+    return i + encodeRunSSE2(pIn + i, nLen - i, nOffset, pOut + i);
+  }
+
+  __attribute__((target("avx2")))
+  size_t encodeRunBackAVX2(const unsigned char *pInEnd, size_t nLen, unsigned char nOffset, unsigned char *pOutEnd)
+  {
+    const __m256i offset = _mm256_set1_epi8(static_cast<char>(nOffset));
+    size_t i = 0;
+
+    for (; i + 32 <= nLen; i += 32) {
+      __m256i c = _mm256_sub_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pInEnd - i - 32)), offset);
+      unsigned int nMask = encodeEscapesAVX2(c);
+
+      if (nMask) {
+        int nClean = 31 - highestBit(nMask);
+        unsigned char aTemp[32];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(aTemp), c);
+        memcpy(pOutEnd - i - nClean, aTemp + 32 - nClean, nClean);
+        return i + nClean;
+      }
+
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(pOutEnd - i - 32), c);
+    }
+
+    return i + encodeRunBackSSE2(pInEnd - i, nLen - i, nOffset, pOutEnd - i);
+  }
+
+  __attribute__((target("avx2")))
+  size_t decodeRunAVX2(const unsigned char *pIn, size_t nLen, unsigned char nOffset, unsigned char *pOut)
+  {
+    const __m256i offset = _mm256_set1_epi8(static_cast<char>(nOffset));
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = 0;
+
+    for (; i + 32 <= nLen; i += 32) {
+      __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pIn + i));
+      __m256i v = _mm256_add_epi8(c, offset);
+      unsigned int nMask = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(c, one), c)));
+
+      if (nMask) {
+        int nClean = lowestBit(nMask);
+        unsigned char aTemp[32];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(aTemp), v);
+        memcpy(pOut + i, aTemp, nClean);
+        return i + nClean;
+      }
+
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(pOut + i), v);
+    }
+
+    return i + decodeRunSSE2(pIn + i, nLen - i, nOffset, pOut + i);
+  }
+#endif
+#endif
+
+  const CodecKernels &codecKernels()
+  {
+    static const CodecKernels kernels = []() {
+#if defined(CPPSQLITE_AVX2)
+      if (__builtin_cpu_supports("avx2")) {
+        return CodecKernels{encodeRunAVX2, encodeRunBackAVX2, decodeRunAVX2};
+      }
+#endif
+#if defined(CPPSQLITE_SSE2)
+      return CodecKernels{encodeRunSSE2, encodeRunBackSSE2, decodeRunSSE2};
+#else
+      return CodecKernels{scalarRun, scalarRun, scalarRun};
+#endif
+    }();
+
+    return kernels;
+  }
+
+  // The second byte of the escape for c, or 0 if c needs none
+  inline unsigned char escapeCode(unsigned char c)
+  {
+    return (c == 0 ? 1 : c == 1 ? 2 : c == '\'' ? 3 : 0);
+  }
+
+  size_t encodeBytes(const unsigned char *pIn, size_t nLen, unsigned char nOffset, unsigned char *pOut)
+  {
+    const CodecKernels &kernels = codecKernels();
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < nLen) {
+      size_t nRun = kernels.encodeRun(pIn + i, nLen - i, nOffset, pOut + j);
+      i += nRun;
+      j += nRun;
+
+      if (i == nLen) {
+        break;
+      }
+
+      unsigned char c = static_cast<unsigned char>(pIn[i++] - nOffset);
+      unsigned char nCode = escapeCode(c);
+
+      if (nCode) {
+        pOut[j++] = 1;
+        pOut[j++] = nCode;
+      } else {
+        pOut[j++] = c;
+      }
+    }
+
+    return j;
+  }
+
+  // Decodes into pOut, carrying an escape split across calls in bEscape
+  size_t decodeBytes(const unsigned char *pIn, size_t nLen, unsigned char nOffset, bool &bEscape,
+                     unsigned char *pOut)
+  {
+    const CodecKernels &kernels = codecKernels();
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < nLen) {
+      unsigned char c;
+
+      if (bEscape) {
+        c = pIn[i++];
+        bEscape = false;
+
+        if (c == 1) {
+          c = 0;
+        } else if (c == 2) {
+          c = 1;
+        } else if (c == 3) {
+          c = '\'';
+        } else {
+          throw CppSQLite3Exception(CPPSQLITE_ERROR, "Cannot decode binary", DONT_DELETE_MSG);
+        }
+      } else {
+        size_t nRun = kernels.decodeRun(pIn + i, nLen - i, nOffset, pOut + j);
+        i += nRun;
+        j += nRun;
+
+        if (i == nLen) {
+          break;
+        }
+
+        c = pIn[i++];
+
+        if (c == 0) {
+          throw CppSQLite3Exception(CPPSQLITE_ERROR, "Cannot decode binary", DONT_DELETE_MSG);
+        }
+
+        if (c == 1) {
+          bEscape = true;
+          continue;
+        }
+      }
+
+      pOut[j++] = static_cast<unsigned char>(c + nOffset);
+    }
+
+    return j;
+  }
 }
 
-CppSQLite3Query::CppSQLite3Query(sqlite3 *pDB, sqlite3_stmt *pVM, bool bEof, bool bOwnVM)
-  : mpDB(pDB),
-    mpVM(pVM),
-    mbEof(bEof),
-    mbOwnVM(bOwnVM),
-    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
-    mnRetryTimeUs(5000)     // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+////////////////////////////////////////////////////////////////////////////////
+
+size_t CppSQLite3BinaryCodec::maxEncodedLength(size_t nLen)
 {
-  mnCols = sqlite3_column_count(mpVM);
+  return 2 + nLen + (3 * nLen + 253) / 254;
 }
 
-CppSQLite3Query::~CppSQLite3Query()
+void CppSQLite3BinaryCodec::count(const unsigned char *pIn, size_t nLen, size_t anCounts[256])
 {
-  try {
-    finalize();
-  } catch (...) {
+  // Counting into separate tables keeps repeated bytes from waiting on each
+  // other's increments
+  size_t anPartial[4][256] = {};
+  size_t i = 0;
+
+  for (; i + 4 <= nLen; i += 4) {
+    anPartial[0][pIn[i]]++;
+    anPartial[1][pIn[i + 1]]++;
+    anPartial[2][pIn[i + 2]]++;
+    anPartial[3][pIn[i + 3]]++;
+  }
+
+  for (; i < nLen; i++) {
+    anPartial[0][pIn[i]]++;
+  }
+
+  for (int c = 0; c < 256; c++) {
+    anCounts[c] += anPartial[0][c] + anPartial[1][c] + anPartial[2][c] + anPartial[3][c];
   }
 }
 
-CppSQLite3Query &CppSQLite3Query::operator=(const CppSQLite3Query &rQuery)
+unsigned char CppSQLite3BinaryCodec::chooseOffset(const size_t anCounts[256], size_t nLen)
 {
-  try {
-    finalize();
-  } catch (...) {
+  if (nLen == 0) {
+    return 'x';
   }
 
-  mpVM = rQuery.mpVM;
-  // Only one object can own the VM
-  const_cast<CppSQLite3Query&>(rQuery).mpVM = NULL;
-  mbEof = rQuery.mbEof;
-  mnCols = rQuery.mnCols;
-  mbOwnVM = rQuery.mbOwnVM;
-  mnMaxRetryCount = rQuery.mnMaxRetryCount;
-  mnRetryTimeUs = rQuery.mnRetryTimeUs;
-  return *this;
+  // The first offset with the fewest escapes, as sqlite3_encode_binary picks
+  size_t nBest = nLen;
+  unsigned char nOffset = 1;
+
+  for (int i = 1; i < 256; i++) {
+    if (i == '\'') {
+      continue;
+    }
+
+    size_t nSum = anCounts[i] + anCounts[(i + 1) & 0xff] + anCounts[(i + '\'') & 0xff];
+
+    if (nSum < nBest) {
+      nBest = nSum;
+      nOffset = static_cast<unsigned char>(i);
+
+      if (nBest == 0) {
+        break;
+      }
+    }
+  }
+
+  return nOffset;
 }
 
-int CppSQLite3Query::numFields() const
+size_t CppSQLite3BinaryCodec::encode(const unsigned char *pIn, size_t nLen, unsigned char *pOut)
 {
-  checkVM();
-  return mnCols;
+  size_t anCounts[256] = {};
+  count(pIn, nLen, anCounts);
+
+  pOut[0] = chooseOffset(anCounts, nLen);
+  size_t nEncoded = 1 + encodeBytes(pIn, nLen, pOut[0], pOut + 1);
+  pOut[nEncoded] = 0;
+  return nEncoded;
 }
 
-string CppSQLite3Query::fieldValue(int nField) const
+size_t CppSQLite3BinaryCodec::encodeInPlace(unsigned char *pBuf, size_t nLen)
 {
-  checkVM();
+  size_t anCounts[256] = {};
+  count(pBuf, nLen, anCounts);
 
-  if (nField < 0 || nField > mnCols - 1) {
-    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  unsigned char nOffset = chooseOffset(anCounts, nLen);
+  size_t nEncoded = 1 + nLen;
+
+  if (nLen > 0) {
+    nEncoded += anCounts[nOffset] + anCounts[(nOffset + 1) & 0xff] + anCounts[(nOffset + '\'') & 0xff];
   }
 
-  if (fieldDataType(nField) == SQLITE_NULL) {
-    return "";
-  } else {
-    return reinterpret_cast<const char *>(sqlite3_column_text(mpVM, nField));
+  // Working back from the end, each byte of output lands at or after the
+  // byte of input it came from, so no input is overwritten before it is read
+  const CodecKernels &kernels = codecKernels();
+  size_t i = nLen;
+  size_t j = nEncoded;
+  pBuf[j] = 0;
+
+  while (i > 0) {
+    size_t nRun = kernels.encodeRunBack(pBuf + i, i, nOffset, pBuf + j);
+    i -= nRun;
+    j -= nRun;
+
+    if (i == 0) {
+      break;
+    }
+
+    unsigned char c = static_cast<unsigned char>(pBuf[--i] - nOffset);
+    unsigned char nCode = escapeCode(c);
+
+    if (nCode) {
+      pBuf[--j] = nCode;
+      pBuf[--j] = 1;
+    } else {
+      pBuf[--j] = c;
+    }
   }
-}
 
-string CppSQLite3Query::fieldValue(const string &szField) const
-{
-  int nField = fieldIndex(szField);
-  return reinterpret_cast<const char *>(sqlite3_column_text(mpVM, nField));
+  pBuf[0] = nOffset;
+  return nEncoded;
 }
 
-int CppSQLite3Query::getIntField(int nField, int nNullValue) const
+size_t CppSQLite3BinaryCodec::decode(const unsigned char *pIn, size_t nLen, unsigned char *pOut)
 {
-  if (fieldDataType(nField) == SQLITE_NULL) {
-    return nNullValue;
-  } else {
-    return sqlite3_column_int(mpVM, nField);
+  if (nLen == 0) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Cannot decode binary", DONT_DELETE_MSG);
+  }
+
+  bool bEscape = false;
+  size_t nDecoded = decodeBytes(pIn + 1, nLen - 1, pIn[0], bEscape, pOut);
+
+  if (bEscape) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Cannot decode binary", DONT_DELETE_MSG);
   }
+
+  return nDecoded;
 }
 
-int CppSQLite3Query::getIntField(const string &szField, int nNullValue) const
+size_t CppSQLite3BinaryCodec::decode(const unsigned char *szIn, unsigned char *pOut)
 {
-  int nField = fieldIndex(szField);
-  return getIntField(nField, nNullValue);
+  return decode(szIn, strlen(reinterpret_cast<const char*>(szIn)), pOut);
 }
 
-int64_t CppSQLite3Query::getInt64Field(int nField, int64_t nNullValue) const
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3BinaryEncoder::CppSQLite3BinaryEncoder(unsigned char nOffset)
+  : mnOffset(nOffset),
+    mbStarted(false)
 {
-  if (fieldDataType(nField) == SQLITE_NULL) {
-    return nNullValue;
-  } else {
-    return sqlite3_column_int64(mpVM, nField);
+  if (nOffset == 0 || nOffset == '\'') {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid binary encoding offset", DONT_DELETE_MSG);
   }
 }
 
-int64_t CppSQLite3Query::getInt64Field(const string &szField, int64_t nNullValue) const
+size_t CppSQLite3BinaryEncoder::update(const unsigned char *pIn, size_t nLen, unsigned char *pOut)
 {
-  int nField = fieldIndex(szField);
-  return getIntField(nField, nNullValue);
+  size_t nWritten = 0;
+
+  if (!mbStarted) {
+    pOut[nWritten++] = mnOffset;
+    mbStarted = true;
+  }
+
+  return nWritten + encodeBytes(pIn, nLen, mnOffset, pOut + nWritten);
 }
 
-double CppSQLite3Query::getFloatField(int nField, double fNullValue) const
+size_t CppSQLite3BinaryEncoder::finish(unsigned char *pOut)
 {
-  if (fieldDataType(nField) == SQLITE_NULL) {
-    return fNullValue;
-  } else {
-    return sqlite3_column_double(mpVM, nField);
+  size_t nWritten = 0;
+
+  if (!mbStarted) {
+    pOut[nWritten++] = mnOffset;
+    mbStarted = true;
   }
+
+  pOut[nWritten] = 0;
+  return nWritten;
 }
 
-double CppSQLite3Query::getFloatField(const string &szField, double fNullValue) const
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3BinaryDecoder::CppSQLite3BinaryDecoder()
+  : mnOffset(0),
+    mbStarted(false),
+    mbEscape(false)
 {
-  int nField = fieldIndex(szField);
-  return getFloatField(nField, fNullValue);
 }
 
-string CppSQLite3Query::getStringField(int nField, const string &szNullValue) const
+size_t CppSQLite3BinaryDecoder::update(const unsigned char *pIn, size_t nLen, unsigned char *pOut)
 {
-  if (fieldDataType(nField) == SQLITE_NULL) {
-    return szNullValue;
-  } else {
-    return reinterpret_cast<const char*>(sqlite3_column_text(mpVM, nField));
+  if (!mbStarted && nLen > 0) {
+    mnOffset = *pIn++;
+    nLen--;
+    mbStarted = true;
   }
+
+  return decodeBytes(pIn, nLen, mnOffset, mbEscape, pOut);
 }
 
-string CppSQLite3Query::getStringField(const string &szField, const string &szNullValue) const
+void CppSQLite3BinaryDecoder::finish()
 {
-  int nField = fieldIndex(szField);
-  return getStringField(nField, szNullValue);
+  if (!mbStarted || mbEscape) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Cannot decode binary", DONT_DELETE_MSG);
+  }
 }
 
-const unsigned char *CppSQLite3Query::getBlobField(int nField, int &nLen) const
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3ColumnMap::CppSQLite3ColumnMap()
+  : mpVM(NULL),
+    mnReprepares(0)
 {
-  checkVM();
+}
 
-  if (nField < 0 || nField > mnCols - 1) {
-    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+void CppSQLite3ColumnMap::build(sqlite3_stmt *pVM)
+{
+  int nCols = sqlite3_column_count(pVM);
+  vector<const char*> aszNames(nCols);
+
+  for (int nCol = 0; nCol < nCols; nCol++) {
+    aszNames[nCol] = sqlite3_column_name(pVM, nCol);
   }
 
-  nLen = sqlite3_column_bytes(mpVM, nField);
-  return (const unsigned char*)sqlite3_column_blob(mpVM, nField);
+  build(aszNames.data(), nCols);
+  mpVM = pVM;
+  mnReprepares = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_REPREPARE, 0);
 }
 
-const unsigned char *CppSQLite3Query::getBlobField(const string &szField, int &nLen) const
+void CppSQLite3ColumnMap::build(const char *const *paszNames, int nCols)
 {
-  int nField = fieldIndex(szField);
-  return getBlobField(nField, nLen);
-}
+  clear();
 
-bool CppSQLite3Query::fieldIsNull(int nField) const
-{
-  return (fieldDataType(nField) == SQLITE_NULL);
+  // Keep the table at most half full so probes stay short
+  size_t nSlots = 8;
+  while (nSlots < 2 * static_cast<size_t>(nCols)) {
+    nSlots *= 2;
+  }
+
+  mSlots.assign(nSlots, 0);
+  mOffsets.reserve(nCols + 1);
+  mHashes.reserve(nCols);
+  mOffsets.push_back(0);
+
+  for (int nCol = 0; nCol < nCols; nCol++) {
+    insert(paszNames[nCol] ? paszNames[nCol] : "", nCol);
+  }
 }
 
-bool CppSQLite3Query::fieldIsNull(const string &szField) const
+bool CppSQLite3ColumnMap::builtFor(sqlite3_stmt *pVM) const
 {
-  int nField = fieldIndex(szField);
-  return (fieldDataType(nField) == SQLITE_NULL);
+  return (mpVM == pVM && mnReprepares == sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_REPREPARE, 0));
 }
 
-int CppSQLite3Query::fieldIndex(const string &szField) const
+int CppSQLite3ColumnMap::find(string_view szName) const
 {
-  checkVM();
+  if (mSlots.empty()) {
+    return -1;
+  }
 
-  if (!szField.empty()) {
-    string szTemp;
-    for (int nField = 0; nField < mnCols; nField++) {
-      szTemp = sqlite3_column_name(mpVM, nField);
+  uint32_t nHash = hash(szName);
+  size_t nMask = mSlots.size() - 1;
 
-      if (szField == szTemp) {
-        return nField;
-      }
+  for (size_t nSlot = nHash & nMask; mSlots[nSlot] != 0; nSlot = (nSlot + 1) & nMask) {
+    int nCol = mSlots[nSlot] - 1;
+
+    if (mHashes[nCol] == nHash &&
+        string_view(mNames).substr(mOffsets[nCol], mOffsets[nCol + 1] - mOffsets[nCol]) == szName) {
+      return nCol;
     }
   }
 
-  throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field name requested", DONT_DELETE_MSG);
+  return -1;
 }
 
-string CppSQLite3Query::fieldName(int nCol) const
+void CppSQLite3ColumnMap::clear()
 {
-  checkVM();
-  checkFieldIndex(nCol);
-
-  return sqlite3_column_name(mpVM, nCol);
+  mNames.clear();
+  mOffsets.clear();
+  mHashes.clear();
+  mSlots.clear();
+  mpVM = NULL;
+  mnReprepares = 0;
 }
 
-string CppSQLite3Query::fieldDeclType(int nCol) const
+uint32_t CppSQLite3ColumnMap::hash(string_view szName)
 {
-  checkVM();
-  checkFieldIndex(nCol);
+  // FNV-1a
+  uint32_t nHash = 2166136261u;
 
-  return sqlite3_column_decltype(mpVM, nCol);
+  for (size_t i = 0; i < szName.size(); i++) {
+    nHash = (nHash ^ static_cast<unsigned char>(szName[i])) * 16777619u;
+  }
+
+  return nHash;
 }
 
-int CppSQLite3Query::fieldDataType(int nCol) const
+void CppSQLite3ColumnMap::insert(string_view szName, int nCol)
 {
-  checkVM();
-  checkFieldIndex(nCol);
+  // Later duplicates stay in mNames so that offsets line up with column
+  // indexes, but are not reachable by name
+  bool bDuplicate = (find(szName) >= 0);
 
-  return sqlite3_column_type(mpVM, nCol);
-}
+  mNames.append(szName.data(), szName.size());
+  mOffsets.push_back(static_cast<uint32_t>(mNames.size()));
+  mHashes.push_back(hash(szName));
+
+  if (bDuplicate) {
+    return;
+  }
+
+  size_t nMask = mSlots.size() - 1;
+  size_t nSlot = mHashes[nCol] & nMask;
+
+  while (mSlots[nSlot] != 0) {
+    nSlot = (nSlot + 1) & nMask;
+  }
+
+  mSlots[nSlot] = nCol + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const shared_ptr<const CppSQLite3RetryPolicy> &CppSQLite3RetryPolicy::defaultPolicy()
+{
+  static const shared_ptr<const CppSQLite3RetryPolicy> pPolicy = make_shared<CppSQLite3FixedRetry>(5, 5000);
+  return pPolicy;
+}
+
+CppSQLite3FixedRetry::CppSQLite3FixedRetry(int nMaxRetries, int64_t nDelayUs)
+  : mnMaxRetries(nMaxRetries),
+    mnDelayUs(nDelayUs)
+{
+}
+
+int64_t CppSQLite3FixedRetry::nextDelayUs(int, int nAttempt, int64_t) const
+{
+  return (nAttempt <= mnMaxRetries ? mnDelayUs : GIVE_UP);
+}
+
+CppSQLite3ExponentialBackoff::CppSQLite3ExponentialBackoff(int nMaxRetries, int64_t nBaseDelayUs,
+                                                           int64_t nMaxDelayUs, bool bJitter)
+  : mnMaxRetries(nMaxRetries),
+    mnBaseDelayUs(nBaseDelayUs),
+    mnMaxDelayUs(nMaxDelayUs),
+    mbJitter(bJitter)
+{
+}
+
+int64_t CppSQLite3ExponentialBackoff::nextDelayUs(int, int nAttempt, int64_t) const
+{
+  if (nAttempt > mnMaxRetries) {
+    return GIVE_UP;
+  }
+
+  int64_t nBound = mnBaseDelayUs;
+
+  for (int i = 1; i < nAttempt && nBound < mnMaxDelayUs; i++) {
+    nBound *= 2;
+  }
+
+  nBound = min(nBound, mnMaxDelayUs);
+
+  if (!mbJitter || nBound <= 0) {
+    return nBound;
+  }
+
+  // Each thread draws from its own generator, so no locking is needed
+  static thread_local minstd_rand gen(random_device{}());
+  return uniform_int_distribution<int64_t>(0, nBound)(gen);
+}
+
+CppSQLite3DeadlineRetry::CppSQLite3DeadlineRetry(int64_t nBudgetUs,
+                                                 const shared_ptr<const CppSQLite3RetryPolicy> &pDelays)
+  : mnBudgetUs(nBudgetUs),
+    mpDelays(pDelays)
+{
+  if (!mpDelays) {
+    mpDelays = make_shared<CppSQLite3ExponentialBackoff>(numeric_limits<int>::max(), 100, 50000);
+  }
+}
+
+int64_t CppSQLite3DeadlineRetry::nextDelayUs(int nErrCode, int nAttempt, int64_t nElapsedUs) const
+{
+  if (nElapsedUs >= mnBudgetUs) {
+    return GIVE_UP;
+  }
+
+  int64_t nDelayUs = mpDelays->nextDelayUs(nErrCode, nAttempt, nElapsedUs);
+
+  if (nDelayUs < 0) {
+    return nDelayUs;
+  }
+
+  return min(nDelayUs, mnBudgetUs - nElapsedUs);
+}
+
+CppSQLite3SpinYieldRetry::CppSQLite3SpinYieldRetry(int nSpins, int nYields)
+  : mnSpins(nSpins),
+    mnYields(nYields)
+{
+}
+
+int64_t CppSQLite3SpinYieldRetry::nextDelayUs(int, int nAttempt, int64_t) const
+{
+  if (nAttempt <= mnSpins) {
+    return 0;
+  } else if (nAttempt - mnSpins <= mnYields) {
+    return YIELD;
+  } else {
+    return GIVE_UP;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3RingBufferLogger::CppSQLite3RingBufferLogger(size_t nCapacity)
+  : mSlots(max<size_t>(nCapacity, 1)),
+    mnNext(0)
+{
+  for (Slot &slot : mSlots) {
+    slot.nVersion.store(0, memory_order_relaxed);
+  }
+}
+
+void CppSQLite3RingBufferLogger::log(const CppSQLite3LogEvent &event)
+{
+  uint64_t nSeq = mnNext.fetch_add(1, memory_order_relaxed);
+  Slot &slot = mSlots[nSeq % mSlots.size()];
+
+  // Claim the slot unless a writer is still in it, or a later lap already
+  // wrote it. Either way this event is dropped rather than waited for.
+  uint64_t nVersion = slot.nVersion.load(memory_order_relaxed);
+
+  if ((nVersion & 1) || nVersion > 2 * nSeq ||
+      !slot.nVersion.compare_exchange_strong(nVersion, 2 * nSeq + 1, memory_order_relaxed)) {
+    return;
+  }
+
+  // Readers must see the slot marked busy before any of the new contents
+  atomic_thread_fence(memory_order_release);
+
+  slot.nLevel.store(event.nLevel, memory_order_relaxed);
+  slot.nErrCode.store(event.nErrCode, memory_order_relaxed);
+  slot.szMessage.store(event.szMessage, memory_order_relaxed);
+  slot.nRetry.store(event.nRetry, memory_order_relaxed);
+  slot.nElapsedUs.store(event.nElapsedUs, memory_order_relaxed);
+
+  // Words up to the one holding the terminator
+  uint64_t anSQL[SQL_WORDS] = {};
+  size_t nLen = (event.szSQL ? strnlen(event.szSQL, SQL_LENGTH) : 0);
+  memcpy(anSQL, event.szSQL ? event.szSQL : "", nLen);
+
+  for (size_t nWord = 0; nWord <= nLen / 8; nWord++) {
+    slot.anSQL[nWord].store(anSQL[nWord], memory_order_relaxed);
+  }
+
+  slot.nVersion.store(2 * (nSeq + 1), memory_order_release);
+}
+
+vector<CppSQLite3RingBufferLogger::Entry> CppSQLite3RingBufferLogger::events(uint64_t nFrom) const
+{
+  uint64_t nEnd = mnNext.load(memory_order_acquire);
+  uint64_t nBegin = max<uint64_t>(nFrom, (nEnd > mSlots.size() ? nEnd - mSlots.size() : 0));
+
+  vector<Entry> entries;
+
+  for (uint64_t nSeq = nBegin; nSeq < nEnd; nSeq++) {
+    const Slot &slot = mSlots[nSeq % mSlots.size()];
+    uint64_t nVersion = slot.nVersion.load(memory_order_acquire);
+
+    if (nVersion != 2 * (nSeq + 1)) {
+      // Still being written, or already overwritten
+      continue;
+    }
+
+    Entry entry;
+    entry.nSequence = nSeq;
+    entry.nLevel = slot.nLevel.load(memory_order_relaxed);
+    entry.nErrCode = slot.nErrCode.load(memory_order_relaxed);
+    entry.szMessage = slot.szMessage.load(memory_order_relaxed);
+    entry.nRetry = slot.nRetry.load(memory_order_relaxed);
+    entry.nElapsedUs = slot.nElapsedUs.load(memory_order_relaxed);
+
+    // Words up to the first holding a terminator. A torn copy may have
+    // none, so the length is bounded as well.
+    char szSQL[SQL_WORDS * 8];
+    size_t nWord = 0;
+
+    do {
+      uint64_t nValue = slot.anSQL[nWord].load(memory_order_relaxed);
+      memcpy(szSQL + 8 * nWord, &nValue, 8);
+    } while (memchr(szSQL + 8 * nWord, 0, 8) == NULL && ++nWord < SQL_WORDS);
+
+    size_t nCopied = 8 * (nWord + 1);
+    entry.szSQL.assign(szSQL, strnlen(szSQL, nCopied < SQL_LENGTH ? nCopied : SQL_LENGTH));
+
+    // Discard the copy if a writer got into the slot meanwhile
+    atomic_thread_fence(memory_order_acquire);
+
+    if (slot.nVersion.load(memory_order_relaxed) == nVersion) {
+      entries.push_back(entry);
+    }
+  }
+
+  return entries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Profiler::CppSQLite3Profiler()
+  : mnSlowThresholdNs(numeric_limits<int64_t>::max())
+{
+}
+
+void CppSQLite3Profiler::setSlowQueryHandler(int64_t nThresholdNs, SlowQueryHandler fnHandler)
+{
+  lock_guard<mutex> lock(mMutex);
+  mnSlowThresholdNs.store((fnHandler ? nThresholdNs : numeric_limits<int64_t>::max()), memory_order_relaxed);
+  mpSlowQueryHandler = (fnHandler ? make_shared<const SlowQueryHandler>(move(fnHandler)) : nullptr);
+}
+
+vector<CppSQLite3StatementProfile> CppSQLite3Profiler::snapshot() const
+{
+  vector<CppSQLite3StatementProfile> profiles;
+
+  {
+    lock_guard<mutex> lock(mMutex);
+    profiles.reserve(mEntries.size());
+
+    for (const auto &item : mEntries) {
+      CppSQLite3StatementProfile profile = item.second.profile;
+      profile.nP50Ns = percentile(item.second, 0.50);
+      profile.nP99Ns = percentile(item.second, 0.99);
+      profiles.push_back(profile);
+    }
+  }
+
+  sort(profiles.begin(), profiles.end(),
+       [](const CppSQLite3StatementProfile &a, const CppSQLite3StatementProfile &b) {
+         return a.nTotalNs > b.nTotalNs;
+       });
+
+  return profiles;
+}
+
+string CppSQLite3Profiler::snapshotJSON() const
+{
+  ostringstream json;
+  json << "[";
+
+  bool bFirst = true;
+
+  for (const CppSQLite3StatementProfile &profile : snapshot()) {
+    json << (bFirst ? "\n" : ",\n") << "  {\"SQL\": \"";
+    bFirst = false;
+
+    for (unsigned char c : profile.szSQL) {
+      if (c == '"' || c == '\\') {
+        json << '\\' << c;
+      } else if (c < 0x20) {
+        char szEscape[8];
+        snprintf(szEscape, sizeof szEscape, "\\u%04x", c);
+        json << szEscape;
+      } else {
+        json << c;
+      }
+    }
+
+    json << "\", \"Calls\": " << profile.nCalls
+         << ", \"Rows\": " << profile.nRows
+         << ", \"TotalNs\": " << profile.nTotalNs
+         << ", \"MaxNs\": " << profile.nMaxNs
+         << ", \"P50Ns\": " << profile.nP50Ns
+         << ", \"P99Ns\": " << profile.nP99Ns
+         << ", \"FullScanSteps\": " << profile.nFullScanSteps
+         << ", \"Sorts\": " << profile.nSorts
+         << ", \"AutoIndexes\": " << profile.nAutoIndexes
+         << ", \"VMSteps\": " << profile.nVMSteps
+         << ", \"Reprepares\": " << profile.nReprepares << "}";
+  }
+
+  json << (bFirst ? "]" : "\n]");
+  return json.str();
+}
+
+void CppSQLite3Profiler::reset()
+{
+  lock_guard<mutex> lock(mMutex);
+  mEntries.clear();
+}
+
+void CppSQLite3Profiler::record(const CppSQLite3StatementRun &run)
+{
+  string szKey = normalize(run.szSQL ? run.szSQL : "");
+  shared_ptr<const SlowQueryHandler> pSlowQueryHandler;
+
+  {
+    lock_guard<mutex> lock(mMutex);
+    auto it = mEntries.find(szKey);
+
+    if (it == mEntries.end()) {
+      Entry entry;
+      entry.profile = CppSQLite3StatementProfile();
+      entry.profile.szSQL = szKey;
+      entry.anHistogram.assign(BUCKETS, 0);
+      it = mEntries.emplace(move(szKey), move(entry)).first;
+    }
+
+    CppSQLite3StatementProfile &profile = it->second.profile;
+    profile.nCalls++;
+    profile.nRows += run.nRows;
+    profile.nTotalNs += run.nElapsedNs;
+    profile.nMaxNs = max(profile.nMaxNs, run.nElapsedNs);
+    profile.nFullScanSteps += run.nFullScanSteps;
+    profile.nSorts += run.nSorts;
+    profile.nAutoIndexes += run.nAutoIndexes;
+    profile.nVMSteps += run.nVMSteps;
+    profile.nReprepares += run.nReprepares;
+    it->second.anHistogram[bucket(run.nElapsedNs)]++;
+
+    if (run.nElapsedNs >= mnSlowThresholdNs.load(memory_order_relaxed)) {
+      pSlowQueryHandler = mpSlowQueryHandler;
+    }
+  }
+
+  // Called without the lock, so the handler may take a snapshot
+  if (pSlowQueryHandler) {
+    (*pSlowQueryHandler)(run);
+  }
+}
+
+namespace {
+
+bool isWordChar(unsigned char c)
+{
+  return (isalnum(c) || c == '_' || c == '$' || c >= 0x80);
+}
+
+}
+
+string CppSQLite3Profiler::normalize(string_view szSQL)
+{
+  string szNormal;
+  szNormal.reserve(szSQL.size());
+
+  size_t i = 0;
+  size_t nLen = szSQL.size();
+
+  while (i < nLen) {
+    unsigned char c = szSQL[i];
+
+    if (isspace(c)) {
+      i++;
+      continue;
+    }
+
+    if (c == '-' && i + 1 < nLen && szSQL[i + 1] == '-') {
+      i = szSQL.find('\n', i);
+      i = (i == string_view::npos ? nLen : i);
+      continue;
+    }
+
+    if (c == '/' && i + 1 < nLen && szSQL[i + 1] == '*') {
+      i = szSQL.find("*/", i + 2);
+      i = (i == string_view::npos ? nLen : i + 2);
+      continue;
+    }
+
+    // Tokens are separated by one space, whatever the spacing of the source,
+    // except around brackets, dots and commas
+    if (!szNormal.empty()) {
+      char cLast = szNormal.back();
+      bool bTight = (cLast == '(' || cLast == '.' || c == ',' || c == ')' || c == ';' || c == '.' ||
+                     (c == '(' && (isWordChar(cLast) || cLast == '"' || cLast == ']' || cLast == '`')));
+
+      if (!bTight) {
+        szNormal += ' ';
+      }
+    }
+
+    size_t nStart = i;
+
+    if (c == '\'' || ((c == 'x' || c == 'X') && i + 1 < nLen && szSQL[i + 1] == '\'')) {
+      // String or blob literal, with '' for a quote
+      i = szSQL.find('\'', i) + 1;
+
+      while (i < nLen) {
+        if (szSQL[i] == '\'') {
+          if (i + 1 < nLen && szSQL[i + 1] == '\'') {
+            i += 2;
+            continue;
+          }
+
+          i++;
+          break;
+        }
+
+        i++;
+      }
+
+      szNormal += '?';
+    } else if (c == '"' || c == '`' || c == '[') {
+      // Quoted identifier, kept as it is
+      char cClose = (c == '[' ? ']' : static_cast<char>(c));
+      size_t nEnd = szSQL.find(cClose, i + 1);
+      i = (nEnd == string_view::npos ? nLen : nEnd + 1);
+      szNormal.append(szSQL.data() + nStart, i - nStart);
+    } else if (isdigit(c) || (c == '.' && i + 1 < nLen && isdigit(static_cast<unsigned char>(szSQL[i + 1])))) {
+      // Number, including hex and exponents
+      bool bHex = (c == '0' && i + 1 < nLen && (szSQL[i + 1] == 'x' || szSQL[i + 1] == 'X'));
+
+      while (i < nLen) {
+        unsigned char d = szSQL[i];
+
+        if (!bHex && (d == '+' || d == '-') && (szSQL[i - 1] == 'e' || szSQL[i - 1] == 'E')) {
+          i++;
+        } else if (isalnum(d) || d == '.') {
+          i++;
+        } else {
+          break;
+        }
+      }
+
+      szNormal += '?';
+    } else if (isWordChar(c) || ((c == '?' || c == ':' || c == '@') && i + 1 < nLen &&
+                                 isWordChar(static_cast<unsigned char>(szSQL[i + 1])))) {
+      // Keyword, identifier or parameter
+      szNormal += static_cast<char>(tolower(c));
+
+      for (i++; i < nLen && isWordChar(static_cast<unsigned char>(szSQL[i])); i++) {
+        szNormal += static_cast<char>(tolower(static_cast<unsigned char>(szSQL[i])));
+      }
+    } else if (c != '\0' && strchr("<>=!|", c)) {
+      // Operators such as <= and ||
+      while (i < nLen && szSQL[i] != '\0' && strchr("<>=!|", szSQL[i])) {
+        szNormal += szSQL[i++];
+      }
+    } else {
+      szNormal += static_cast<char>(c);
+      i++;
+    }
+  }
+
+  while (!szNormal.empty() && (szNormal.back() == ';' || szNormal.back() == ' ')) {
+    szNormal.pop_back();
+  }
+
+  return szNormal;
+}
+
+int CppSQLite3Profiler::bucket(int64_t nNs)
+{
+  if (nNs < SUB_BUCKETS) {
+    return static_cast<int>(max<int64_t>(nNs, 0));
+  }
+
+  // SUB_BUCKETS is 8, so the 3 bits below the leading one pick the bucket
+#ifdef _MSC_VER
+  unsigned long nIndex;
+  _BitScanReverse64(&nIndex, static_cast<uint64_t>(nNs));
+  int nExponent = static_cast<int>(nIndex);
+#else
+  int nExponent = 63 - __builtin_clzll(static_cast<uint64_t>(nNs));
+#endif
+  return SUB_BUCKETS * (nExponent - 2) + static_cast<int>((nNs >> (nExponent - 3)) & (SUB_BUCKETS - 1));
+}
+
+int64_t CppSQLite3Profiler::percentile(const Entry &entry, double fFraction)
+{
+  int64_t nRank = static_cast<int64_t>(ceil(fFraction * entry.profile.nCalls));
+  int64_t nSeen = 0;
+
+  for (int i = 0; i < BUCKETS; i++) {
+    nSeen += entry.anHistogram[i];
+
+    if (nSeen >= nRank && nSeen > 0) {
+      if (i < SUB_BUCKETS) {
+        return i;
+      }
+
+      // Middle of the bucket, which is no further than 6% from any value in it
+      int nExponent = i / SUB_BUCKETS + 2;
+      int64_t nWidth = int64_t(1) << (nExponent - 3);
+      int64_t nLow = (SUB_BUCKETS + i % SUB_BUCKETS) * nWidth;
+      return min(nLow + nWidth / 2, entry.profile.nMaxNs);
+    }
+  }
+
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Trace callback context of a profiled connection, tracking the statements
+// part way through a run. Only touched on the thread using the connection.
+//
+// Runs are timed here rather than with the time in the profile event, which
+// SQLite measures in whole milliseconds.
+class CppSQLite3ProfilerHook
+{
+  public:
+    explicit CppSQLite3ProfilerHook(const shared_ptr<CppSQLite3Profiler> &pProfiler)
+      : mpProfiler(pProfiler)
+    {
+    }
+
+    static int trace(unsigned int nEvent, void *pContext, void *pP, void *pX);
+
+  private:
+    struct Running
+    {
+      sqlite3_stmt *pVM;
+      chrono::steady_clock::time_point start;
+      int64_t nRows;
+      // The statement cache resets this counter, so it is read, not reset
+      int nReprepares;
+      // A statement reprepared part way through a step sends a profile event
+      // for the abandoned attempt, then carries on without a new stmt event,
+      // so finished runs are kept until another statement starts
+      bool bFinished;
+    };
+
+    Running *find(sqlite3_stmt *pVM);
+
+    void start(sqlite3_stmt *pVM);
+
+    void finish(sqlite3_stmt *pVM);
+
+    shared_ptr<CppSQLite3Profiler> mpProfiler;
+
+    // Usually one or two statements
+    vector<Running> mRunning;
+};
+
+int CppSQLite3ProfilerHook::trace(unsigned int nEvent, void *pContext, void *pP, void *)
+{
+  CppSQLite3ProfilerHook *pHook = static_cast<CppSQLite3ProfilerHook*>(pContext);
+  sqlite3_stmt *pVM = static_cast<sqlite3_stmt*>(pP);
+
+  try {
+    if (nEvent == SQLITE_TRACE_STMT) {
+      pHook->start(pVM);
+    } else if (nEvent == SQLITE_TRACE_ROW) {
+      Running *pRunning = pHook->find(pVM);
+
+      if (pRunning) {
+        pRunning->bFinished = false;
+        pRunning->nRows++;
+      }
+    } else if (nEvent == SQLITE_TRACE_PROFILE) {
+      pHook->finish(pVM);
+    }
+  } catch (...) {
+    // Nothing may be thrown back through SQLite
+  }
+
+  return 0;
+}
+
+CppSQLite3ProfilerHook::Running *CppSQLite3ProfilerHook::find(sqlite3_stmt *pVM)
+{
+  for (Running &running : mRunning) {
+    if (running.pVM == pVM) {
+      return &running;
+    }
+  }
+
+  return NULL;
+}
+
+void CppSQLite3ProfilerHook::start(sqlite3_stmt *pVM)
+{
+  Running *pRunning = find(pVM);
+
+  if (pRunning && !pRunning->bFinished) {
+    // Stmt events also come for each trigger program
+    return;
+  }
+
+  if (!pRunning) {
+    mRunning.erase(remove_if(mRunning.begin(), mRunning.end(),
+                             [](const Running &running) { return running.bFinished; }),
+                   mRunning.end());
+    mRunning.push_back(Running());
+    pRunning = &mRunning.back();
+    pRunning->pVM = pVM;
+  }
+
+  pRunning->start = chrono::steady_clock::now();
+  pRunning->nRows = 0;
+  pRunning->nReprepares = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_REPREPARE, 0);
+  pRunning->bFinished = false;
+}
+
+void CppSQLite3ProfilerHook::finish(sqlite3_stmt *pVM)
+{
+  Running *pRunning = find(pVM);
+
+  if (!pRunning) {
+    // Started before profiling was turned on
+    return;
+  }
+
+  chrono::steady_clock::time_point now = chrono::steady_clock::now();
+  int nReprepares = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_REPREPARE, 0);
+
+  CppSQLite3StatementRun run;
+  run.szSQL = sqlite3_sql(pVM);
+  run.nElapsedNs = chrono::duration_cast<chrono::nanoseconds>(now - pRunning->start).count();
+  run.nRows = pRunning->nRows;
+  run.nFullScanSteps = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  run.nSorts = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_SORT, 1);
+  run.nAutoIndexes = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+  run.nVMSteps = sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_VM_STEP, 1);
+  run.nReprepares = max(nReprepares - pRunning->nReprepares, 0);
+
+  pRunning->start = now;
+  pRunning->nRows = 0;
+  pRunning->nReprepares = nReprepares;
+  pRunning->bFinished = true;
+
+  mpProfiler->record(run);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// Length of szSQL without trailing whitespace, which the statement cache
+// ignores
+size_t trimmedLength(const char *szSQL, size_t nLen)
+{
+  while (nLen > 0 && isspace(static_cast<unsigned char>(szSQL[nLen - 1]))) {
+    nLen--;
+  }
+
+  return nLen;
+}
+
+void logEvent(CppSQLite3Logger *pLogger, CppSQLite3LogEvent::Level nLevel, int nErrCode,
+              const char *szMessage, const char *szSQL=NULL, int nRetry=0, int64_t nElapsedUs=0)
+{
+  if (pLogger) {
+    CppSQLite3LogEvent event = { nLevel, nErrCode, szMessage, szSQL, nRetry, nElapsedUs };
+    pLogger->log(event);
+  }
+}
+
+// Follows a retry policy through the failed attempts of one operation,
+// logging each retry to pLogger if there is one
+class CppSQLite3Retrier
+{
+  public:
+    CppSQLite3Retrier(const CppSQLite3RetryPolicy *pPolicy, CppSQLite3Logger *pLogger, const char *szSQL)
+      : mpPolicy(pPolicy),
+        mpLogger(pLogger),
+        mszSQL(szSQL),
+        mnAttempt(0),
+        mnDelayUs(CppSQLite3RetryPolicy::GIVE_UP)
+    {
+    }
+
+    // Whether an attempt that failed with nRet should be retried. Only busy
+    // and locked errors (including their extended codes) are retried, but
+    // not SQLITE_BUSY_SNAPSHOT: the read transaction's snapshot is stale,
+    // and stays so however often the statement is repeated within it.
+    bool retry(int nRet)
+    {
+      int nPrimary = (nRet & 0xff);
+
+      if (!mpPolicy || (nPrimary != SQLITE_BUSY && nPrimary != SQLITE_LOCKED) || nRet == SQLITE_BUSY_SNAPSHOT) {
+        return false;
+      }
+
+      // The clock only starts on the first failure, so the common case of
+      // no contention never reads it
+      chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+      if (mnAttempt++ == 0) {
+        mStart = now;
+      }
+
+      int64_t nElapsedUs = chrono::duration_cast<chrono::microseconds>(now - mStart).count();
+      mnDelayUs = mpPolicy->nextDelayUs(nRet, mnAttempt, nElapsedUs);
+
+      if (mnDelayUs == CppSQLite3RetryPolicy::GIVE_UP) {
+        logEvent(mpLogger, CppSQLite3LogEvent::LEVEL_ERROR, nRet, "Database is locked, giving up",
+                 mszSQL, mnAttempt, nElapsedUs);
+        return false;
+      }
+
+      logEvent(mpLogger, CppSQLite3LogEvent::LEVEL_WARNING, nRet, "Database is locked, retrying",
+               mszSQL, mnAttempt, nElapsedUs);
+      return true;
+    }
+
+    // Wait as the policy asked before the next attempt
+    void wait() const
+    {
+      if (mnDelayUs > 0) {
+        this_thread::sleep_for(chrono::microseconds(mnDelayUs));
+      } else if (mnDelayUs == CppSQLite3RetryPolicy::YIELD) {
+        this_thread::yield();
+      }
+    }
+
+  private:
+    const CppSQLite3RetryPolicy *mpPolicy;
+    CppSQLite3Logger *mpLogger;
+    const char *mszSQL;
+    int mnAttempt;
+    int64_t mnDelayUs;
+    chrono::steady_clock::time_point mStart;
+};
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3StatementCache::CppSQLite3StatementCache(sqlite3 *pDB, int nCapacity)
+  : mpDB(pDB),
+    mnCapacity(nCapacity),
+    mnHits(0),
+    mnMisses(0),
+    mnEvictions(0),
+    mnInvalidations(0)
+{
+}
+
+CppSQLite3StatementCache::~CppSQLite3StatementCache()
+{
+  clear();
+}
+
+sqlite3_stmt *CppSQLite3StatementCache::acquire(const string &szSQL, shared_ptr<CppSQLite3ColumnMap> &pColumns)
+{
+  if (mnCapacity <= 0) {
+    return NULL;
+  }
+
+  // Keys have no trailing whitespace; only copy szSQL when it has some
+  size_t nLen = trimmedLength(szSQL.data(), szSQL.size());
+  unordered_map<string, IdleList::iterator>::iterator it =
+    (nLen == szSQL.size() ? mIndex.find(szSQL) : mIndex.find(szSQL.substr(0, nLen)));
+
+  if (it == mIndex.end()) {
+    mnMisses++;
+    return NULL;
+  }
+
+  // The statement is checked out until it is released again
+  sqlite3_stmt *pVM = it->second->pVM;
+  pColumns = it->second->pColumns;
+  mIdle.erase(it->second);
+  mIndex.erase(it);
+  mnHits++;
+  return pVM;
+}
+
+bool CppSQLite3StatementCache::cacheable(const string &szSQL, sqlite3_stmt *pVM) const
+{
+  if (!mpDB || mnCapacity <= 0 || !pVM) {
+    return false;
+  }
+
+  // sqlite3_sql() stops at the end of the first statement, so this rejects
+  // multi-statement strings and anything else release() could not key on,
+  // but not whitespace after the statement
+  const char *szStmtSQL = sqlite3_sql(pVM);
+
+  if (!szStmtSQL) {
+    return false;
+  }
+
+  size_t nLen = trimmedLength(szSQL.data(), szSQL.size());
+  return (trimmedLength(szStmtSQL, strlen(szStmtSQL)) == nLen && szSQL.compare(0, nLen, szStmtSQL, nLen) == 0);
+}
+
+int CppSQLite3StatementCache::release(sqlite3_stmt *pVM, const shared_ptr<CppSQLite3ColumnMap> &pColumns)
+{
+  int nRet = sqlite3_reset(pVM);
+  sqlite3_clear_bindings(pVM);
+
+  if (!mpDB || mnCapacity <= 0) {
+    sqlite3_finalize(pVM);
+    return nRet;
+  }
+
+  // A reprepare means the schema changed under us, so the other idle
+  // statements were compiled against a stale schema as well
+  if (sqlite3_stmt_status(pVM, SQLITE_STMTSTATUS_REPREPARE, 1) > 0) {
+    if (pColumns) {
+      // Resetting the counter would hide the reprepare from builtFor()
+      pColumns->clear();
+    }
+
+    if (!mIdle.empty()) {
+      clear();
+      mnInvalidations++;
+    }
+  }
+
+  const char *szStmtSQL = sqlite3_sql(pVM);
+  string szSQL(szStmtSQL, trimmedLength(szStmtSQL, strlen(szStmtSQL)));
+
+  if (mIndex.find(szSQL) != mIndex.end()) {
+    // Another copy of this statement is already idle
+    sqlite3_finalize(pVM);
+    return nRet;
+  }
+
+  Entry entry = { szSQL, pVM, pColumns };
+  mIdle.push_front(entry);
+  mIndex[szSQL] = mIdle.begin();
+  evict(mnCapacity);
+
+  return nRet;
+}
+
+void CppSQLite3StatementCache::clear()
+{
+  for (IdleList::iterator it = mIdle.begin(); it != mIdle.end(); ++it) {
+    sqlite3_finalize(it->pVM);
+  }
+
+  mIdle.clear();
+  mIndex.clear();
+}
+
+void CppSQLite3StatementCache::close()
+{
+  clear();
+  mpDB = NULL;
+}
+
+void CppSQLite3StatementCache::setCapacity(int nCapacity)
+{
+  mnCapacity = nCapacity;
+  evict(mnCapacity > 0 ? mnCapacity : 0);
+}
+
+void CppSQLite3StatementCache::evict(size_t nSize)
+{
+  while (mIdle.size() > nSize) {
+    sqlite3_finalize(mIdle.back().pVM);
+    mIndex.erase(mIdle.back().szSQL);
+    mIdle.pop_back();
+    mnEvictions++;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Query::CppSQLite3Query()
+  : mpDB(NULL),
+    mpVM(NULL),
+    mbEof(true),
+    mnCols(0),
+    mbOwnVM(false),
+    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
+    mnRetryTimeUs(5000),    // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+    mpRetryPolicy(CppSQLite3RetryPolicy::defaultPolicy())
+{
+}
+
+CppSQLite3Query::CppSQLite3Query(CppSQLite3Query &&rQuery) noexcept
+  : mpDB(rQuery.mpDB),
+    mpVM(rQuery.mpVM),
+    mbEof(rQuery.mbEof),
+    mnCols(rQuery.mnCols),
+    mbOwnVM(rQuery.mbOwnVM),
+    mpCache(move(rQuery.mpCache)),
+    mpColumns(move(rQuery.mpColumns)),
+    mnMaxRetryCount(rQuery.mnMaxRetryCount),
+    mnRetryTimeUs(rQuery.mnRetryTimeUs),
+    mpRetryPolicy(move(rQuery.mpRetryPolicy)),
+    mpLogger(move(rQuery.mpLogger))
+{
+  // Only one object can own the VM
+  rQuery.mpVM = NULL;
+  rQuery.mbEof = true;
+}
+
+CppSQLite3Query::CppSQLite3Query(sqlite3 *pDB, sqlite3_stmt *pVM, bool bEof, bool bOwnVM,
+                                 const shared_ptr<CppSQLite3StatementCache> &pCache,
+                                 const shared_ptr<CppSQLite3ColumnMap> &pColumns)
+  : mpDB(pDB),
+    mpVM(pVM),
+    mbEof(bEof),
+    mbOwnVM(bOwnVM),
+    mpCache(pCache),
+    mpColumns(pColumns),
+    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
+    mnRetryTimeUs(5000),    // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+    mpRetryPolicy(CppSQLite3RetryPolicy::defaultPolicy())
+{
+  mnCols = sqlite3_column_count(mpVM);
+}
+
+CppSQLite3Query::~CppSQLite3Query() noexcept
+{
+  try {
+    finalize();
+  } catch (...) {
+  }
+}
+
+CppSQLite3Query &CppSQLite3Query::operator=(CppSQLite3Query &&rQuery) noexcept
+{
+  if (this == &rQuery) {
+    return *this;
+  }
+
+  try {
+    finalize();
+  } catch (...) {
+  }
+
+  mpDB = rQuery.mpDB;
+  mpVM = rQuery.mpVM;
+  // Only one object can own the VM
+  rQuery.mpVM = NULL;
+  mbEof = rQuery.mbEof;
+  rQuery.mbEof = true;
+  mnCols = rQuery.mnCols;
+  mbOwnVM = rQuery.mbOwnVM;
+  mpCache = move(rQuery.mpCache);
+  mpColumns = move(rQuery.mpColumns);
+  mnMaxRetryCount = rQuery.mnMaxRetryCount;
+  mnRetryTimeUs = rQuery.mnRetryTimeUs;
+  mpRetryPolicy = move(rQuery.mpRetryPolicy);
+  mpLogger = move(rQuery.mpLogger);
+  return *this;
+}
+
+int CppSQLite3Query::numFields() const
+{
+  checkVM();
+  return mnCols;
+}
+
+string CppSQLite3Query::fieldValue(int nField) const
+{
+  checkVM();
+
+  if (nField < 0 || nField > mnCols - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  }
+
+  if (fieldDataType(nField) == SQLITE_NULL) {
+    return "";
+  } else {
+    return string(getStringView(nField));
+  }
+}
+
+string CppSQLite3Query::fieldValue(const string &szField) const
+{
+  int nField = fieldIndex(szField);
+  return fieldValue(nField);
+}
+
+int CppSQLite3Query::getIntField(int nField, int nNullValue) const
+{
+  if (fieldDataType(nField) == SQLITE_NULL) {
+    return nNullValue;
+  } else {
+    return sqlite3_column_int(mpVM, nField);
+  }
+}
+
+int CppSQLite3Query::getIntField(const string &szField, int nNullValue) const
+{
+  int nField = fieldIndex(szField);
+  return getIntField(nField, nNullValue);
+}
+
+int64_t CppSQLite3Query::getInt64Field(int nField, int64_t nNullValue) const
+{
+  if (fieldDataType(nField) == SQLITE_NULL) {
+    return nNullValue;
+  } else {
+    return sqlite3_column_int64(mpVM, nField);
+  }
+}
+
+int64_t CppSQLite3Query::getInt64Field(const string &szField, int64_t nNullValue) const
+{
+  int nField = fieldIndex(szField);
+  return getIntField(nField, nNullValue);
+}
+
+double CppSQLite3Query::getFloatField(int nField, double fNullValue) const
+{
+  if (fieldDataType(nField) == SQLITE_NULL) {
+    return fNullValue;
+  } else {
+    return sqlite3_column_double(mpVM, nField);
+  }
+}
+
+double CppSQLite3Query::getFloatField(const string &szField, double fNullValue) const
+{
+  int nField = fieldIndex(szField);
+  return getFloatField(nField, fNullValue);
+}
+
+string CppSQLite3Query::getStringField(int nField, const string &szNullValue) const
+{
+  if (fieldDataType(nField) == SQLITE_NULL) {
+    return szNullValue;
+  } else {
+    return string(getStringView(nField));
+  }
+}
+
+string CppSQLite3Query::getStringField(const string &szField, const string &szNullValue) const
+{
+  int nField = fieldIndex(szField);
+  return getStringField(nField, szNullValue);
+}
+
+const unsigned char *CppSQLite3Query::getBlobField(int nField, int &nLen) const
+{
+  checkVM();
+
+  if (nField < 0 || nField > mnCols - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  }
+
+  nLen = sqlite3_column_bytes(mpVM, nField);
+  return (const unsigned char*)sqlite3_column_blob(mpVM, nField);
+}
+
+const unsigned char *CppSQLite3Query::getBlobField(const string &szField, int &nLen) const
+{
+  int nField = fieldIndex(szField);
+  return getBlobField(nField, nLen);
+}
+
+string_view CppSQLite3Query::getStringView(int nField, string_view szNullValue) const
+{
+  if (fieldDataType(nField) == SQLITE_NULL) {
+    return szNullValue;
+  }
+
+  // sqlite3_column_bytes must follow sqlite3_column_text so that it reports
+  // the length of the text conversion
+  const char *szValue = reinterpret_cast<const char*>(sqlite3_column_text(mpVM, nField));
+  return string_view(szValue, sqlite3_column_bytes(mpVM, nField));
+}
+
+string_view CppSQLite3Query::getStringView(const string &szField, string_view szNullValue) const
+{
+  int nField = fieldIndex(szField);
+  return getStringView(nField, szNullValue);
+}
+
+CppSQLite3ByteView CppSQLite3Query::getBlobView(int nField) const
+{
+  checkVM();
+  checkFieldIndex(nField);
+
+  const unsigned char *pValue = static_cast<const unsigned char*>(sqlite3_column_blob(mpVM, nField));
+  return CppSQLite3ByteView(pValue, sqlite3_column_bytes(mpVM, nField));
+}
+
+CppSQLite3ByteView CppSQLite3Query::getBlobView(const string &szField) const
+{
+  int nField = fieldIndex(szField);
+  return getBlobView(nField);
+}
+
+bool CppSQLite3Query::fieldIsNull(int nField) const
+{
+  return (fieldDataType(nField) == SQLITE_NULL);
+}
+
+bool CppSQLite3Query::fieldIsNull(const string &szField) const
+{
+  int nField = fieldIndex(szField);
+  return (fieldDataType(nField) == SQLITE_NULL);
+}
+
+int CppSQLite3Query::fieldIndex(string_view szField) const
+{
+  checkVM();
+
+  if (!szField.empty()) {
+    if (!mpColumns) {
+      mpColumns = make_shared<CppSQLite3ColumnMap>();
+    }
+
+    if (!mpColumns->builtFor(mpVM)) {
+      mpColumns->build(mpVM);
+    }
+
+    int nField = mpColumns->find(szField);
+
+    if (nField >= 0) {
+      return nField;
+    }
+  }
+
+  throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field name requested", DONT_DELETE_MSG);
+}
+
+string CppSQLite3Query::fieldName(int nCol) const
+{
+  checkVM();
+  checkFieldIndex(nCol);
+
+  return sqlite3_column_name(mpVM, nCol);
+}
+
+string_view CppSQLite3Query::fieldNameView(int nCol) const
+{
+  checkVM();
+  checkFieldIndex(nCol);
+
+  return sqlite3_column_name(mpVM, nCol);
+}
+
+string CppSQLite3Query::fieldDeclType(int nCol) const
+{
+  checkVM();
+  checkFieldIndex(nCol);
+
+  return sqlite3_column_decltype(mpVM, nCol);
+}
+
+int CppSQLite3Query::fieldDataType(int nCol) const
+{
+  checkVM();
+  checkFieldIndex(nCol);
+
+  return sqlite3_column_type(mpVM, nCol);
+}
 
 bool CppSQLite3Query::eof() const
 {
-  checkVM();
-  return mbEof;
+  checkVM();
+  return mbEof;
+}
+
+void CppSQLite3Query::nextRow()
+{
+  checkVM();
+
+  CppSQLite3Retrier retrier(mpRetryPolicy.get(), mpLogger.get(), sqlite3_sql(mpVM));
+
+  while (true) {
+    int nRet = sqlite3_step(mpVM);
+
+    if (nRet == SQLITE_DONE) {
+      // no rows
+      mbEof = true;
+      break;
+
+    } else if (nRet == SQLITE_ROW) {
+      // more rows, nothing to do
+      break;
+
+    } else if (retrier.retry(nRet)) {
+      // Database is locked, wait for a bit
+      // Give the thread holding the lock time to finish
+      retrier.wait();
+      continue;
+
+    } else {
+      if (nRet == SQLITE_FULL || nRet == SQLITE_IOERR || nRet == SQLITE_NOMEM || nRet == SQLITE_INTERRUPT) {
+        rollback(nRet);
+      }
+
+      if (!mbOwnVM) {
+        // The VM belongs to a CppSQLite3Statement, which finalizes it
+        nRet = sqlite3_reset(mpVM);
+      } else if (mpCache) {
+        nRet = mpCache->release(mpVM, mpColumns);
+      } else {
+        nRet = sqlite3_finalize(mpVM);
+      }
+
+      mpVM = NULL;
+      const char *szError = sqlite3_errmsg(mpDB);
+      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    }
+  }
+}
+
+int CppSQLite3Query::fetchBatch(int nRows, CppSQLite3ColumnBatch &batch)
+{
+  checkVM();
+
+  batch.start(mnCols, max(nRows, 0));
+
+  while (batch.mnRows < nRows && !mbEof) {
+    batch.append(mpVM);
+    nextRow();
+  }
+
+  return batch.mnRows;
+}
+
+void CppSQLite3Query::finalize()
+{
+  if (mpVM && mbOwnVM) {
+    int nRet = (mpCache ? mpCache->release(mpVM, mpColumns) : sqlite3_finalize(mpVM));
+    mpVM = NULL;
+    if (nRet != SQLITE_OK) {
+      const char *szError = sqlite3_errmsg(mpDB);
+      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    }
+  }
+}
+
+void CppSQLite3Query::setMaxRetryCount(int nMaxRetryCount)
+{
+  mnMaxRetryCount = nMaxRetryCount;
+  mpRetryPolicy = make_shared<CppSQLite3FixedRetry>(mnMaxRetryCount, mnRetryTimeUs);
+}
+
+void CppSQLite3Query::setRetryTimeUs(int nRetryTimeUs)
+{
+  mnRetryTimeUs = nRetryTimeUs;
+  mpRetryPolicy = make_shared<CppSQLite3FixedRetry>(mnMaxRetryCount, mnRetryTimeUs);
+}
+
+void CppSQLite3Query::setRetryPolicy(const shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy)
+{
+  mpRetryPolicy = pRetryPolicy;
+}
+
+void CppSQLite3Query::setLogger(const shared_ptr<CppSQLite3Logger> &pLogger)
+{
+  mpLogger = pLogger;
+}
+
+void CppSQLite3Query::rollback(int nErrCode) const
+{
+  // Returns 0 when the given database connection
+  // is in the middle of a manually-initiated transaction
+  if (sqlite3_get_autocommit(mpDB) == 0) {
+    logEvent(mpLogger.get(), CppSQLite3LogEvent::LEVEL_WARNING, nErrCode, "Rolling back db transaction");
+
+    // Rollback the transaction that failed
+    char *szError = NULL;
+    int nRet2 = sqlite3_exec(mpDB, "ROLLBACK", 0, 0, &szError);
+
+    if (nRet2 != SQLITE_OK) {
+      sqlite3_free(szError);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Table::CppSQLite3Table()
+  : mnRows(0),
+    mnCols(0),
+    mnCurrentRow(0),
+    mpaszResults(NULL)
+{
+}
+
+CppSQLite3Table::CppSQLite3Table(CppSQLite3Table &&rTable) noexcept
+  : mnRows(rTable.mnRows),
+    mnCols(rTable.mnCols),
+    mnCurrentRow(rTable.mnCurrentRow),
+    mpaszResults(rTable.mpaszResults),
+    mpColumns(move(rTable.mpColumns))
+{
+  // Only one object can own the results
+  rTable.mpaszResults = NULL;
+}
+
+CppSQLite3Table::CppSQLite3Table(char **paszResults, int nRows, int nCols)
+  : mnRows(nRows),
+    mnCols(nCols),
+    mnCurrentRow(0),
+    mpaszResults(paszResults)
+{
+}
+
+CppSQLite3Table::~CppSQLite3Table() noexcept
+{
+  try {
+    finalize();
+  } catch (...) {
+  }
+}
+
+CppSQLite3Table &CppSQLite3Table::operator=(CppSQLite3Table &&rTable) noexcept
+{
+  if (this == &rTable) {
+    return *this;
+  }
+
+  try {
+    finalize();
+  } catch (...) {
+  }
+
+  mpaszResults = rTable.mpaszResults;
+  // Only one object can own the results
+  rTable.mpaszResults = NULL;
+  mnRows = rTable.mnRows;
+  mnCols = rTable.mnCols;
+  mnCurrentRow = rTable.mnCurrentRow;
+  mpColumns = move(rTable.mpColumns);
+  return *this;
+}
+
+void CppSQLite3Table::finalize()
+{
+  if (mpaszResults) {
+    sqlite3_free_table(mpaszResults);
+    mpaszResults = NULL;
+    mpColumns.reset();
+  }
+}
+
+int CppSQLite3Table::numFields() const
+{
+  checkResults();
+  return mnCols;
+}
+
+int CppSQLite3Table::numRows() const
+{
+  checkResults();
+  return mnRows;
+}
+
+string CppSQLite3Table::fieldValue(int nField) const
+{
+  checkResults();
+
+  if (nField < 0 || nField > mnCols - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  }
+
+  int nIndex = (mnCurrentRow * mnCols) + mnCols + nField;
+  return (mpaszResults[nIndex] ? mpaszResults[nIndex] : "");
+}
+
+string CppSQLite3Table::fieldValue(const string &szField) const
+{
+  int nField = fieldIndex(szField);
+  return fieldValue(nField);
+}
+
+int CppSQLite3Table::fieldIndex(string_view szField) const
+{
+  checkResults();
+
+  if (!szField.empty()) {
+    if (!mpColumns) {
+      // The first mnCols results are the column names
+      mpColumns = make_shared<CppSQLite3ColumnMap>();
+      mpColumns->build(mpaszResults, mnCols);
+    }
+
+    int nField = mpColumns->find(szField);
+
+    if (nField >= 0) {
+      return nField;
+    }
+  }
+
+  throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field name requested", DONT_DELETE_MSG);
+}
+
+int CppSQLite3Table::getIntField(int nField, int nNullValue) const
+{
+  if (fieldIsNull(nField)) {
+    return nNullValue;
+  } else {
+    return atoi(fieldValue(nField).c_str());
+  }
+}
+
+int CppSQLite3Table::getIntField(const string &szField, int nNullValue) const
+{
+  if (fieldIsNull(szField)) {
+    return nNullValue;
+  } else {
+    return atoi(fieldValue(szField).c_str());
+  }
+}
+
+double CppSQLite3Table::getFloatField(int nField, double fNullValue) const
+{
+  if (fieldIsNull(nField)) {
+    return fNullValue;
+  } else {
+    return atof(fieldValue(nField).c_str());
+  }
+}
+
+double CppSQLite3Table::getFloatField(const string &szField, double fNullValue) const
+{
+  if (fieldIsNull(szField)) {
+    return fNullValue;
+  } else {
+    return atof(fieldValue(szField).c_str());
+  }
+}
+
+const string CppSQLite3Table::getStringField(int nField, const string &szNullValue) const
+{
+  if (fieldIsNull(nField)) {
+    return szNullValue;
+  } else {
+    return fieldValue(nField);
+  }
+}
+
+const string CppSQLite3Table::getStringField(const string &szField, const string &szNullValue) const
+{
+  if (fieldIsNull(szField)) {
+    return szNullValue;
+  } else {
+    return fieldValue(szField);
+  }
+}
+
+bool CppSQLite3Table::fieldIsNull(int nField) const
+{
+  checkResults();
+
+  if (nField < 0 || nField > mnCols - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  }
+
+  int nIndex = (mnCurrentRow * mnCols) + mnCols + nField;
+  return (mpaszResults[nIndex] == NULL);
+}
+
+bool CppSQLite3Table::fieldIsNull(const string &szField) const
+{
+  return fieldIsNull(fieldIndex(szField));
+}
+
+string CppSQLite3Table::fieldName(int nCol)
+{
+  checkResults();
+
+  if (nCol < 0 || nCol > mnCols - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  }
+
+  return mpaszResults[nCol];
+}
+
+void CppSQLite3Table::setRow(int nRow)
+{
+  checkResults();
+
+  if (nRow < 0 || nRow > mnRows - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid row index requested", DONT_DELETE_MSG);
+  }
+
+  mnCurrentRow = nRow;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3ColumnarTable::CppSQLite3ColumnarTable()
+  : mnRows(0),
+    mnCols(0),
+    mnCurrentRow(0)
+{
+}
+
+CppSQLite3ColumnarTable::CppSQLite3ColumnarTable(CppSQLite3Query &rQuery)
+  : mnRows(0),
+    mnCols(0),
+    mnCurrentRow(0)
+{
+  rQuery.checkVM();
+  sqlite3_stmt *pVM = rQuery.mpVM;
+
+  mnCols = rQuery.mnCols;
+  mNames.resize(mnCols);
+  mColumns.resize(mnCols);
+
+  for (int nCol = 0; nCol < mnCols; nCol++) {
+    mNames[nCol] = sqlite3_column_name(pVM, nCol);
+  }
+
+  mColumnMap.build(pVM);
+
+  while (!rQuery.eof()) {
+    load(pVM);
+    rQuery.nextRow();
+  }
+}
+
+void CppSQLite3ColumnarTable::load(sqlite3_stmt *pVM)
+{
+  for (int nCol = 0; nCol < mnCols; nCol++) {
+    Column &column = mColumns[nCol];
+    int nType = sqlite3_column_type(pVM, nCol);
+    int64_t nValue = 0;
+
+    if (nType == SQLITE_INTEGER) {
+      nValue = sqlite3_column_int64(pVM, nCol);
+
+    } else if (nType == SQLITE_FLOAT) {
+      double dValue = sqlite3_column_double(pVM, nCol);
+      memcpy(&nValue, &dValue, sizeof nValue);
+
+    } else if (nType == SQLITE_TEXT || nType == SQLITE_BLOB) {
+      const void *pValue = (nType == SQLITE_TEXT ? static_cast<const void*>(sqlite3_column_text(pVM, nCol))
+                                                 : sqlite3_column_blob(pVM, nCol));
+      uint32_t nLen = static_cast<uint32_t>(sqlite3_column_bytes(pVM, nCol));
+
+      nValue = static_cast<int64_t>(mHeap.size());
+      mHeap.resize(mHeap.size() + sizeof nLen + nLen + 1);
+      char *pCell = &mHeap[nValue];
+      memcpy(pCell, &nLen, sizeof nLen);
+
+      if (nLen > 0) {
+        memcpy(pCell + sizeof nLen, pValue, nLen);
+      }
+
+      pCell[sizeof nLen + nLen] = '\0';
+    }
+
+    column.anValues.push_back(nValue);
+    column.anTypes.push_back(static_cast<unsigned char>(nType));
+  }
+
+  mnRows++;
+}
+
+int CppSQLite3ColumnarTable::numFields() const
+{
+  return mnCols;
+}
+
+int CppSQLite3ColumnarTable::numRows() const
+{
+  return mnRows;
+}
+
+int CppSQLite3ColumnarTable::fieldIndex(string_view szField) const
+{
+  int nField = (szField.empty() ? -1 : mColumnMap.find(szField));
+
+  if (nField < 0) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field name requested", DONT_DELETE_MSG);
+  }
+
+  return nField;
+}
+
+string CppSQLite3ColumnarTable::fieldName(int nCol) const
+{
+  checkField(nCol);
+  return mNames[nCol];
+}
+
+int CppSQLite3ColumnarTable::fieldDataType(int nField) const
+{
+  checkField(nField);
+
+  if (mnCurrentRow >= mnRows) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid row index requested", DONT_DELETE_MSG);
+  }
+
+  return mColumns[nField].anTypes[mnCurrentRow];
+}
+
+string CppSQLite3ColumnarTable::fieldValue(int nField) const
+{
+  switch (fieldDataType(nField)) {
+    case SQLITE_INTEGER:
+      return to_string(mColumns[nField].anValues[mnCurrentRow]);
+
+    case SQLITE_FLOAT: {
+      // Formatted as SQLite converts floats to text
+      char szValue[32];
+      sqlite3_snprintf(sizeof szValue, szValue, "%!.15g", getFloatField(nField));
+      return szValue;
+    }
+
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      return string(heapValue(mColumns[nField].anValues[mnCurrentRow]));
+
+    default:
+      return "";
+  }
+}
+
+string CppSQLite3ColumnarTable::fieldValue(const string &szField) const
+{
+  return fieldValue(fieldIndex(szField));
+}
+
+int CppSQLite3ColumnarTable::getIntField(int nField, int nNullValue) const
+{
+  return static_cast<int>(getInt64Field(nField, nNullValue));
+}
+
+int CppSQLite3ColumnarTable::getIntField(const string &szField, int nNullValue) const
+{
+  return getIntField(fieldIndex(szField), nNullValue);
+}
+
+int64_t CppSQLite3ColumnarTable::getInt64Field(int nField, int64_t nNullValue) const
+{
+  int64_t nValue = 0;
+  double dValue;
+
+  switch (fieldDataType(nField)) {
+    case SQLITE_INTEGER:
+      return mColumns[nField].anValues[mnCurrentRow];
+
+    case SQLITE_FLOAT:
+      nValue = mColumns[nField].anValues[mnCurrentRow];
+      memcpy(&dValue, &nValue, sizeof dValue);
+      return static_cast<int64_t>(dValue);
+
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      // Heap values are NUL terminated
+      return strtoll(heapValue(mColumns[nField].anValues[mnCurrentRow]).data(), NULL, 10);
+
+    default:
+      return nNullValue;
+  }
+}
+
+int64_t CppSQLite3ColumnarTable::getInt64Field(const string &szField, int64_t nNullValue) const
+{
+  return getInt64Field(fieldIndex(szField), nNullValue);
+}
+
+double CppSQLite3ColumnarTable::getFloatField(int nField, double fNullValue) const
+{
+  int64_t nValue = 0;
+  double dValue;
+
+  switch (fieldDataType(nField)) {
+    case SQLITE_INTEGER:
+      return static_cast<double>(mColumns[nField].anValues[mnCurrentRow]);
+
+    case SQLITE_FLOAT:
+      nValue = mColumns[nField].anValues[mnCurrentRow];
+      memcpy(&dValue, &nValue, sizeof dValue);
+      return dValue;
+
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      return atof(heapValue(mColumns[nField].anValues[mnCurrentRow]).data());
+
+    default:
+      return fNullValue;
+  }
+}
+
+double CppSQLite3ColumnarTable::getFloatField(const string &szField, double fNullValue) const
+{
+  return getFloatField(fieldIndex(szField), fNullValue);
+}
+
+const string CppSQLite3ColumnarTable::getStringField(int nField, const string &szNullValue) const
+{
+  if (fieldIsNull(nField)) {
+    return szNullValue;
+  } else {
+    return fieldValue(nField);
+  }
+}
+
+const string CppSQLite3ColumnarTable::getStringField(const string &szField, const string &szNullValue) const
+{
+  return getStringField(fieldIndex(szField), szNullValue);
+}
+
+string_view CppSQLite3ColumnarTable::getStringView(int nField, string_view szNullValue) const
+{
+  int nType = fieldDataType(nField);
+
+  if (nType == SQLITE_TEXT || nType == SQLITE_BLOB) {
+    return heapValue(mColumns[nField].anValues[mnCurrentRow]);
+  }
+
+  // Numbers have no text form stored to point at
+  if (nType != SQLITE_NULL) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Field is not text", DONT_DELETE_MSG);
+  }
+
+  return szNullValue;
+}
+
+string_view CppSQLite3ColumnarTable::getStringView(const string &szField, string_view szNullValue) const
+{
+  return getStringView(fieldIndex(szField), szNullValue);
+}
+
+CppSQLite3ByteView CppSQLite3ColumnarTable::getBlobView(int nField) const
+{
+  int nType = fieldDataType(nField);
+
+  if (nType != SQLITE_TEXT && nType != SQLITE_BLOB) {
+    return CppSQLite3ByteView();
+  }
+
+  string_view value = heapValue(mColumns[nField].anValues[mnCurrentRow]);
+  return CppSQLite3ByteView(reinterpret_cast<const unsigned char*>(value.data()), value.size());
+}
+
+CppSQLite3ByteView CppSQLite3ColumnarTable::getBlobView(const string &szField) const
+{
+  return getBlobView(fieldIndex(szField));
+}
+
+bool CppSQLite3ColumnarTable::fieldIsNull(int nField) const
+{
+  return (fieldDataType(nField) == SQLITE_NULL);
+}
+
+bool CppSQLite3ColumnarTable::fieldIsNull(const string &szField) const
+{
+  return fieldIsNull(fieldIndex(szField));
+}
+
+void CppSQLite3ColumnarTable::setRow(int nRow)
+{
+  if (nRow < 0 || nRow > mnRows - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid row index requested", DONT_DELETE_MSG);
+  }
+
+  mnCurrentRow = nRow;
+}
+
+void CppSQLite3ColumnarTable::finalize()
+{
+  mnRows = 0;
+  mnCols = 0;
+  mnCurrentRow = 0;
+  vector<string>().swap(mNames);
+  vector<Column>().swap(mColumns);
+  vector<char>().swap(mHeap);
+  mColumnMap.clear();
+}
+
+void CppSQLite3ColumnarTable::checkField(int nField) const
+{
+  if (nField < 0 || nField > mnCols - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  }
+}
+
+string_view CppSQLite3ColumnarTable::heapValue(int64_t nOffset) const
+{
+  uint32_t nLen;
+  memcpy(&nLen, &mHeap[nOffset], sizeof nLen);
+  return string_view(&mHeap[nOffset] + sizeof nLen, nLen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3ColumnBatch::CppSQLite3ColumnBatch()
+  : mnRows(0),
+    mnCapacity(0)
+{
+}
+
+void CppSQLite3ColumnBatch::reset()
+{
+  for (Column &col : mColumns) {
+    col.nType = SQLITE_NULL;
+  }
+
+  mArena.clear();
+  mnRows = 0;
+}
+
+void CppSQLite3ColumnBatch::setColumnType(int nCol, int nType)
+{
+  if (nCol < 0) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  }
+
+  if (nType != SQLITE_INTEGER && nType != SQLITE_FLOAT && nType != SQLITE_TEXT && nType != SQLITE_BLOB) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid column type", DONT_DELETE_MSG);
+  }
+
+  if (nCol >= numFields()) {
+    mColumns.resize(nCol + 1);
+  }
+
+  mColumns[nCol].nType = nType;
+  size(mColumns[nCol], mnCapacity, mnRows);
+}
+
+int CppSQLite3ColumnBatch::columnType(int nCol) const
+{
+  checkField(nCol);
+  return mColumns[nCol].nType;
+}
+
+bool CppSQLite3ColumnBatch::isNull(int nCol, int nRow) const
+{
+  checkField(nCol);
+  checkRow(nRow);
+  return (mColumns[nCol].anNulls[nRow >> 6] >> (nRow & 63)) & 1;
+}
+
+const uint64_t *CppSQLite3ColumnBatch::nullBitmap(int nCol) const
+{
+  checkField(nCol);
+  return mColumns[nCol].anNulls.data();
+}
+
+const int64_t *CppSQLite3ColumnBatch::int64Column(int nCol) const
+{
+  return column(nCol, SQLITE_INTEGER, SQLITE_INTEGER).anInts.data();
+}
+
+const double *CppSQLite3ColumnBatch::doubleColumn(int nCol) const
+{
+  return column(nCol, SQLITE_FLOAT, SQLITE_FLOAT).adFloats.data();
+}
+
+const int64_t *CppSQLite3ColumnBatch::offsetColumn(int nCol) const
+{
+  return column(nCol, SQLITE_TEXT, SQLITE_BLOB).anOffsets.data();
+}
+
+const int32_t *CppSQLite3ColumnBatch::lengthColumn(int nCol) const
+{
+  return column(nCol, SQLITE_TEXT, SQLITE_BLOB).anLengths.data();
+}
+
+string_view CppSQLite3ColumnBatch::stringValue(int nCol, int nRow) const
+{
+  const Column &col = column(nCol, SQLITE_TEXT, SQLITE_BLOB);
+  checkRow(nRow);
+  return string_view(mArena.data() + col.anOffsets[nRow], col.anLengths[nRow]);
+}
+
+CppSQLite3ByteView CppSQLite3ColumnBatch::blobValue(int nCol, int nRow) const
+{
+  const Column &col = column(nCol, SQLITE_TEXT, SQLITE_BLOB);
+  checkRow(nRow);
+  return CppSQLite3ByteView(reinterpret_cast<const unsigned char*>(mArena.data()) + col.anOffsets[nRow],
+                            col.anLengths[nRow]);
+}
+
+void CppSQLite3ColumnBatch::start(int nCols, int nRows)
+{
+  if (numFields() != nCols) {
+    mColumns.resize(nCols);
+  }
+
+  mArena.clear();
+  mnRows = 0;
+  mnCapacity = nRows;
+
+  for (Column &col : mColumns) {
+    col.anNulls.assign((nRows + 63) / 64, 0);
+    size(col, nRows, 0);
+  }
+}
+
+void CppSQLite3ColumnBatch::append(sqlite3_stmt *pVM)
+{
+  int nRow = mnRows++;
+
+  for (int nCol = 0; nCol < numFields(); nCol++) {
+    Column &col = mColumns[nCol];
+    int nValueType = sqlite3_column_type(pVM, nCol);
+
+    if (nValueType == SQLITE_NULL) {
+      col.anNulls[nRow >> 6] |= uint64_t(1) << (nRow & 63);
+
+      switch (col.nType) {
+        case SQLITE_INTEGER:
+          col.anInts[nRow] = 0;
+          break;
+
+        case SQLITE_FLOAT:
+          col.adFloats[nRow] = 0;
+          break;
+
+        case SQLITE_TEXT:
+        case SQLITE_BLOB:
+          col.anOffsets[nRow] = 0;
+          col.anLengths[nRow] = 0;
+          break;
+      }
+
+      continue;
+    }
+
+    if (col.nType == SQLITE_NULL) {
+      // First value of the column, which fixes its type
+      col.nType = nValueType;
+      size(col, mnCapacity, nRow);
+    }
+
+    switch (col.nType) {
+      case SQLITE_INTEGER:
+        col.anInts[nRow] = sqlite3_column_int64(pVM, nCol);
+        break;
+
+      case SQLITE_FLOAT:
+        col.adFloats[nRow] = sqlite3_column_double(pVM, nCol);
+        break;
+
+      case SQLITE_TEXT: {
+        const char *szValue = reinterpret_cast<const char*>(sqlite3_column_text(pVM, nCol));
+        int nLen = sqlite3_column_bytes(pVM, nCol);
+        col.anOffsets[nRow] = static_cast<int64_t>(mArena.size());
+        col.anLengths[nRow] = nLen;
+        mArena.insert(mArena.end(), szValue, szValue + nLen);
+        mArena.push_back(0);
+        break;
+      }
+
+      case SQLITE_BLOB: {
+        const char *pValue = static_cast<const char*>(sqlite3_column_blob(pVM, nCol));
+        int nLen = sqlite3_column_bytes(pVM, nCol);
+        col.anOffsets[nRow] = static_cast<int64_t>(mArena.size());
+        col.anLengths[nRow] = nLen;
+
+        if (nLen > 0) {
+          mArena.insert(mArena.end(), pValue, pValue + nLen);
+        }
+
+        break;
+      }
+    }
+  }
+}
+
+void CppSQLite3ColumnBatch::size(Column &rColumn, int nRows, int nFill)
+{
+  switch (rColumn.nType) {
+    case SQLITE_INTEGER:
+      if (static_cast<int>(rColumn.anInts.size()) < nRows) {
+        rColumn.anInts.resize(nRows);
+      }
+
+      fill(rColumn.anInts.begin(), rColumn.anInts.begin() + nFill, 0);
+      break;
+
+    case SQLITE_FLOAT:
+      if (static_cast<int>(rColumn.adFloats.size()) < nRows) {
+        rColumn.adFloats.resize(nRows);
+      }
+
+      fill(rColumn.adFloats.begin(), rColumn.adFloats.begin() + nFill, 0.0);
+      break;
+
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      if (static_cast<int>(rColumn.anOffsets.size()) < nRows) {
+        rColumn.anOffsets.resize(nRows);
+        rColumn.anLengths.resize(nRows);
+      }
+
+      fill(rColumn.anOffsets.begin(), rColumn.anOffsets.begin() + nFill, 0);
+      fill(rColumn.anLengths.begin(), rColumn.anLengths.begin() + nFill, 0);
+      break;
+  }
+}
+
+const CppSQLite3ColumnBatch::Column &CppSQLite3ColumnBatch::column(int nCol, int nType1, int nType2) const
+{
+  checkField(nCol);
+
+  const Column &col = mColumns[nCol];
+
+  if (col.nType != nType1 && col.nType != nType2) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Column is not stored as the requested type", DONT_DELETE_MSG);
+  }
+
+  return col;
+}
+
+void CppSQLite3ColumnBatch::checkField(int nCol) const
+{
+  if (nCol < 0 || nCol > numFields() - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3ColumnBatch::checkRow(int nRow) const
+{
+  if (nRow < 0 || nRow > mnRows - 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid row index requested", DONT_DELETE_MSG);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3ExecuteManyOptions::CppSQLite3ExecuteManyOptions()
+  : bTransaction(true),
+    bStatic(false),
+    bContinueOnError(false)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Statement::CppSQLite3Statement()
+  : mpDB(NULL),
+    mpVM(NULL),
+    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
+    mnRetryTimeUs(5000),    // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+    mpRetryPolicy(CppSQLite3RetryPolicy::defaultPolicy())
+{
+}
+
+CppSQLite3Statement::CppSQLite3Statement(CppSQLite3Statement &&rStatement) noexcept
+  : mpDB(rStatement.mpDB),
+    mpVM(rStatement.mpVM),
+    mpCache(move(rStatement.mpCache)),
+    mpColumns(move(rStatement.mpColumns)),
+    mpParams(move(rStatement.mpParams)),
+    mnMaxRetryCount(rStatement.mnMaxRetryCount),
+    mnRetryTimeUs(rStatement.mnRetryTimeUs),
+    mpRetryPolicy(move(rStatement.mpRetryPolicy)),
+    mpLogger(move(rStatement.mpLogger))
+{
+  // Only one object can own VM
+  rStatement.mpVM = NULL;
+}
+
+CppSQLite3Statement::CppSQLite3Statement(sqlite3 *pDB, sqlite3_stmt *pVM,
+                                         const shared_ptr<CppSQLite3StatementCache> &pCache,
+                                         const shared_ptr<CppSQLite3ColumnMap> &pColumns)
+  : mpDB(pDB),
+    mpVM(pVM),
+    mpCache(pCache),
+    mpColumns(pColumns),
+    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
+    mnRetryTimeUs(5000),    // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+    mpRetryPolicy(CppSQLite3RetryPolicy::defaultPolicy())
+{
+}
+
+CppSQLite3Statement::~CppSQLite3Statement() noexcept
+{
+  try {
+    finalize();
+  } catch (...) {
+  }
+}
+
+CppSQLite3Statement &CppSQLite3Statement::operator=(CppSQLite3Statement &&rStatement) noexcept
+{
+  if (this == &rStatement) {
+    return *this;
+  }
+
+  // The VM being replaced would otherwise leak
+  try {
+    finalize();
+  } catch (...) {
+  }
+
+  mpDB = rStatement.mpDB;
+  mpVM = rStatement.mpVM;
+  // Only one object can own VM
+  rStatement.mpVM = NULL;
+  mpCache = move(rStatement.mpCache);
+  mpColumns = move(rStatement.mpColumns);
+  mpParams = move(rStatement.mpParams);
+  mnMaxRetryCount = rStatement.mnMaxRetryCount;
+  mnRetryTimeUs = rStatement.mnRetryTimeUs;
+  mpRetryPolicy = move(rStatement.mpRetryPolicy);
+  mpLogger = move(rStatement.mpLogger);
+  return *this;
+}
+
+int CppSQLite3Statement::execDML() const
+{
+  checkDB();
+  checkVM();
+
+  const char *szError = NULL;
+
+  int nRet = sqlite3_step(mpVM);
+
+  if (nRet == SQLITE_DONE) {
+    int nRowsChanged = sqlite3_changes(mpDB);
+
+    nRet = sqlite3_reset(mpVM);
+
+    if (nRet != SQLITE_OK) {
+      szError = sqlite3_errmsg(mpDB);
+      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    }
+
+    return nRowsChanged;
+  } else {
+    nRet = sqlite3_reset(mpVM);
+    szError = sqlite3_errmsg(mpDB);
+    throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+  }
+}
+
+CppSQLite3ExecuteManyResult CppSQLite3Statement::executeMany(size_t nRows, const vector<CppSQLite3ParamColumn> &columns,
+                                                             const CppSQLite3ExecuteManyOptions &options)
+{
+  checkDB();
+  checkVM();
+
+  if (static_cast<int>(columns.size()) > sqlite3_bind_parameter_count(mpVM)) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "More columns than statement parameters", DONT_DELETE_MSG);
+  }
+
+  for (size_t nCol = 0; nCol < columns.size(); nCol++) {
+    if (columns[nCol].mnValues < nRows) {
+      throw CppSQLite3Exception(CPPSQLITE_ERROR, "Column has fewer values than rows", DONT_DELETE_MSG);
+    }
+  }
+
+  CppSQLite3ExecuteManyResult result;
+  result.nRows = 0;
+  result.nChanges = 0;
+  result.nFailed = 0;
+  result.nFirstFailedRow = -1;
+  result.nFirstErrCode = SQLITE_OK;
+
+  sqlite3_destructor_type pDestructor = (options.bStatic ? SQLITE_STATIC : SQLITE_TRANSIENT);
+  bool bOwnTransaction = (options.bTransaction && sqlite3_get_autocommit(mpDB) != 0);
+
+  if (bOwnTransaction) {
+    // Take the write lock up front, so the rows can't fail part way through
+    // on a lock another writer holds
+    CppSQLite3Retrier retrier(mpRetryPolicy.get(), mpLogger.get(), "BEGIN IMMEDIATE;");
+    int nRet;
+
+    while ((nRet = sqlite3_exec(mpDB, "BEGIN IMMEDIATE;", 0, 0, NULL)) != SQLITE_OK) {
+      if (!retrier.retry(nRet)) {
+        throw CppSQLite3Exception(nRet, sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+      }
+
+      // Database is locked, give the thread holding the lock time to finish
+      retrier.wait();
+    }
+  }
+
+  // Whether rows run in a transaction, ours or the caller's
+  bool bInTransaction = (sqlite3_get_autocommit(mpDB) == 0);
+
+  sqlite3_reset(mpVM);
+
+  for (size_t nRow = 0; nRow < nRows; nRow++) {
+    int nRet = SQLITE_OK;
+
+    for (size_t nCol = 0; nCol < columns.size() && nRet == SQLITE_OK; nCol++) {
+      const CppSQLite3ParamColumn &col = columns[nCol];
+      int nParam = static_cast<int>(nCol) + 1;
+
+      if (col.mpNulls && ((col.mpNulls[nRow >> 6] >> (nRow & 63)) & 1)) {
+        nRet = sqlite3_bind_null(mpVM, nParam);
+        continue;
+      }
+
+      switch (col.mnType) {
+        case SQLITE_INTEGER:
+          nRet = sqlite3_bind_int64(mpVM, nParam, static_cast<const int64_t*>(col.mpValues)[nRow]);
+          break;
+
+        case SQLITE_FLOAT:
+          nRet = sqlite3_bind_double(mpVM, nParam, static_cast<const double*>(col.mpValues)[nRow]);
+          break;
+
+        case SQLITE_TEXT: {
+          const string_view &szValue = static_cast<const string_view*>(col.mpValues)[nRow];
+          // A NULL pointer would bind NULL rather than an empty string
+          const char *szData = (szValue.data() ? szValue.data() : "");
+          nRet = sqlite3_bind_text64(mpVM, nParam, szData, szValue.size(), pDestructor, SQLITE_UTF8);
+          break;
+        }
+
+        case SQLITE_BLOB: {
+          const CppSQLite3ByteView &value = static_cast<const CppSQLite3ByteView*>(col.mpValues)[nRow];
+
+          if (!value.data()) {
+            // A NULL pointer would bind NULL rather than an empty blob
+            nRet = sqlite3_bind_zeroblob(mpVM, nParam, 0);
+          } else {
+            nRet = sqlite3_bind_blob64(mpVM, nParam, value.data(), value.size(), pDestructor);
+          }
+          break;
+        }
+      }
+    }
+
+    if (nRet == SQLITE_OK) {
+      nRet = sqlite3_step(mpVM);
+
+      if (nRet == SQLITE_DONE) {
+        result.nChanges += sqlite3_changes(mpDB);
+        nRet = SQLITE_OK;
+      }
+
+      int nReset = sqlite3_reset(mpVM);
+
+      if (nRet == SQLITE_OK) {
+        nRet = nReset;
+      }
+    }
+
+    if (nRet == SQLITE_OK) {
+      result.nRows++;
+      continue;
+    }
+
+    // Errors such as SQLITE_FULL and SQLITE_IOERR may roll the transaction
+    // back themselves, taking the rows already run with it
+    bool bRolledBack = (bInTransaction && sqlite3_get_autocommit(mpDB) != 0);
+
+    if (!options.bContinueOnError || bRolledBack) {
+      // Copied, as the rollback may replace the message
+      CppSQLite3Exception e(nRet, sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+      sqlite3_clear_bindings(mpVM);
+
+      if (bOwnTransaction && !bRolledBack) {
+        sqlite3_exec(mpDB, "rollback transaction;", 0, 0, NULL);
+      }
+
+      throw e;
+    }
+
+    if (result.nFailed++ == 0) {
+      result.nFirstFailedRow = static_cast<int64_t>(nRow);
+      result.nFirstErrCode = nRet;
+      result.szFirstError = sqlite3_errmsg(mpDB);
+    }
+  }
+
+  // Static bindings must not outlive the caller's values
+  sqlite3_clear_bindings(mpVM);
+
+  if (bOwnTransaction) {
+    // A COMMIT that fails with SQLITE_BUSY, as it does in rollback journal
+    // mode while readers hold SHARED locks, leaves the transaction open so
+    // that it can be retried
+    CppSQLite3Retrier retrier(mpRetryPolicy.get(), mpLogger.get(), "commit transaction;");
+    int nRet;
+
+    while ((nRet = sqlite3_exec(mpDB, "commit transaction;", 0, 0, NULL)) != SQLITE_OK) {
+      if (!retrier.retry(nRet)) {
+        // Copied, as the rollback may replace the message
+        CppSQLite3Exception e(nRet, sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+
+        if (sqlite3_get_autocommit(mpDB) == 0) {
+          sqlite3_exec(mpDB, "rollback transaction;", 0, 0, NULL);
+        }
+
+        throw e;
+      }
+
+      // Database is locked, give the thread holding the lock time to finish
+      retrier.wait();
+    }
+  }
+
+  return result;
+}
+
+CppSQLite3Query CppSQLite3Statement::execQuery() const
+{
+  checkDB();
+  checkVM();
+
+  if (!mpColumns) {
+    mpColumns = make_shared<CppSQLite3ColumnMap>();
+  }
+
+  CppSQLite3Retrier retrier(mpRetryPolicy.get(), mpLogger.get(), sqlite3_sql(mpVM));
+
+  while (true) {
+    int nRet = sqlite3_step(mpVM);
+
+    if (nRet == SQLITE_DONE) {
+      // no rows
+      CppSQLite3Query query(mpDB, mpVM, true, false, nullptr, mpColumns);
+      query.setRetryPolicy(mpRetryPolicy);
+      query.setLogger(mpLogger);
+      return query;
+    } else if (nRet == SQLITE_ROW) {
+      // at least 1 row
+      CppSQLite3Query query(mpDB, mpVM, false, false, nullptr, mpColumns);
+      query.setRetryPolicy(mpRetryPolicy);
+      query.setLogger(mpLogger);
+      return query;
+
+    } else if (retrier.retry(nRet)) {
+      // Database is locked, wait for a bit
+      // Give the thread holding the lock time to finish
+      retrier.wait();
+      continue;
+
+    } else {
+      nRet = sqlite3_reset(mpVM);
+      const char *szError = sqlite3_errmsg(mpDB);
+      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    }
+  }
+}
+
+void CppSQLite3Statement::bind(int nParam, const string &szValue)
+{
+  bind(nParam, string_view(szValue), CPPSQLITE_BIND_TRANSIENT);
+}
+
+void CppSQLite3Statement::bind(int nParam, const char *szValue)
+{
+  if (szValue) {
+    bind(nParam, string_view(szValue), CPPSQLITE_BIND_TRANSIENT);
+  } else {
+    bindNull(nParam);
+  }
+}
+
+void CppSQLite3Statement::bind(int nParam, const int nValue)
+{
+  checkVM();
+  int nRes = sqlite3_bind_int(mpVM, nParam, nValue);
+
+  if (nRes != SQLITE_OK) {
+    throw CppSQLite3Exception(nRes, "Error binding int param", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Statement::bind(int nParam, const int64_t nValue)
+{
+  checkVM();
+  int nRes = sqlite3_bind_int64(mpVM, nParam, nValue);
+
+  if (nRes != SQLITE_OK) {
+    throw CppSQLite3Exception(nRes, "Error binding int64 param", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Statement::bind(int nParam, const double dValue)
+{
+  checkVM();
+  int nRes = sqlite3_bind_double(mpVM, nParam, dValue);
+
+  if (nRes != SQLITE_OK) {
+    throw CppSQLite3Exception(nRes, "Error binding double param", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Statement::bind(int nParam, const unsigned char *blobValue, int nLen)
+{
+  checkVM();
+  int nRes = sqlite3_bind_blob(mpVM, nParam, (const void*)blobValue, nLen, SQLITE_TRANSIENT);
+
+  if (nRes != SQLITE_OK) {
+    throw CppSQLite3Exception(nRes, "Error binding blob param", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Statement::bindNull(int nParam)
+{
+  checkVM();
+  int nRes = sqlite3_bind_null(mpVM, nParam);
+
+  if (nRes != SQLITE_OK) {
+    throw CppSQLite3Exception(nRes, "Error binding NULL param", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Statement::bind(int nParam, string_view szValue, CppSQLite3BindLifetime nLifetime)
+{
+  bind(nParam, szValue, (nLifetime == CPPSQLITE_BIND_STATIC ? SQLITE_STATIC : SQLITE_TRANSIENT));
+}
+
+void CppSQLite3Statement::bind(int nParam, CppSQLite3ByteView blobValue, CppSQLite3BindLifetime nLifetime)
+{
+  bind(nParam, blobValue, (nLifetime == CPPSQLITE_BIND_STATIC ? SQLITE_STATIC : SQLITE_TRANSIENT));
+}
+
+void CppSQLite3Statement::bind(int nParam, string_view szValue, void (*xDestroy)(void*))
+{
+  if (!mpVM) {
+    // SQLite would have destroyed the value had it got that far
+    if (szValue.data() && xDestroy != SQLITE_STATIC && xDestroy != SQLITE_TRANSIENT) {
+      xDestroy(const_cast<char*>(szValue.data()));
+    }
+
+    checkVM();
+  }
+
+  int nRes;
+
+  if (szValue.data()) {
+    nRes = sqlite3_bind_text64(mpVM, nParam, szValue.data(), szValue.size(), xDestroy, SQLITE_UTF8);
+  } else {
+    // A NULL pointer would bind NULL rather than an empty string. The
+    // literal must not reach xDestroy.
+    nRes = sqlite3_bind_text64(mpVM, nParam, "", 0, SQLITE_STATIC, SQLITE_UTF8);
+  }
+
+  if (nRes != SQLITE_OK) {
+    throw CppSQLite3Exception(nRes, "Error binding string param", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Statement::bind(int nParam, CppSQLite3ByteView blobValue, void (*xDestroy)(void*))
+{
+  if (!mpVM) {
+    if (blobValue.data() && xDestroy != SQLITE_STATIC && xDestroy != SQLITE_TRANSIENT) {
+      xDestroy(const_cast<unsigned char*>(blobValue.data()));
+    }
+
+    checkVM();
+  }
+
+  int nRes;
+
+  if (blobValue.data()) {
+    nRes = sqlite3_bind_blob64(mpVM, nParam, blobValue.data(), blobValue.size(), xDestroy);
+  } else {
+    // A NULL pointer would bind NULL rather than an empty blob
+    nRes = sqlite3_bind_zeroblob(mpVM, nParam, 0);
+  }
+
+  if (nRes != SQLITE_OK) {
+    throw CppSQLite3Exception(nRes, "Error binding blob param", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Statement::bindZeroBlob(int nParam, int64_t nBytes)
+{
+  checkVM();
+  int nRes = sqlite3_bind_zeroblob64(mpVM, nParam, static_cast<sqlite3_uint64>(nBytes));
+
+  if (nRes != SQLITE_OK) {
+    throw CppSQLite3Exception(nRes, "Error binding zeroblob param", DONT_DELETE_MSG);
+  }
+}
+
+int CppSQLite3Statement::paramIndex(string_view szName) const
+{
+  checkVM();
+
+  if (!mpParams) {
+    int nParams = sqlite3_bind_parameter_count(mpVM);
+    vector<const char*> aszNames(nParams);
+
+    for (int nParam = 0; nParam < nParams; nParam++) {
+      aszNames[nParam] = sqlite3_bind_parameter_name(mpVM, nParam + 1);
+    }
+
+    mpParams = make_shared<CppSQLite3ColumnMap>();
+    mpParams->build(aszNames.data(), nParams);
+  }
+
+  // Nameless ? parameters are mapped as empty names
+  int nParam = (szName.empty() ? -1 : mpParams->find(szName));
+
+  if (nParam < 0) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid parameter name", DONT_DELETE_MSG);
+  }
+
+  return nParam + 1;
+}
+
+void CppSQLite3Statement::checkBind(int nRet) const
+{
+  if (nRet != SQLITE_OK) {
+    throw CppSQLite3Exception(nRet, "Error binding param", DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Statement::clearBindings()
+{
+  checkVM();
+  sqlite3_clear_bindings(mpVM);
+}
+
+void CppSQLite3Statement::reset()
+{
+  if (mpVM) {
+    int nRet = sqlite3_reset(mpVM);
+
+    if (nRet != SQLITE_OK) {
+      const char *szError = sqlite3_errmsg(mpDB);
+      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    }
+  }
+}
+
+void CppSQLite3Statement::finalize()
+{
+  mpParams.reset();
+
+  if (mpVM) {
+    int nRet = (mpCache ? mpCache->release(mpVM, mpColumns) : sqlite3_finalize(mpVM));
+    mpVM = NULL;
+
+    if (nRet != SQLITE_OK) {
+      const char *szError = sqlite3_errmsg(mpDB);
+      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    }
+  }
+}
+
+void CppSQLite3Statement::setMaxRetryCount(int nMaxRetryCount)
+{
+  mnMaxRetryCount = nMaxRetryCount;
+  mpRetryPolicy = make_shared<CppSQLite3FixedRetry>(mnMaxRetryCount, mnRetryTimeUs);
+}
+
+void CppSQLite3Statement::setRetryTimeUs(int nRetryTimeUs)
+{
+  mnRetryTimeUs = nRetryTimeUs;
+  mpRetryPolicy = make_shared<CppSQLite3FixedRetry>(mnMaxRetryCount, mnRetryTimeUs);
+}
+
+void CppSQLite3Statement::setRetryPolicy(const shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy)
+{
+  mpRetryPolicy = pRetryPolicy;
+}
+
+void CppSQLite3Statement::setLogger(const shared_ptr<CppSQLite3Logger> &pLogger)
+{
+  mpLogger = pLogger;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Blob::CppSQLite3Blob()
+  : mpDB(NULL),
+    mpBlob(NULL),
+    mbWritable(false),
+    mnSize(0),
+    mnPos(0)
+{
+}
+
+CppSQLite3Blob::CppSQLite3Blob(sqlite3 *pDB, sqlite3_blob *pBlob, bool bWritable)
+  : mpDB(pDB),
+    mpBlob(pBlob),
+    mbWritable(bWritable),
+    mnSize(sqlite3_blob_bytes(pBlob)),
+    mnPos(0)
+{
+}
+
+CppSQLite3Blob::CppSQLite3Blob(CppSQLite3Blob &&rBlob) noexcept
+  : mpDB(rBlob.mpDB),
+    mpBlob(rBlob.mpBlob),
+    mbWritable(rBlob.mbWritable),
+    mnSize(rBlob.mnSize),
+    mnPos(rBlob.mnPos)
+{
+  // Only one object can own the handle
+  rBlob.mpBlob = NULL;
+}
+
+CppSQLite3Blob::~CppSQLite3Blob() noexcept
+{
+  try {
+    close();
+  } catch (...) {
+  }
+}
+
+CppSQLite3Blob &CppSQLite3Blob::operator=(CppSQLite3Blob &&rBlob) noexcept
+{
+  if (this == &rBlob) {
+    return *this;
+  }
+
+  try {
+    close();
+  } catch (...) {
+  }
+
+  mpDB = rBlob.mpDB;
+  mpBlob = rBlob.mpBlob;
+  // Only one object can own the handle
+  rBlob.mpBlob = NULL;
+  mbWritable = rBlob.mbWritable;
+  mnSize = rBlob.mnSize;
+  mnPos = rBlob.mnPos;
+  return *this;
+}
+
+int CppSQLite3Blob::size() const
+{
+  checkBlob();
+  return mnSize;
+}
+
+void CppSQLite3Blob::seek(int nOffset)
+{
+  checkBlob();
+
+  if (nOffset < 0 || nOffset > mnSize) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid blob offset", DONT_DELETE_MSG);
+  }
+
+  mnPos = nOffset;
+}
+
+int CppSQLite3Blob::read(void *pBuffer, int nBytes)
+{
+  checkBlob();
+
+  int nRead = min(max(nBytes, 0), mnSize - mnPos);
+
+  if (nRead > 0) {
+    readAt(mnPos, pBuffer, nRead);
+    mnPos += nRead;
+  }
+
+  return nRead;
+}
+
+void CppSQLite3Blob::write(const void *pData, int nBytes)
+{
+  writeAt(mnPos, pData, nBytes);
+  mnPos += nBytes;
+}
+
+void CppSQLite3Blob::readAt(int nOffset, void *pBuffer, int nBytes) const
+{
+  checkBlob();
+
+  if (nOffset < 0 || nBytes < 0 || nBytes > mnSize - nOffset) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Read past end of blob", DONT_DELETE_MSG);
+  }
+
+  int nRet = sqlite3_blob_read(mpBlob, pBuffer, nBytes, nOffset);
+
+  if (nRet != SQLITE_OK) {
+    const char *szError = sqlite3_errmsg(mpDB);
+    throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Blob::writeAt(int nOffset, const void *pData, int nBytes)
+{
+  checkBlob();
+
+  if (!mbWritable) {
+    throw CppSQLite3Exception(SQLITE_READONLY, "Blob was opened read only", DONT_DELETE_MSG);
+  }
+
+  if (nOffset < 0 || nBytes < 0 || nBytes > mnSize - nOffset) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Write past end of blob", DONT_DELETE_MSG);
+  }
+
+  int nRet = sqlite3_blob_write(mpBlob, pData, nBytes, nOffset);
+
+  if (nRet != SQLITE_OK) {
+    const char *szError = sqlite3_errmsg(mpDB);
+    throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+  }
+}
+
+void CppSQLite3Blob::reopen(sqlite3_int64 nRowId)
+{
+  checkBlob();
+
+  int nRet = sqlite3_blob_reopen(mpBlob, nRowId);
+
+  if (nRet != SQLITE_OK) {
+    // The handle is aborted, and only good for closing
+    const char *szError = sqlite3_errmsg(mpDB);
+    CppSQLite3Exception e(nRet, szError, DONT_DELETE_MSG);
+    close();
+    throw e;
+  }
+
+  mnSize = sqlite3_blob_bytes(mpBlob);
+  mnPos = 0;
+}
+
+void CppSQLite3Blob::close()
+{
+  if (mpBlob) {
+    int nRet = sqlite3_blob_close(mpBlob);
+    mpBlob = NULL;
+
+    if (nRet != SQLITE_OK) {
+      const char *szError = sqlite3_errmsg(mpDB);
+      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    }
+  }
+}
+
+void CppSQLite3Blob::checkBlob() const
+{
+  if (mpBlob == NULL) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Blob not open", DONT_DELETE_MSG);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3BlobStreambuf::CppSQLite3BlobStreambuf(CppSQLite3Blob &blob, size_t nBufferSize)
+  : mBlob(blob),
+    mBuffer(max<size_t>(nBufferSize, 1))
+{
+}
+
+CppSQLite3BlobStreambuf::~CppSQLite3BlobStreambuf()
+{
+  flushPut();
+}
+
+void CppSQLite3BlobStreambuf::reopen(sqlite3_int64 nRowId)
+{
+  int nPending = static_cast<int>(pptr() - pbase());
+
+  if (nPending > 0) {
+    // Written directly, so that a failure throws rather than being lost
+    mBlob.write(pbase(), nPending);
+  }
+
+  // Unread data belongs to the old row, and the position goes back to 0
+  setp(NULL, NULL);
+  setg(NULL, NULL, NULL);
+  mBlob.reopen(nRowId);
+}
+
+CppSQLite3BlobStreambuf::int_type CppSQLite3BlobStreambuf::underflow()
+{
+  if (!flushPut()) {
+    return traits_type::eof();
+  }
+
+  setp(NULL, NULL);
+
+  int nRead;
+
+  try {
+    nRead = mBlob.read(mBuffer.data(), static_cast<int>(mBuffer.size()));
+  } catch (const CppSQLite3Exception &) {
+    return traits_type::eof();
+  }
+
+  if (nRead <= 0) {
+    return traits_type::eof();
+  }
+
+  setg(mBuffer.data(), mBuffer.data(), mBuffer.data() + nRead);
+  return traits_type::to_int_type(*gptr());
+}
+
+CppSQLite3BlobStreambuf::int_type CppSQLite3BlobStreambuf::overflow(int_type c)
+{
+  try {
+    dropGet();
+  } catch (const CppSQLite3Exception &) {
+    return traits_type::eof();
+  }
+
+  if (!flushPut()) {
+    return traits_type::eof();
+  }
+
+  setp(mBuffer.data(), mBuffer.data() + mBuffer.size());
+
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+
+  return traits_type::not_eof(c);
+}
+
+int CppSQLite3BlobStreambuf::sync()
+{
+  return (flushPut() ? 0 : -1);
+}
+
+CppSQLite3BlobStreambuf::pos_type CppSQLite3BlobStreambuf::seekoff(off_type nOffset, ios_base::seekdir nDir,
+                                                                   ios_base::openmode)
+{
+  if (!flushPut()) {
+    return pos_type(off_type(-1));
+  }
+
+  setp(NULL, NULL);
+
+  try {
+    dropGet();
+
+    off_type nBase = (nDir == ios_base::beg ? 0 : nDir == ios_base::cur ? mBlob.tell() : mBlob.size());
+    off_type nTarget = nBase + nOffset;
+
+    if (nTarget < 0 || nTarget > mBlob.size()) {
+      return pos_type(off_type(-1));
+    }
+
+    mBlob.seek(static_cast<int>(nTarget));
+    return pos_type(nTarget);
+  } catch (const CppSQLite3Exception &) {
+    return pos_type(off_type(-1));
+  }
+}
+
+CppSQLite3BlobStreambuf::pos_type CppSQLite3BlobStreambuf::seekpos(pos_type nPos, ios_base::openmode nMode)
+{
+  return seekoff(off_type(nPos), ios_base::beg, nMode);
+}
+
+bool CppSQLite3BlobStreambuf::flushPut()
+{
+  int nPending = static_cast<int>(pptr() - pbase());
+
+  if (nPending > 0) {
+    try {
+      mBlob.write(pbase(), nPending);
+    } catch (const CppSQLite3Exception &) {
+      return false;
+    }
+
+    setp(pbase(), epptr());
+  }
+
+  return true;
+}
+
+void CppSQLite3BlobStreambuf::dropGet()
+{
+  int nUnread = static_cast<int>(egptr() - gptr());
+
+  if (nUnread > 0) {
+    mBlob.seek(mBlob.tell() - nUnread);
+  }
+
+  setg(NULL, NULL, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3BackupOptions::CppSQLite3BackupOptions()
+  : nPagesPerStep(-1),
+    nStepDelayUs(0),
+    nMaxPagesPerSecond(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3OpenOptions::CppSQLite3OpenOptions()
+  : bReadOnly(false),
+    bCreate(true),
+    bNoMutex(false),
+    bFullMutex(false),
+    bUri(false),
+    bSharedCache(false),
+    bImmutable(false)
+{
+}
+
+CppSQLite3OpenOptions CppSQLite3OpenOptions::readHeavy()
+{
+  CppSQLite3OpenOptions options;
+  options.szJournalMode = "WAL";
+  options.szSynchronous = "NORMAL";
+  options.nMmapSize = int64_t(256) * 1024 * 1024;
+  options.nCacheSize = -64 * 1024;
+  options.szTempStore = "MEMORY";
+  return options;
+}
+
+CppSQLite3OpenOptions CppSQLite3OpenOptions::bulkLoad()
+{
+  CppSQLite3OpenOptions options;
+  options.szJournalMode = "MEMORY";
+  options.szSynchronous = "OFF";
+  options.nCacheSize = -256 * 1024;
+  options.szTempStore = "MEMORY";
+  return options;
+}
+
+CppSQLite3OpenOptions CppSQLite3OpenOptions::durableOLTP()
+{
+  CppSQLite3OpenOptions options;
+  options.szJournalMode = "WAL";
+  options.szSynchronous = "FULL";
+  options.nCacheSize = -16 * 1024;
+  return options;
+}
+
+CppSQLite3OpenOptions CppSQLite3OpenOptions::snapshot()
+{
+  CppSQLite3OpenOptions options;
+  options.bReadOnly = true;
+  options.bImmutable = true;
+  options.bNoMutex = true;
+
+  // SQLite caps this at SQLITE_MAX_MMAP_SIZE
+  options.nMmapSize = numeric_limits<int64_t>::max();
+  options.nCacheSize = -1024;
+  options.szTempStore = "MEMORY";
+  return options;
+}
+
+CppSQLite3OpenOptions CppSQLite3OpenOptions::preset(const string &szName)
+{
+  if (szName == "read-heavy") {
+    return readHeavy();
+  } else if (szName == "bulk-load") {
+    return bulkLoad();
+  } else if (szName == "durable-OLTP") {
+    return durableOLTP();
+  } else if (szName == "snapshot") {
+    return snapshot();
+  }
+
+  throw CppSQLite3Exception(CPPSQLITE_ERROR, "Unknown open options preset", DONT_DELETE_MSG);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3DB::CppSQLite3DB()
+  : mpDB(NULL),
+    mnBusyTimeoutMs(1000), // 1 seconds
+    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
+    mnRetryTimeUs(5000),    // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+    mpRetryPolicy(CppSQLite3RetryPolicy::defaultPolicy()),
+    mnStatementCacheSize(32)
+{
+}
+
+CppSQLite3DB::CppSQLite3DB(const CppSQLite3DB &db)
+  : mpDB(db.mpDB),
+    mnBusyTimeoutMs(db.mnBusyTimeoutMs),
+    mnMaxRetryCount(db.mnMaxRetryCount),
+    mnRetryTimeUs(db.mnRetryTimeUs),
+    mpRetryPolicy(db.mpRetryPolicy),
+    mpLogger(db.mpLogger),
+    mpProfiler(db.mpProfiler),
+    mpProfilerHook(db.mpProfilerHook),
+    mnStatementCacheSize(db.mnStatementCacheSize),
+    mpCache(db.mpCache)
+{
+}
+
+CppSQLite3DB::~CppSQLite3DB()
+{
+  close();
+}
+
+CppSQLite3DB &CppSQLite3DB::operator=(const CppSQLite3DB &db)
+{
+  mpDB = db.mpDB;
+  mnBusyTimeoutMs = 1000; // 1 seconds
+  return *this;
+}
+
+void CppSQLite3DB::open(const string &szFile)
+{
+  open(szFile, CppSQLite3OpenOptions());
+}
+
+void CppSQLite3DB::open(const string &szFile, const CppSQLite3OpenOptions &options)
+{
+  int nFlags = (options.bReadOnly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE);
+
+  if (!options.bReadOnly && options.bCreate) {
+    nFlags |= SQLITE_OPEN_CREATE;
+  }
+
+  if (options.bNoMutex) {
+    nFlags |= SQLITE_OPEN_NOMUTEX;
+  } else if (options.bFullMutex) {
+    nFlags |= SQLITE_OPEN_FULLMUTEX;
+  }
+
+  if (options.bUri) {
+    nFlags |= SQLITE_OPEN_URI;
+  }
+
+  if (options.bSharedCache) {
+    nFlags |= SQLITE_OPEN_SHAREDCACHE;
+  }
+
+  string szPath = szFile;
+
+  if (options.bImmutable) {
+    if (!options.bUri || szFile.compare(0, 5, "file:") != 0) {
+      // Characters with a meaning in URIs are escaped
+      szPath = "file:";
+
+      for (char c : szFile) {
+        if (c == '%' || c == '?' || c == '#') {
+          szPath += (c == '%' ? "%25" : c == '?' ? "%3f" : "%23");
+        } else {
+          szPath += c;
+        }
+      }
+    }
+
+    szPath += (szPath.find('?') == string::npos ? "?immutable=1" : "&immutable=1");
+    nFlags |= SQLITE_OPEN_URI;
+  }
+
+  int nRet = sqlite3_open_v2(szPath.c_str(), &mpDB, nFlags,
+                             (options.szVfs.empty() ? NULL : options.szVfs.c_str()));
+
+  if (nRet != SQLITE_OK) {
+    // The message belongs to the connection close() frees
+    CppSQLite3Exception e(nRet, sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+
+    close();
+
+    throw e;
+  }
+
+	// Enable extended error codes
+	sqlite3_extended_result_codes(mpDB, 1);
+
+  setBusyTimeout(options.nBusyTimeoutMs ? *options.nBusyTimeoutMs : mnBusyTimeoutMs);
+
+  // page_size goes first, as it cannot change once in WAL mode
+  string szPragmas;
+  CppSQLite3Buffer pragma;
+
+  if (options.nPageSize) {
+    szPragmas += pragma.format("PRAGMA page_size = %d;", *options.nPageSize);
+  }
+
+  if (!options.szJournalMode.empty()) {
+    szPragmas += pragma.format("PRAGMA journal_mode = %Q;", options.szJournalMode.c_str());
+  }
+
+  if (!options.szSynchronous.empty()) {
+    szPragmas += pragma.format("PRAGMA synchronous = %Q;", options.szSynchronous.c_str());
+  }
+
+  if (options.nCacheSize) {
+    szPragmas += pragma.format("PRAGMA cache_size = %d;", *options.nCacheSize);
+  }
+
+  if (options.nMmapSize) {
+    szPragmas += pragma.format("PRAGMA mmap_size = %lld;", (long long)*options.nMmapSize);
+  }
+
+  if (!options.szTempStore.empty()) {
+    szPragmas += pragma.format("PRAGMA temp_store = %Q;", options.szTempStore.c_str());
+  }
+
+  if (!szPragmas.empty()) {
+    char *szError = NULL;
+    nRet = sqlite3_exec(mpDB, szPragmas.c_str(), 0, 0, &szError);
+
+    if (nRet != SQLITE_OK) {
+      CppSQLite3Exception e(nRet, szError);
+      close();
+      throw e;
+    }
+  }
+
+  if (mpProfiler) {
+    installProfiler();
+  }
+
+  mpCache = make_shared<CppSQLite3StatementCache>(mpDB, mnStatementCacheSize);
+}
+
+void CppSQLite3DB::close()
+{
+  if (mpCache) {
+    // Queries and statements still holding the cache finalize their VMs
+    mpCache->close();
+    mpCache.reset();
+  }
+
+  if (mpDB) {
+    if (mpProfilerHook) {
+      // Statements left open past sqlite3_close_v2 could still trace
+      sqlite3_trace_v2(mpDB, 0, NULL, NULL);
+      mpProfilerHook.reset();
+    }
+
+    sqlite3_close_v2(mpDB);
+    mpDB = NULL;
+  }
+}
+
+CppSQLite3Statement CppSQLite3DB::compileStatement(const string &szSQL) const
+{
+  checkDB();
+
+  bool bCached;
+  shared_ptr<CppSQLite3ColumnMap> pColumns;
+  sqlite3_stmt *pVM = compile(szSQL, bCached, pColumns);
+  CppSQLite3Statement stmt(mpDB, pVM, (bCached ? mpCache : nullptr), pColumns);
+  stmt.setRetryPolicy(mpRetryPolicy);
+  stmt.setLogger(mpLogger);
+  return stmt;
+}
+
+CppSQLite3Blob CppSQLite3DB::openBlob(const string &szTable, const string &szColumn, sqlite3_int64 nRowId,
+                                     bool bWritable, const string &szDB) const
+{
+  checkDB();
+
+  sqlite3_blob *pBlob = NULL;
+  int nRet = sqlite3_blob_open(mpDB, szDB.c_str(), szTable.c_str(), szColumn.c_str(), nRowId,
+                               (bWritable ? 1 : 0), &pBlob);
+
+  if (nRet != SQLITE_OK) {
+    const char *szError = sqlite3_errmsg(mpDB);
+    CppSQLite3Exception e(nRet, szError, DONT_DELETE_MSG);
+    // A handle may be returned even on failure
+    sqlite3_blob_close(pBlob);
+    throw e;
+  }
+
+  return CppSQLite3Blob(mpDB, pBlob, bWritable);
+}
+
+bool CppSQLite3DB::tableExists(const string &szTable) const
+{
+  return scalar<int>("select exists(select 1 from sqlite_master where type = 'table' and name = ?);", szTable) != 0;
+}
+
+int CppSQLite3DB::execDML(const string &szSQL)
+{
+  return execDML(szSQL, mpRetryPolicy);
+}
+
+int CppSQLite3DB::execDML(const string &szSQL, const shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy)
+{
+  checkDB();
+
+  if (mpCache->capacity() > 0) {
+    bool bCached;
+    shared_ptr<CppSQLite3ColumnMap> pColumns;
+    sqlite3_stmt *pVM = compile(szSQL, bCached, pColumns);
+
+    if (bCached) {
+      return execDML(pVM, pColumns, pRetryPolicy.get());
+    }
+
+    // Multiple statements, left to sqlite3_exec below
+    sqlite3_finalize(pVM);
+  }
+
+  char *szError = NULL;
+
+  CppSQLite3Retrier retrier(pRetryPolicy.get(), mpLogger.get(), szSQL.c_str());
+
+  while (true) {
+    int nRet = sqlite3_exec(mpDB, szSQL.c_str(), 0, 0, &szError);
+
+    if (nRet == SQLITE_OK) {
+      return sqlite3_changes(mpDB);
+
+    } else if (retrier.retry(nRet)) {
+      // Database is locked, wait for a bit
+      sqlite3_free(szError);
+      szError = NULL;
+
+      // Give the thread holding the lock time to finish
+      retrier.wait();
+      continue;
+    } else {
+      if (nRet == SQLITE_FULL || nRet == SQLITE_IOERR || nRet == SQLITE_NOMEM || nRet == SQLITE_INTERRUPT) {
+        rollback(nRet);
+      }
+
+      throw CppSQLite3Exception(nRet, szError);
+    }
+  }
+}
+
+int CppSQLite3DB::execDML(sqlite3_stmt *pVM, const shared_ptr<CppSQLite3ColumnMap> &pColumns,
+                          const CppSQLite3RetryPolicy *pRetryPolicy)
+{
+  CppSQLite3Retrier retrier(pRetryPolicy, mpLogger.get(), sqlite3_sql(pVM));
+
+  while (true) {
+    int nRet = sqlite3_step(pVM);
+
+    if (nRet == SQLITE_ROW) {
+      // Rows are discarded, as sqlite3_exec does
+      continue;
+
+    } else if (nRet == SQLITE_DONE) {
+      int nRowsChanged = sqlite3_changes(mpDB);
+      mpCache->release(pVM, pColumns);
+      return nRowsChanged;
+
+    } else if (retrier.retry(nRet)) {
+      // Database is locked, wait for a bit
+      sqlite3_reset(pVM);
+
+      // Give the thread holding the lock time to finish
+      retrier.wait();
+      continue;
+
+    } else {
+      if (nRet == SQLITE_FULL || nRet == SQLITE_IOERR || nRet == SQLITE_NOMEM || nRet == SQLITE_INTERRUPT) {
+        rollback(nRet);
+      }
+
+      nRet = mpCache->release(pVM, pColumns);
+      const char *szError = sqlite3_errmsg(mpDB);
+      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    }
+  }
 }
 
-void CppSQLite3Query::nextRow()
+CppSQLite3Query CppSQLite3DB::execQuery(const string &szSQL) const
 {
-  checkVM();
+  return execQuery(szSQL, mpRetryPolicy);
+}
+
+CppSQLite3Query CppSQLite3DB::execQuery(const string &szSQL,
+                                        const shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy) const
+{
+  checkDB();
 
-  int tries = 0;
+  bool bCached;
+  shared_ptr<CppSQLite3ColumnMap> pColumns;
+  sqlite3_stmt *pVM = compile(szSQL, bCached, pColumns);
+
+  CppSQLite3Retrier retrier(pRetryPolicy.get(), mpLogger.get(), sqlite3_sql(pVM));
 
   while (true) {
-    int nRet = sqlite3_step(mpVM);
+    int nRet = sqlite3_step(pVM);
 
     if (nRet == SQLITE_DONE) {
       // no rows
-      mbEof = true;
-      break;
-
+      CppSQLite3Query query(mpDB, pVM, true, true, (bCached ? mpCache : nullptr), pColumns);
+      query.setRetryPolicy(pRetryPolicy);
+      query.setLogger(mpLogger);
+      return query;
     } else if (nRet == SQLITE_ROW) {
-      // more rows, nothing to do
-      break;
-
-    } else if ((nRet == SQLITE_BUSY || nRet == SQLITE_LOCKED) && tries < mnMaxRetryCount) {
-      // Database is locked, sleep for a bit
-      cout << "Database is locked." << endl;
-
-      if (nRet == SQLITE_BUSY) {
-        rollback();
-      }
+      // at least 1 row
+      CppSQLite3Query query(mpDB, pVM, false, true, (bCached ? mpCache : nullptr), pColumns);
+      query.setRetryPolicy(pRetryPolicy);
+      query.setLogger(mpLogger);
+      return query;
 
-      // Sleep fora bit to give thread holding the lock to finish
-      usleep(mnMaxRetryCount);
+    } else if (retrier.retry(nRet)) {
+      // Database is locked, wait for a bit
+      sqlite3_reset(pVM);
 
-      tries++;
+      // Give the thread holding the lock time to finish
+      retrier.wait();
       continue;
 
     } else {
-      if (nRet == SQLITE_FULL || nRet == SQLITE_IOERR || nRet == SQLITE_NOMEM || nRet == SQLITE_BUSY || nRet == SQLITE_INTERRUPT) {
-        rollback();
+      if (nRet == SQLITE_FULL || nRet == SQLITE_IOERR || nRet == SQLITE_NOMEM || nRet == SQLITE_INTERRUPT) {
+        rollback(nRet);
       }
 
-      nRet = sqlite3_finalize(mpVM);
-      mpVM = NULL;
-      const char *szError = sqlite3_errmsg(mpDB);
+      nRet = (bCached ? mpCache->release(pVM, pColumns) : sqlite3_finalize(pVM));
+      const char *szError= sqlite3_errmsg(mpDB);
       throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
     }
   }
 }
 
-void CppSQLite3Query::finalize()
+int CppSQLite3DB::execScalar(const string &szSQL) const
 {
-  if (mpVM && mbOwnVM) {
-    int nRet = sqlite3_finalize(mpVM);
-    mpVM = NULL;
-    if (nRet != SQLITE_OK) {
-      const char *szError = sqlite3_errmsg(mpDB);
-      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+  return scalar<int>(szSQL);
+}
+
+void CppSQLite3DB::checkBind(int nRet) const
+{
+  if (nRet != SQLITE_OK) {
+    throw CppSQLite3Exception(nRet, "Error binding scalar param", DONT_DELETE_MSG);
+  }
+}
+
+bool CppSQLite3DB::stepScalar(sqlite3_stmt *pVM) const
+{
+  if (sqlite3_column_count(pVM) < 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid scalar query", DONT_DELETE_MSG);
+  }
+
+  CppSQLite3Retrier retrier(mpRetryPolicy.get(), mpLogger.get(), sqlite3_sql(pVM));
+
+  while (true) {
+    int nRet = sqlite3_step(pVM);
+
+    if (nRet == SQLITE_ROW) {
+      return true;
+    } else if (nRet == SQLITE_DONE) {
+      return false;
+    } else if (retrier.retry(nRet)) {
+      // Database is locked, wait for a bit
+      sqlite3_reset(pVM);
+
+      // Give the thread holding the lock time to finish
+      retrier.wait();
+      continue;
+    }
+
+    // Before a rollback replaces the message
+    CppSQLite3Exception e(nRet, sqlite3_errmsg(mpDB), DONT_DELETE_MSG);
+
+    if (nRet == SQLITE_FULL || nRet == SQLITE_IOERR || nRet == SQLITE_NOMEM || nRet == SQLITE_INTERRUPT) {
+      rollback(nRet);
     }
+
+    throw e;
   }
 }
 
-void CppSQLite3Query::setMaxRetryCount(int nMaxRetryCount)
+void CppSQLite3DB::release(sqlite3_stmt *pVM, bool bCached, const shared_ptr<CppSQLite3ColumnMap> &pColumns) const
 {
-  mnMaxRetryCount = nMaxRetryCount;
+  if (bCached) {
+    mpCache->release(pVM, pColumns);
+  } else {
+    sqlite3_finalize(pVM);
+  }
 }
 
-void CppSQLite3Query::setRetryTimeUs(int nRetryTimeUs)
+CppSQLite3Table CppSQLite3DB::getTable(const string &szSQL) const
 {
-  mnRetryTimeUs = nRetryTimeUs;
+  checkDB();
+
+  char *szError = NULL;
+  char **paszResults = NULL;
+  int nRet;
+  int nRows = 0;
+  int nCols = 0;
+
+  nRet = sqlite3_get_table(mpDB, szSQL.c_str(), &paszResults, &nRows, &nCols, &szError);
+
+  if (nRet == SQLITE_OK) {
+    return CppSQLite3Table(paszResults, nRows, nCols);
+  } else {
+    throw CppSQLite3Exception(nRet, szError);
+  }
 }
 
-void CppSQLite3Query::rollback() const
+CppSQLite3ColumnarTable CppSQLite3DB::getColumnarTable(const string &szSQL) const
 {
-  // Returns 0 when the given database connection
-  // is in the middle of a manually-initiated transaction
-  if (sqlite3_get_autocommit(mpDB) == 0) {
-    cout << "Rolling back db transaction." << endl;
+  CppSQLite3Query q = execQuery(szSQL);
+  return CppSQLite3ColumnarTable(q);
+}
 
-    // Rollback the transaction that failed
-    char *szError = NULL;
-    int nRet2 = sqlite3_exec(mpDB, "ROLLBACK", 0, 0, &szError);
+sqlite_int64 CppSQLite3DB::lastRowId() const
+{
+  return sqlite3_last_insert_rowid(mpDB);
+}
 
-    if (nRet2 != SQLITE_OK) {
-      sqlite3_free(szError);
+bool CppSQLite3DB::isAutoCommit() const
+{
+  checkDB();
+  return (sqlite3_get_autocommit(mpDB) != 0);
+}
+
+void CppSQLite3DB::interrupt()
+{
+  checkDB();
+  sqlite3_interrupt(mpDB);
+}
+
+void CppSQLite3DB::backup(const std::string &target)
+{
+  backupOrRestore(target, true, CppSQLite3BackupOptions());
+}
+
+void CppSQLite3DB::restore(const std::string &target)
+{
+  backupOrRestore(target, false, CppSQLite3BackupOptions());
+}
+
+bool CppSQLite3DB::backup(const string &target, const CppSQLite3BackupOptions &options)
+{
+  return backupOrRestore(target, true, options);
+}
+
+bool CppSQLite3DB::restore(const string &target, const CppSQLite3BackupOptions &options)
+{
+  return backupOrRestore(target, false, options);
+}
+
+bool CppSQLite3DB::backupOrRestore(const std::string &target, bool isBackup, const CppSQLite3BackupOptions &options)
+{
+  checkDB();
+
+  // Open the file that we are going to backup to ro restore from
+  CppSQLite3DB backupDB;
+  backupDB.open(target);
+
+  if (isBackup && !options.szJournalMode.empty()) {
+    CppSQLite3Buffer pragma;
+    backupDB.execDML(pragma.format("PRAGMA journal_mode = %Q;", options.szJournalMode.c_str()));
+  }
+
+  sqlite3 *pTo   = (isBackup ? backupDB.mpDB : mpDB);
+  sqlite3 *pFrom = (isBackup ? mpDB          : backupDB.mpDB);
+
+  sqlite3_backup *pBackup = sqlite3_backup_init(pTo, "main", pFrom, "main");
+
+  if (!pBackup) {
+    int nRet = sqlite3_errcode(pTo);
+    const char *szError = sqlite3_errmsg(pTo);
+    throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+  }
+
+  int nPagesPerStep = (options.nPagesPerStep > 0 ? options.nPagesPerStep : -1);
+  int64_t nPagesCopied = 0;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  while (true) {
+    // Every step may retry as often as the policy allows
+    CppSQLite3Retrier retrier(mpRetryPolicy.get(), mpLogger.get(), NULL);
+    int nRet;
+
+    // Copy the next nPagesPerStep pages from pFrom into pTo
+    while ((nRet = sqlite3_backup_step(pBackup, nPagesPerStep)) != SQLITE_OK && nRet != SQLITE_DONE) {
+      if (!retrier.retry(nRet)) {
+        nRet = sqlite3_backup_finish(pBackup);
+        const char *szError = sqlite3_errmsg(pTo);
+        throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+      }
+
+      // Database is locked, give the thread holding the lock time to finish
+      retrier.wait();
+    }
+
+    if (nRet == SQLITE_DONE) {
+      // Backup completed successfully. pTo is already committed, so there
+      // is nothing left to cancel.
+      nRet = sqlite3_backup_finish(pBackup);
+
+      if (nRet != SQLITE_OK) {
+        const char *szError = sqlite3_errmsg(pTo);
+        throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+      }
+
+      return true;
+    }
+
+    int nRemaining = sqlite3_backup_remaining(pBackup);
+    int nTotal = sqlite3_backup_pagecount(pBackup);
+    nPagesCopied += (nPagesPerStep > 0 ? nPagesPerStep : nTotal);
+
+    if (options.fnProgress && !options.fnProgress(nRemaining, nTotal)) {
+      // pTo is only committed by the step that returns SQLITE_DONE, so
+      // finishing now leaves it as it was
+      sqlite3_backup_finish(pBackup);
+      return false;
+    }
+
+    // Copying pages completed successfully, but there is still more work to
+    // do. Pause, long enough to stay under the rate cap if there is one.
+    int64_t nDelayUs = options.nStepDelayUs;
+
+    if (options.nMaxPagesPerSecond > 0) {
+      int64_t nDueUs = nPagesCopied * 1000000 / options.nMaxPagesPerSecond;
+      int64_t nElapsedUs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+      nDelayUs = max(nDelayUs, nDueUs - nElapsedUs);
+    }
+
+    if (nDelayUs > 0) {
+      this_thread::sleep_for(chrono::microseconds(nDelayUs));
+    } else {
+      this_thread::yield();
     }
   }
 }
 
-////////////////////////////////////////////////////////////////////////////////
+void CppSQLite3DB::setBusyTimeout(int nMillisecs)
+{
+  mnBusyTimeoutMs = nMillisecs;
+  sqlite3_busy_timeout(mpDB, mnBusyTimeoutMs);
+}
 
-CppSQLite3Table::CppSQLite3Table()
-  : mnRows(0),
-    mnCols(0),
-    mnCurrentRow(0),
-    mpaszResults(NULL)
+void CppSQLite3DB::setMaxRetryCount(int nMaxRetryCount)
 {
+  mnMaxRetryCount = nMaxRetryCount;
+  mpRetryPolicy = make_shared<CppSQLite3FixedRetry>(mnMaxRetryCount, mnRetryTimeUs);
 }
 
-CppSQLite3Table::CppSQLite3Table(const CppSQLite3Table &rTable)
+void CppSQLite3DB::setRetryTimeUs(int nRetryTimeUs)
 {
-  mpaszResults = rTable.mpaszResults;
-  // Only one object can own the results
-  const_cast<CppSQLite3Table&>(rTable).mpaszResults = NULL;
-  mnRows = rTable.mnRows;
-  mnCols = rTable.mnCols;
-  mnCurrentRow = rTable.mnCurrentRow;
+  mnRetryTimeUs = nRetryTimeUs;
+  mpRetryPolicy = make_shared<CppSQLite3FixedRetry>(mnMaxRetryCount, mnRetryTimeUs);
 }
 
-CppSQLite3Table::CppSQLite3Table(char **paszResults, int nRows, int nCols)
-  : mnRows(nRows),
-    mnCols(nCols),
-    mnCurrentRow(0),
-    mpaszResults(paszResults)
+void CppSQLite3DB::setRetryPolicy(const shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy)
 {
+  mpRetryPolicy = pRetryPolicy;
 }
 
-CppSQLite3Table::~CppSQLite3Table()
+void CppSQLite3DB::setLogger(const shared_ptr<CppSQLite3Logger> &pLogger)
 {
-  try {
-    finalize();
-  } catch (...) {
+  mpLogger = pLogger;
+}
+
+void CppSQLite3DB::setProfiler(const shared_ptr<CppSQLite3Profiler> &pProfiler)
+{
+  mpProfiler = pProfiler;
+
+  if (mpDB) {
+    installProfiler();
   }
 }
 
-CppSQLite3Table &CppSQLite3Table::operator=(const CppSQLite3Table &rTable)
+void CppSQLite3DB::installProfiler()
 {
-  try {
-    finalize();
-  } catch (...) {
+  shared_ptr<CppSQLite3ProfilerHook> pHook;
+
+  if (mpProfiler) {
+    pHook = make_shared<CppSQLite3ProfilerHook>(mpProfiler);
+    sqlite3_trace_v2(mpDB, SQLITE_TRACE_STMT | SQLITE_TRACE_ROW | SQLITE_TRACE_PROFILE,
+                     CppSQLite3ProfilerHook::trace, pHook.get());
+  } else {
+    sqlite3_trace_v2(mpDB, 0, NULL, NULL);
+  }
+
+  // Only released once SQLite no longer holds the old one
+  mpProfilerHook = pHook;
+}
+
+void CppSQLite3DB::setStatementCacheSize(int nStatements)
+{
+  mnStatementCacheSize = nStatements;
+
+  if (mpCache) {
+    mpCache->setCapacity(mnStatementCacheSize);
   }
-  mpaszResults = rTable.mpaszResults;
-  // Only one object can own the results
-  const_cast<CppSQLite3Table&>(rTable).mpaszResults = NULL;
-  mnRows = rTable.mnRows;
-  mnCols = rTable.mnCols;
-  mnCurrentRow = rTable.mnCurrentRow;
-  return *this;
 }
 
-void CppSQLite3Table::finalize()
-{
-  if (mpaszResults) {
-    sqlite3_free_table(mpaszResults);
-    mpaszResults = NULL;
+void CppSQLite3DB::clearStatementCache()
+{
+  if (mpCache) {
+    mpCache->clear();
+  }
+}
+
+const CppSQLite3StatementCache &CppSQLite3DB::statementCache() const
+{
+  checkDB();
+  return *mpCache;
+}
+
+sqlite3_stmt *CppSQLite3DB::compile(const string &szSQL, bool &bCached,
+                                    shared_ptr<CppSQLite3ColumnMap> &pColumns) const
+{
+  checkDB();
+
+  sqlite3_stmt *pVM = mpCache->acquire(szSQL, pColumns);
+
+  if (pVM) {
+    bCached = true;
+    return pVM;
+  }
+
+  const char *szTail = NULL;
+
+  int nRet = sqlite3_prepare_v2(mpDB, szSQL.c_str(), static_cast<int>(szSQL.size()) + 1, &pVM, &szTail);
+
+  if (nRet != SQLITE_OK) {
+    const char *szError = sqlite3_errmsg(mpDB);
+    throw CppSQLite3Exception(nRet, szError, false);
+  }
+
+  bCached = mpCache->cacheable(szSQL, pVM);
+  return pVM;
+}
+
+void CppSQLite3DB::rollback(int nErrCode) const
+{
+  // Returns 0 when the given database connection
+  // is in the middle of a manually-initiated transaction
+  if (sqlite3_get_autocommit(mpDB) == 0) {
+    logEvent(mpLogger.get(), CppSQLite3LogEvent::LEVEL_WARNING, nErrCode, "Rolling back db transaction");
+
+    // Rollback the transaction that failed
+    char *szError = NULL;
+    int nRet2 = sqlite3_exec(mpDB, "ROLLBACK", 0, 0, &szError);
+
+    if (nRet2 != SQLITE_OK) {
+      sqlite3_free(szError);
+    }
   }
 }
 
-int CppSQLite3Table::numFields() const
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Transaction::CppSQLite3Transaction(CppSQLite3DB &db, Mode nMode)
+  : mDB(db),
+    mbActive(false)
 {
-  checkResults();
-  return mnCols;
+  mDB.execDML(nMode == IMMEDIATE ? "BEGIN IMMEDIATE;" : nMode == EXCLUSIVE ? "BEGIN EXCLUSIVE;" : "BEGIN;");
+  mbActive = true;
 }
 
-int CppSQLite3Table::numRows() const
+CppSQLite3Transaction::~CppSQLite3Transaction() noexcept
 {
-  checkResults();
-  return mnRows;
+  if (mbActive) {
+    try {
+      logEvent(mDB.logger().get(), CppSQLite3LogEvent::LEVEL_INFO, SQLITE_OK, "Rolling back uncommitted transaction");
+      rollback();
+    } catch (...) {
+    }
+  }
 }
 
-string CppSQLite3Table::fieldValue(int nField) const
+void CppSQLite3Transaction::commit()
 {
-  checkResults();
-
-  if (nField < 0 || nField > mnCols - 1) {
-    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+  if (!mbActive) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Transaction not active", DONT_DELETE_MSG);
   }
 
-  int nIndex = (mnCurrentRow * mnCols) + mnCols + nField;
-  return mpaszResults[nIndex];
+  mDB.execDML("COMMIT;");
+  mbActive = false;
 }
 
-string CppSQLite3Table::fieldValue(const string &szField) const
+void CppSQLite3Transaction::rollback()
 {
-  checkResults();
-
-  if (!szField.empty()) {
-    for (int nField = 0; nField < mnCols; nField++) {
-      if (szField == string(mpaszResults[nField])) {
-        int nIndex = (mnCurrentRow * mnCols) + mnCols + nField;
-        return mpaszResults[nIndex];
-      }
-    }
+  if (!mbActive) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Transaction not active", DONT_DELETE_MSG);
   }
 
-  throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field name requested", DONT_DELETE_MSG);
-}
+  mbActive = false;
 
-int CppSQLite3Table::getIntField(int nField, int nNullValue) const
-{
-  if (fieldIsNull(nField)) {
-    return nNullValue;
-  } else {
-    return atoi(fieldValue(nField).c_str());
+  // Some errors roll the transaction back by themselves
+  if (!mDB.isAutoCommit()) {
+    mDB.execDML("ROLLBACK;");
   }
 }
 
-int CppSQLite3Table::getIntField(const string &szField, int nNullValue) const
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Savepoint::CppSQLite3Savepoint(CppSQLite3DB &db, const string &szName)
+  : mDB(db),
+    mszName(szName),
+    mbActive(false)
 {
-  if (fieldIsNull(szField)) {
-    return nNullValue;
-  } else {
-    return atoi(fieldValue(szField).c_str());
-  }
+  CppSQLite3Buffer bufSQL;
+  mDB.execDML(bufSQL.format("SAVEPOINT \"%w\";", mszName.c_str()));
+  mbActive = true;
 }
 
-double CppSQLite3Table::getFloatField(int nField, double fNullValue) const
+CppSQLite3Savepoint::~CppSQLite3Savepoint() noexcept
 {
-  if (fieldIsNull(nField)) {
-    return fNullValue;
-  } else {
-    return atof(fieldValue(nField).c_str());
+  if (mbActive) {
+    try {
+      logEvent(mDB.logger().get(), CppSQLite3LogEvent::LEVEL_INFO, SQLITE_OK, "Rolling back to unreleased savepoint");
+      rollback();
+    } catch (...) {
+    }
   }
 }
 
-double CppSQLite3Table::getFloatField(const string &szField, double fNullValue) const
+void CppSQLite3Savepoint::release()
 {
-  if (fieldIsNull(szField)) {
-    return fNullValue;
-  } else {
-    return atof(fieldValue(szField).c_str());
+  if (!mbActive) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Savepoint not active", DONT_DELETE_MSG);
   }
+
+  CppSQLite3Buffer bufSQL;
+  mDB.execDML(bufSQL.format("RELEASE \"%w\";", mszName.c_str()));
+  mbActive = false;
 }
 
-const string CppSQLite3Table::getStringField(int nField, const string &szNullValue) const
+void CppSQLite3Savepoint::rollback()
 {
-  if (fieldIsNull(nField)) {
-    return szNullValue;
-  } else {
-    return fieldValue(nField);
+  if (!mbActive) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Savepoint not active", DONT_DELETE_MSG);
   }
-}
 
-const string CppSQLite3Table::getStringField(const string &szField, const string &szNullValue) const
-{
-  if (fieldIsNull(szField)) {
-    return szNullValue;
-  } else {
-    return fieldValue(szField);
+  mbActive = false;
+
+  // Some errors roll the whole transaction back, savepoints included
+  if (!mDB.isAutoCommit()) {
+    CppSQLite3Buffer bufSQL;
+    mDB.execDML(bufSQL.format("ROLLBACK TO \"%w\";", mszName.c_str()));
+    mDB.execDML(bufSQL.format("RELEASE \"%w\";", mszName.c_str()));
   }
 }
 
-bool CppSQLite3Table::fieldIsNull(int nField) const
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3BulkInserter::CppSQLite3BulkInserter(CppSQLite3DB &db, const string &szSQL, int nBatchSize)
+  : mDB(db),
+    mStatement(db.compileStatement(szSQL)),
+    mnBatchSize(nBatchSize > 0 ? nBatchSize : 1),
+    mnBatchRows(0),
+    mbOwnTransaction(false),
+    mnRows(0),
+    mStart(chrono::steady_clock::now()),
+    mLastFlush(mStart)
 {
-  checkResults();
-  return fieldValue(nField).empty();
 }
 
-bool CppSQLite3Table::fieldIsNull(const string &szField) const
+CppSQLite3BulkInserter::~CppSQLite3BulkInserter()
 {
-  checkResults();
-  return fieldValue(szField).empty();
+  try {
+    flush();
+  } catch (...) {
+  }
 }
 
-string CppSQLite3Table::fieldName(int nCol)
+void CppSQLite3BulkInserter::insert()
 {
-  checkResults();
+  if (mnBatchRows == 0) {
+    mbOwnTransaction = mDB.isAutoCommit();
 
-  if (nCol < 0 || nCol > mnCols - 1) {
-    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid field index requested", DONT_DELETE_MSG);
+    if (mbOwnTransaction) {
+      mDB.execDML("begin transaction;");
+    }
   }
 
-  return mpaszResults[nCol];
+  try {
+    mStatement.execDML();
+  } catch (...) {
+    mStatement.clearBindings();
+    rollback();
+    throw;
+  }
+
+  mStatement.clearBindings();
+  mnBatchRows++;
+  mnRows++;
+
+  if (mnBatchRows >= mnBatchSize) {
+    flush();
+  }
 }
 
-void CppSQLite3Table::setRow(int nRow)
+void CppSQLite3BulkInserter::flush()
 {
-  checkResults();
+  if (mnBatchRows == 0) {
+    return;
+  }
 
-  if (nRow < 0 || nRow > mnRows - 1) {
-    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid row index requested", DONT_DELETE_MSG);
+  if (mbOwnTransaction) {
+    try {
+      mDB.execDML("commit transaction;");
+    } catch (...) {
+      rollback();
+      throw;
+    }
   }
 
-  mnCurrentRow = nRow;
+  mnBatchRows = 0;
+  mLastFlush = chrono::steady_clock::now();
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-CppSQLite3Statement::CppSQLite3Statement()
-  : mpDB(NULL),
-    mpVM(NULL),
-    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
-    mnRetryTimeUs(5000)     // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+void CppSQLite3BulkInserter::rollback()
 {
+  // Rows of an enclosing transaction are the caller's to roll back
+  if (mbOwnTransaction) {
+    if (!mDB.isAutoCommit()) {
+      try {
+        mDB.execDML("rollback transaction;");
+      } catch (...) {
+      }
+    }
+
+    mnRows -= mnBatchRows;
+  }
+
+  mnBatchRows = 0;
 }
 
-CppSQLite3Statement::CppSQLite3Statement(const CppSQLite3Statement &rStatement)
+double CppSQLite3BulkInserter::elapsedSeconds() const
 {
-  mpDB = rStatement.mpDB;
-  mpVM = rStatement.mpVM;
-  mnMaxRetryCount = rStatement.mnMaxRetryCount;
-  mnRetryTimeUs = rStatement.mnRetryTimeUs;
-  // Only one object can own VM
-  const_cast<CppSQLite3Statement&>(rStatement).mpVM = NULL;
+  chrono::steady_clock::time_point end = (mnBatchRows > 0 ? chrono::steady_clock::now() : mLastFlush);
+  return chrono::duration<double>(end - mStart).count();
 }
 
-CppSQLite3Statement::CppSQLite3Statement(sqlite3 *pDB, sqlite3_stmt *pVM)
-  : mpDB(pDB),
-    mpVM(pVM),
-    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
-    mnRetryTimeUs(5000)     // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+double CppSQLite3BulkInserter::rowsPerSecond() const
 {
+  double dSeconds = elapsedSeconds();
+  return (dSeconds > 0 ? mnRows / dSeconds : 0.0);
 }
 
-CppSQLite3Statement::~CppSQLite3Statement()
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3Pool::Lease::Lease()
+  : mpPool(NULL),
+    mpDB(NULL),
+    mbWriter(false)
 {
-  try {
-    finalize();
-  } catch (...) {
-  }
 }
 
-CppSQLite3Statement &CppSQLite3Statement::operator=(const CppSQLite3Statement &rStatement)
+CppSQLite3Pool::Lease::Lease(CppSQLite3Pool *pPool, CppSQLite3DB *pDB, bool bWriter)
+  : mpPool(pPool),
+    mpDB(pDB),
+    mbWriter(bWriter),
+    mLeased(chrono::steady_clock::now())
 {
-  mpDB = rStatement.mpDB;
-  mpVM = rStatement.mpVM;
-  // Only one object can own VM
-  const_cast<CppSQLite3Statement&>(rStatement).mpVM = NULL;
-  return *this;
 }
 
-int CppSQLite3Statement::execDML() const
+CppSQLite3Pool::Lease::Lease(Lease &&rLease)
+  : mpPool(rLease.mpPool),
+    mpDB(rLease.mpDB),
+    mbWriter(rLease.mbWriter),
+    mLeased(rLease.mLeased)
 {
-  checkDB();
-  checkVM();
-
-  const char *szError = NULL;
-
-  int nRet = sqlite3_step(mpVM);
+  rLease.mpPool = NULL;
+  rLease.mpDB = NULL;
+}
 
-  if (nRet == SQLITE_DONE) {
-    int nRowsChanged = sqlite3_changes(mpDB);
+CppSQLite3Pool::Lease &CppSQLite3Pool::Lease::operator=(Lease &&rLease)
+{
+  if (this != &rLease) {
+    release();
+    mpPool = rLease.mpPool;
+    mpDB = rLease.mpDB;
+    mbWriter = rLease.mbWriter;
+    mLeased = rLease.mLeased;
+    rLease.mpPool = NULL;
+    rLease.mpDB = NULL;
+  }
 
-    nRet = sqlite3_reset(mpVM);
+  return *this;
+}
 
-    if (nRet != SQLITE_OK) {
-      szError = sqlite3_errmsg(mpDB);
-      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
-    }
+CppSQLite3Pool::Lease::~Lease()
+{
+  release();
+}
 
-    return nRowsChanged;
-  } else {
-    nRet = sqlite3_reset(mpVM);
-    szError = sqlite3_errmsg(mpDB);
-    throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+void CppSQLite3Pool::Lease::release()
+{
+  if (mpPool) {
+    mpPool->release(mpDB, mbWriter, mLeased);
+    mpPool = NULL;
+    mpDB = NULL;
   }
 }
 
-CppSQLite3Query CppSQLite3Statement::execQuery() const
+CppSQLite3Pool::CppSQLite3Pool(const string &szFile, int nReaders, const Setup &fnSetup)
+  : mOpened(chrono::steady_clock::now())
 {
-  checkDB();
-  checkVM();
-
-  int tries = 0;
-
-  while (true) {
-    int nRet = sqlite3_step(mpVM);
-
-    if (nRet == SQLITE_DONE) {
-      // no rows
-      CppSQLite3Query query(mpDB, mpVM, true, false);
-      query.setMaxRetryCount(mnMaxRetryCount);
-      query.setRetryTimeUs(mnRetryTimeUs);
-      return query;
-    } else if (nRet == SQLITE_ROW) {
-      // at least 1 row
-      CppSQLite3Query query(mpDB, mpVM, false, false);
-      query.setMaxRetryCount(mnMaxRetryCount);
-      query.setRetryTimeUs(mnRetryTimeUs);
-      return query;
-
-    } else if ((nRet == SQLITE_BUSY || nRet == SQLITE_LOCKED) && tries < mnMaxRetryCount) {
-      // Database is locked, sleep for a bit
-      cout << "Database is locked." << endl;
+  for (Role *pRole : { &mWriter, &mReaders }) {
+    pRole->nConnections = 0;
+    pRole->nInUse = 0;
+    pRole->nLeases = 0;
+    pRole->nWaits = 0;
+    pRole->nWaitUs = 0;
+    pRole->nMaxWaitUs = 0;
+    pRole->nBusyUs = 0;
+    pRole->nLeasedAtUs = 0;
+  }
 
-      // Sleep fora bit to give thread holding the lock to finish
-      usleep(mnRetryTimeUs);
+  // The writer goes first, so that the switch to WAL is made before any
+  // reader opens the file
+  for (int i = 0; i <= max(nReaders, 0); i++) {
+    bool bWriter = (i == 0);
 
-      tries++;
-      continue;
+    unique_ptr<CppSQLite3DB> pDB(new CppSQLite3DB());
+    pDB->open(szFile);
 
+    if (bWriter) {
+      pDB->execQuery("PRAGMA journal_mode = WAL");
     } else {
-      nRet = sqlite3_reset(mpVM);
-      const char *szError = sqlite3_errmsg(mpDB);
-      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+      pDB->execDML("PRAGMA query_only = 1");
     }
-  }
-}
 
-void CppSQLite3Statement::bind(int nParam, const string &szValue)
-{
-  checkVM();
-  int nRes = sqlite3_bind_text(mpVM, nParam, szValue.c_str(), -1, SQLITE_TRANSIENT);
+    if (fnSetup) {
+      fnSetup(*pDB, bWriter);
+    }
 
-  if (nRes != SQLITE_OK) {
-    throw CppSQLite3Exception(nRes, "Error binding string param", DONT_DELETE_MSG);
+    Role &role = (bWriter ? mWriter : mReaders);
+    role.idle.push_back(pDB.get());
+    role.nConnections++;
+    mConnections.push_back(move(pDB));
   }
 }
 
-void CppSQLite3Statement::bind(int nParam, const int nValue)
+CppSQLite3Pool::~CppSQLite3Pool()
 {
-  checkVM();
-  int nRes = sqlite3_bind_int(mpVM, nParam, nValue);
-
-  if (nRes != SQLITE_OK) {
-    throw CppSQLite3Exception(nRes, "Error binding int param", DONT_DELETE_MSG);
-  }
 }
 
-void CppSQLite3Statement::bind(int nParam, const int64_t nValue)
+CppSQLite3Pool::Lease CppSQLite3Pool::writer(int64_t nTimeoutUs)
 {
-  checkVM();
-  int nRes = sqlite3_bind_int64(mpVM, nParam, nValue);
-
-  if (nRes != SQLITE_OK) {
-    throw CppSQLite3Exception(nRes, "Error binding int64 param", DONT_DELETE_MSG);
-  }
+  return acquire(mWriter, true, nTimeoutUs);
 }
 
-void CppSQLite3Statement::bind(int nParam, const double dValue)
+CppSQLite3Pool::Lease CppSQLite3Pool::reader(int64_t nTimeoutUs)
 {
-  checkVM();
-  int nRes = sqlite3_bind_double(mpVM, nParam, dValue);
-
-  if (nRes != SQLITE_OK) {
-    throw CppSQLite3Exception(nRes, "Error binding double param", DONT_DELETE_MSG);
+  if (mReaders.nConnections == 0) {
+    return acquire(mWriter, true, nTimeoutUs);
   }
+
+  return acquire(mReaders, false, nTimeoutUs);
 }
 
-void CppSQLite3Statement::bind(int nParam, const unsigned char *blobValue, int nLen)
+CppSQLite3Pool::Lease CppSQLite3Pool::acquire(Role &role, bool bWriter, int64_t nTimeoutUs)
 {
-  checkVM();
-  int nRes = sqlite3_bind_blob(mpVM, nParam, (const void*)blobValue, nLen, SQLITE_TRANSIENT);
+  unique_lock<mutex> lock(mMutex);
 
-  if (nRes != SQLITE_OK) {
-    throw CppSQLite3Exception(nRes, "Error binding blob param", DONT_DELETE_MSG);
-  }
-}
+  if (role.idle.empty()) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool bFree = true;
 
-void CppSQLite3Statement::bindNull(int nParam)
-{
-  checkVM();
-  int nRes = sqlite3_bind_null(mpVM, nParam);
+    if (nTimeoutUs < 0) {
+      role.cvFree.wait(lock, [&role] { return !role.idle.empty(); });
+    } else {
+      bFree = role.cvFree.wait_for(lock, chrono::microseconds(nTimeoutUs),
+                                   [&role] { return !role.idle.empty(); });
+    }
 
-  if (nRes != SQLITE_OK) {
-    throw CppSQLite3Exception(nRes, "Error binding NULL param", DONT_DELETE_MSG);
+    int64_t nWaitUs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    role.nWaits++;
+    role.nWaitUs += nWaitUs;
+    role.nMaxWaitUs = max(role.nMaxWaitUs, nWaitUs);
+
+    if (!bFree) {
+      throw CppSQLite3Exception(CPPSQLITE_ERROR, "Timed out waiting for a pooled connection", DONT_DELETE_MSG);
+    }
   }
+
+  // Most recently returned first, as its pages are likeliest to be cached
+  CppSQLite3DB *pDB = role.idle.back();
+  role.idle.pop_back();
+
+  Lease lease(this, pDB, bWriter);
+  role.nInUse++;
+  role.nLeases++;
+  role.nLeasedAtUs += sinceOpenUs(lease.mLeased);
+  return lease;
 }
 
-void CppSQLite3Statement::reset()
+void CppSQLite3Pool::release(CppSQLite3DB *pDB, bool bWriter, chrono::steady_clock::time_point leased)
 {
-  if (mpVM) {
-    int nRet = sqlite3_reset(mpVM);
+  Role &role = (bWriter ? mWriter : mReaders);
+  int64_t nNowUs = sinceOpenUs(chrono::steady_clock::now());
+  int64_t nLeasedAtUs = sinceOpenUs(leased);
 
-    if (nRet != SQLITE_OK) {
-      const char *szError = sqlite3_errmsg(mpDB);
-      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
-    }
+  {
+    lock_guard<mutex> lock(mMutex);
+    role.idle.push_back(pDB);
+    role.nInUse--;
+    role.nBusyUs += nNowUs - nLeasedAtUs;
+    role.nLeasedAtUs -= nLeasedAtUs;
   }
+
+  role.cvFree.notify_one();
 }
 
-void CppSQLite3Statement::finalize()
+CppSQLite3PoolStats CppSQLite3Pool::writerStats() const
 {
-  if (mpVM) {
-    int nRet = sqlite3_finalize(mpVM);
-    mpVM = NULL;
+  return stats(mWriter);
+}
 
-    if (nRet != SQLITE_OK) {
-      const char *szError = sqlite3_errmsg(mpDB);
-      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
-    }
-  }
+CppSQLite3PoolStats CppSQLite3Pool::readerStats() const
+{
+  return stats(mReaders);
 }
 
-void CppSQLite3Statement::setMaxRetryCount(int nMaxRetryCount)
+CppSQLite3PoolStats CppSQLite3Pool::stats(const Role &role) const
 {
-  mnMaxRetryCount = nMaxRetryCount;
+  int64_t nNowUs = sinceOpenUs(chrono::steady_clock::now());
+
+  lock_guard<mutex> lock(mMutex);
+
+  CppSQLite3PoolStats stats;
+  stats.nConnections = role.nConnections;
+  stats.nInUse = role.nInUse;
+  stats.nLeases = role.nLeases;
+  stats.nWaits = role.nWaits;
+  stats.nWaitUs = role.nWaitUs;
+  stats.nMaxWaitUs = role.nMaxWaitUs;
+
+  // Leases still out count up to now
+  int64_t nBusyUs = role.nBusyUs + role.nInUse * nNowUs - role.nLeasedAtUs;
+  int64_t nTotalUs = nNowUs * role.nConnections;
+  stats.fUtilization = (nTotalUs > 0 ? double(nBusyUs) / nTotalUs : 0.0);
+  return stats;
 }
 
-void CppSQLite3Statement::setRetryTimeUs(int nRetryTimeUs)
+int64_t CppSQLite3Pool::sinceOpenUs(chrono::steady_clock::time_point when) const
 {
-  mnRetryTimeUs = nRetryTimeUs;
+  return chrono::duration_cast<chrono::microseconds>(when - mOpened).count();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-CppSQLite3DB::CppSQLite3DB()
-  : mpDB(NULL),
-    mnBusyTimeoutMs(1000), // 1 seconds
-    mnMaxRetryCount(5),     // Retry 5 times on SQLITE_LOCKED
-    mnRetryTimeUs(5000)     // Sleep for 0.005 seconds before retrying on SQLITE_LOCKED
+CppSQLite3WriteQueueOptions::CppSQLite3WriteQueueOptions()
+  : nMaxBatchRequests(1000),
+    nMaxBatchBytes(16 * 1024 * 1024),
+    nMaxDelayUs(0)
+{
+}
+
+CppSQLite3WriteQueue::CppSQLite3WriteQueue(const string &szFile, const CppSQLite3WriteQueueOptions &options,
+                                           const Setup &fnSetup)
+  : mOptions(options),
+    mpHead(&mStub),
+    mpTail(&mStub),
+    mnQueued(0),
+    mnSubmitting(0),
+    mbClosed(false),
+    mbSleeping(false),
+    mnCommitted(0),
+    mnFailed(0),
+    mnBatches(0),
+    mnLargestBatch(0)
 {
+  mStub.pNext.store(NULL, memory_order_relaxed);
+
+  mDB.open(szFile);
+  mDB.execQuery("PRAGMA journal_mode = WAL");
+
+  if (fnSetup) {
+    fnSetup(mDB);
+  }
+
+  mThread = thread(&CppSQLite3WriteQueue::run, this);
 }
 
-CppSQLite3DB::CppSQLite3DB(const CppSQLite3DB &db)
-  : mpDB(db.mpDB),
-    mnBusyTimeoutMs(db.mnBusyTimeoutMs),
-    mnMaxRetryCount(db.mnMaxRetryCount),
-    mnRetryTimeUs(db.mnRetryTimeUs)
+CppSQLite3WriteQueue::~CppSQLite3WriteQueue()
 {
+  close();
 }
 
-CppSQLite3DB::~CppSQLite3DB()
+future<int> CppSQLite3WriteQueue::submit(Write fnWrite, size_t nBytes)
 {
-  close();
+  Request *pRequest = new Request();
+  pRequest->fnWrite = move(fnWrite);
+  pRequest->nBytes = nBytes;
+  future<int> result = pRequest->result.get_future();
+
+  // Pairs with close() setting mbClosed before it checks mnSubmitting: either
+  // this sees the queue closed, or close() waits for the push below before
+  // failing what is left in the queue
+  mnSubmitting.fetch_add(1, memory_order_seq_cst);
+
+  if (mbClosed.load(memory_order_seq_cst)) {
+    mnSubmitting.fetch_sub(1, memory_order_release);
+    delete pRequest;
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Write queue closed", DONT_DELETE_MSG);
+  }
+
+  push(pRequest);
+
+  // Pairs with the writer thread setting mbSleeping before it checks
+  // mnQueued, so that one of the two sees the other
+  mnQueued.fetch_add(1, memory_order_seq_cst);
+  mnSubmitting.fetch_sub(1, memory_order_release);
+
+  if (mbSleeping.load(memory_order_seq_cst)) {
+    lock_guard<mutex> lock(mMutex);
+    mWake.notify_one();
+  }
+
+  return result;
 }
 
-CppSQLite3DB &CppSQLite3DB::operator=(const CppSQLite3DB &db)
+future<int> CppSQLite3WriteQueue::submit(const string &szSQL, Bind fnBind)
 {
-  mpDB = db.mpDB;
-  mnBusyTimeoutMs = 1000; // 1 seconds
-  return *this;
+  return submit([szSQL, fnBind](CppSQLite3DB &db) {
+                  CppSQLite3Statement stmt = db.compileStatement(szSQL);
+
+                  if (fnBind) {
+                    fnBind(stmt);
+                  }
+
+                  return stmt.execDML();
+                },
+                szSQL.size());
 }
 
-void CppSQLite3DB::open(const string &szFile)
+void CppSQLite3WriteQueue::close()
 {
-  int nRet = sqlite3_open_v2(szFile.c_str(), &mpDB, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (mbClosed.exchange(true)) {
+    return;
+  }
 
-  if (nRet != SQLITE_OK) {
-    const char *szError = sqlite3_errmsg(mpDB);
+  {
+    lock_guard<mutex> lock(mMutex);
+    mWake.notify_one();
+  }
 
-    close();
+  mThread.join();
 
-    throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+  // Let submits that got past the closed check finish pushing
+  while (mnSubmitting.load(memory_order_acquire) > 0) {
+    this_thread::yield();
   }
 
-	// Enable extended error codes
-	sqlite3_extended_result_codes(mpDB, 1);
+  // Requests that slipped in as the queue closed
+  while (mnQueued.load() > 0) {
+    Request *pRequest = pop();
 
-  setBusyTimeout(mnBusyTimeoutMs);
-}
+    if (!pRequest) {
+      this_thread::yield();
+      continue;
+    }
 
-void CppSQLite3DB::close()
-{
-  if (mpDB) {
-    sqlite3_close_v2(mpDB);
-    mpDB = NULL;
+    mnQueued.fetch_sub(1);
+    pRequest->result.set_exception(make_exception_ptr(
+      CppSQLite3Exception(CPPSQLITE_ERROR, "Write queue closed", DONT_DELETE_MSG)));
+    mnFailed++;
+    delete pRequest;
   }
+
+  mDB.close();
 }
 
-CppSQLite3Statement CppSQLite3DB::compileStatement(const string &szSQL) const
+CppSQLite3WriteQueueStats CppSQLite3WriteQueue::stats() const
 {
-  checkDB();
-
-  sqlite3_stmt *pVM = compile(szSQL);
-  return CppSQLite3Statement(mpDB, pVM);
+  CppSQLite3WriteQueueStats stats;
+  stats.nCommitted = mnCommitted.load();
+  stats.nFailed = mnFailed.load();
+  stats.nBatches = mnBatches.load();
+  stats.nLargestBatch = mnLargestBatch.load();
+  return stats;
 }
 
-bool CppSQLite3DB::tableExists(const string &szTable) const
+void CppSQLite3WriteQueue::push(Request *pRequest)
 {
-  ostringstream sql;
-  sql << "select count(*) from sqlite_master where type='table' and name='" << szTable << "'";
-  int nRet = execScalar(sql.str());
-  return (nRet > 0);
+  pRequest->pNext.store(NULL, memory_order_relaxed);
+  Request *pPrev = mpHead.exchange(pRequest, memory_order_acq_rel);
+  // Until this store the request is queued but unreachable from mpTail
+  pPrev->pNext.store(pRequest, memory_order_release);
 }
 
-int CppSQLite3DB::execDML(const string &szSQL)
+CppSQLite3WriteQueue::Request *CppSQLite3WriteQueue::pop()
 {
-  checkDB();
+  Request *pTail = mpTail;
+  Request *pNext = pTail->pNext.load(memory_order_acquire);
 
-  char *szError = NULL;
+  if (pTail == &mStub) {
+    if (!pNext) {
+      return NULL;
+    }
 
-  int tries = 0;
+    mpTail = pNext;
+    pTail = pNext;
+    pNext = pNext->pNext.load(memory_order_acquire);
+  }
 
-  while (true) {
-    int nRet = sqlite3_exec(mpDB, szSQL.c_str(), 0, 0, &szError);
+  if (pNext) {
+    mpTail = pNext;
+    return pTail;
+  }
 
-    if (nRet == SQLITE_OK) {
-      return sqlite3_changes(mpDB);
+  if (pTail != mpHead.load(memory_order_acquire)) {
+    // A push is half done
+    return NULL;
+  }
 
-    } else if ((nRet == SQLITE_BUSY || nRet == SQLITE_LOCKED) && tries < mnMaxRetryCount) {
-      // Database is locked, sleep for a bit
-      cout << "Database is locked." << endl;
+  // pTail is the last request, and can only be taken once the stub is
+  // behind it
+  push(&mStub);
+  pNext = pTail->pNext.load(memory_order_acquire);
 
-      sqlite3_free(szError);
+  if (pNext) {
+    mpTail = pNext;
+    return pTail;
+  }
 
-      if (nRet == SQLITE_BUSY) {
-        rollback();
-      }
+  return NULL;
+}
 
-      // Sleep fora bit to give thread holding the lock to finish
-      usleep(mnRetryTimeUs);
+bool CppSQLite3WriteQueue::waitForRequest(const chrono::steady_clock::time_point *pDeadline)
+{
+  mbSleeping.store(true, memory_order_seq_cst);
 
-      tries++;
-      continue;
-    } else {
-      if (nRet == SQLITE_FULL || nRet == SQLITE_IOERR || nRet == SQLITE_NOMEM || nRet == SQLITE_BUSY || nRet == SQLITE_INTERRUPT) {
-        rollback();
-      }
+  {
+    unique_lock<mutex> lock(mMutex);
+    auto ready = [this]() { return mnQueued.load(memory_order_seq_cst) > 0 || mbClosed.load(); };
 
-      throw CppSQLite3Exception(nRet, szError);
+    if (pDeadline) {
+      mWake.wait_until(lock, *pDeadline, ready);
+    } else {
+      mWake.wait(lock, ready);
     }
   }
+
+  mbSleeping.store(false, memory_order_relaxed);
+  return mnQueued.load() > 0;
 }
 
-CppSQLite3Query CppSQLite3DB::execQuery(const std::string &szSQL) const
+void CppSQLite3WriteQueue::run()
 {
-  checkDB();
-
-  sqlite3_stmt *pVM = compile(szSQL);
-
-  int tries = 0;
-
   while (true) {
-    int nRet = sqlite3_step(pVM);
+    Request *pRequest = pop();
+
+    if (pRequest) {
+      mnQueued.fetch_sub(1);
+      runBatch(pRequest);
+    } else if (mnQueued.load() > 0) {
+      this_thread::yield();
+    } else if (mbClosed.load()) {
+      break;
+    } else {
+      waitForRequest(NULL);
+    }
+  }
+}
 
-    if (nRet == SQLITE_DONE) {
-      // no rows
-      CppSQLite3Query query(mpDB, pVM, true);
-      query.setMaxRetryCount(mnMaxRetryCount);
-      query.setRetryTimeUs(mnRetryTimeUs);
-      return query;
-    } else if (nRet == SQLITE_ROW) {
-      // at least 1 row
-      CppSQLite3Query query(mpDB, pVM, false);
-      query.setMaxRetryCount(mnMaxRetryCount);
-      query.setRetryTimeUs(mnRetryTimeUs);
-      return query;
+void CppSQLite3WriteQueue::runBatch(Request *pFirst)
+{
+  // Requests whose writes are in the open transaction, with their results
+  vector<pair<Request*, int> > done;
 
-    } else if ((nRet == SQLITE_BUSY || nRet == SQLITE_LOCKED) && tries < mnMaxRetryCount) {
-      // Database is locked, sleep for a bit
-      cout << "Database is locked." << endl;
+  auto fail = [this](Request *pRequest, const exception_ptr &error) {
+    pRequest->result.set_exception(error);
+    mnFailed++;
+    delete pRequest;
+  };
 
-      if (nRet == SQLITE_BUSY) {
-        rollback();
+  try {
+    CppSQLite3Transaction transaction(mDB, CppSQLite3Transaction::IMMEDIATE);
+
+    Request *pRequest = pFirst;
+    pFirst = NULL;
+    size_t nRequests = 0;
+    size_t nBytes = 0;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::microseconds(mOptions.nMaxDelayUs);
+
+    while (true) {
+      if (pRequest) {
+        nRequests++;
+        nBytes += pRequest->nBytes;
+
+        try {
+          CppSQLite3Savepoint savepoint(mDB);
+          int nChanges = pRequest->fnWrite(mDB);
+          savepoint.release();
+          done.push_back(make_pair(pRequest, nChanges));
+        } catch (...) {
+          exception_ptr error = current_exception();
+          fail(pRequest, error);
+
+          if (mDB.isAutoCommit()) {
+            // The error rolled back the whole transaction
+            for (auto &item : done) {
+              fail(item.first, error);
+            }
+
+            done.clear();
+            return;
+          }
+        }
       }
 
-      // Sleep fora bit to give thread holding the lock to finish
-      usleep(mnRetryTimeUs);
+      if (nRequests >= mOptions.nMaxBatchRequests || nBytes >= mOptions.nMaxBatchBytes) {
+        break;
+      }
 
-      tries++;
-      continue;
+      pRequest = pop();
 
-    } else {
-      if (nRet == SQLITE_FULL || nRet == SQLITE_IOERR || nRet == SQLITE_NOMEM || nRet == SQLITE_BUSY || nRet == SQLITE_INTERRUPT) {
-        rollback();
+      if (pRequest) {
+        mnQueued.fetch_sub(1);
+      } else if (mnQueued.load() > 0) {
+        this_thread::yield();
+      } else if (mOptions.nMaxDelayUs <= 0 || mbClosed.load() || !waitForRequest(&deadline)) {
+        break;
       }
+    }
 
-      nRet = sqlite3_finalize(pVM);
-      const char *szError= sqlite3_errmsg(mpDB);
-      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+    transaction.commit();
+  } catch (...) {
+    exception_ptr error = current_exception();
+
+    if (pFirst) {
+      // The transaction could not begin
+      fail(pFirst, error);
+    }
+
+    for (auto &item : done) {
+      fail(item.first, error);
     }
+
+    return;
+  }
+
+  mnBatches++;
+  mnCommitted += done.size();
+
+  uint64_t nLargest = mnLargestBatch.load();
+
+  while (done.size() > nLargest && !mnLargestBatch.compare_exchange_weak(nLargest, done.size())) {
+  }
+
+  for (auto &item : done) {
+    item.first->result.set_value(item.second);
+    delete item.first;
   }
 }
 
-int CppSQLite3DB::execScalar(const string &szSQL) const
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3CancelToken::CppSQLite3CancelToken()
+  : mbCancelled(false),
+    mpDB(NULL)
 {
-  CppSQLite3Query q = execQuery(szSQL);
+}
 
-  if (q.eof() || q.numFields() < 1) {
-    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid scalar query", DONT_DELETE_MSG);
+void CppSQLite3CancelToken::cancel()
+{
+  lock_guard<mutex> lock(mMutex);
+  mbCancelled = true;
+
+  if (mpDB) {
+    mpDB->interrupt();
   }
+}
 
-  return atoi(q.fieldValue(0).c_str());
+bool CppSQLite3CancelToken::isCancelled() const
+{
+  lock_guard<mutex> lock(mMutex);
+  return mbCancelled;
 }
 
-CppSQLite3Table CppSQLite3DB::getTable(const string &szSQL) const
+bool CppSQLite3CancelToken::attach(CppSQLite3DB *pDB)
 {
-  checkDB();
+  lock_guard<mutex> lock(mMutex);
 
-  char *szError = NULL;
-  char **paszResults = NULL;
-  int nRet;
-  int nRows = 0;
-  int nCols = 0;
+  if (pDB && mbCancelled) {
+    return false;
+  }
 
-  nRet = sqlite3_get_table(mpDB, szSQL.c_str(), &paszResults, &nRows, &nCols, &szError);
+  mpDB = pDB;
+  return true;
+}
 
-  if (nRet == SQLITE_OK) {
-    return CppSQLite3Table(paszResults, nRows, nCols);
-  } else {
-    throw CppSQLite3Exception(nRet, szError);
+////////////////////////////////////////////////////////////////////////////////
+
+CppSQLite3AsyncExecutor::CppSQLite3AsyncExecutor(CppSQLite3Pool &pool, int nThreads, const Post &fnPost)
+  : mPool(pool),
+    mfnPost(fnPost),
+    mbClosed(false)
+{
+  if (nThreads < 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Executor needs a thread", DONT_DELETE_MSG);
+  }
+
+  for (int i = 0; i < nThreads; i++) {
+    mThreads.push_back(thread(&CppSQLite3AsyncExecutor::run, this));
   }
 }
 
-sqlite_int64 CppSQLite3DB::lastRowId() const
+CppSQLite3AsyncExecutor::~CppSQLite3AsyncExecutor()
 {
-  return sqlite3_last_insert_rowid(mpDB);
+  close();
 }
 
-void CppSQLite3DB::interrupt()
+future<CppSQLite3ColumnarTable> CppSQLite3AsyncExecutor::query(const string &szSQL,
+                                                               const shared_ptr<CppSQLite3CancelToken> &pCancel)
 {
-  checkDB();
-  sqlite3_interrupt(mpDB);
+  return submit([szSQL](CppSQLite3DB &db) { return db.getColumnarTable(szSQL); }, false, pCancel);
 }
 
-void CppSQLite3DB::backup(const std::string &target)
+future<int> CppSQLite3AsyncExecutor::execDML(const string &szSQL, const shared_ptr<CppSQLite3CancelToken> &pCancel)
 {
-  backupOrRestore(target, true);
+  return submit([szSQL](CppSQLite3DB &db) { return db.execDML(szSQL); }, true, pCancel);
 }
 
-void CppSQLite3DB::restore(const std::string &target)
+future<int64_t> CppSQLite3AsyncExecutor::stream(const string &szSQL, int nChunkRows, Chunk fnChunk,
+                                                const shared_ptr<CppSQLite3CancelToken> &pCancel)
 {
-  backupOrRestore(target, false);
+  if (nChunkRows < 1) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid chunk size", DONT_DELETE_MSG);
+  }
+
+  return submit([szSQL, nChunkRows, fnChunk](CppSQLite3DB &db) {
+                  CppSQLite3Query q = db.execQuery(szSQL);
+                  CppSQLite3ColumnBatch batch;
+                  int64_t nRows = 0;
+
+                  while (int nRead = q.fetchBatch(nChunkRows, batch)) {
+                    nRows += nRead;
+
+                    if (!fnChunk(batch)) {
+                      break;
+                    }
+                  }
+
+                  return nRows;
+                },
+                false, pCancel);
 }
 
-void CppSQLite3DB::backupOrRestore(const std::string &target, bool isBackup)
+void CppSQLite3AsyncExecutor::close()
 {
-  checkDB();
+  {
+    lock_guard<mutex> lock(mMutex);
 
-  // Open the file that we are going to backup to ro restore from
-  CppSQLite3DB backupDB;
-  backupDB.open(target);
+    if (mbClosed) {
+      return;
+    }
 
-	if (isBackup) {
-		backupDB.execDML("PRAGMA journal_mode = WAL");
-	}
+    mbClosed = true;
+  }
 
-  sqlite3 *pTo   = (isBackup ? backupDB.mpDB : mpDB);
-  sqlite3 *pFrom = (isBackup ? mpDB          : backupDB.mpDB);
+  mWake.notify_all();
 
-  sqlite3_backup *pBackup = sqlite3_backup_init(pTo, "main", pFrom, "main");
+  for (thread &worker : mThreads) {
+    worker.join();
+  }
 
-  if (!pBackup) {
-    int nRet = sqlite3_errcode(pTo);
-    const char *szError = sqlite3_errmsg(pTo);
-    throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+  mThreads.clear();
+}
+
+void CppSQLite3AsyncExecutor::dispatch(bool bWriter, const shared_ptr<CppSQLite3CancelToken> &pCancel,
+                                       Run fnRun, Done fnDone)
+{
+  {
+    lock_guard<mutex> lock(mMutex);
+
+    if (mbClosed) {
+      throw CppSQLite3Exception(CPPSQLITE_ERROR, "Executor closed", DONT_DELETE_MSG);
+    }
+
+    Call call;
+    call.bWriter = bWriter;
+    call.pCancel = pCancel;
+    call.fnRun = move(fnRun);
+    call.fnDone = move(fnDone);
+    mCalls.push_back(move(call));
   }
 
-  int tries = 0;
+  mWake.notify_one();
+}
+
+void CppSQLite3AsyncExecutor::resume(function<void()> fnResume)
+{
+  if (mfnPost) {
+    mfnPost(move(fnResume));
+  } else {
+    fnResume();
+  }
+}
 
+void CppSQLite3AsyncExecutor::run()
+{
   while (true) {
-    // Copy every page from pFrom into backupDB
-    int nRet = sqlite3_backup_step(pBackup, -1);
+    Call call;
 
-    if (nRet == SQLITE_DONE) {
-      // Backup completed successfully
-      sqlite3_backup_finish(pBackup);
-      break;
+    {
+      unique_lock<mutex> lock(mMutex);
+      mWake.wait(lock, [this]() { return mbClosed || !mCalls.empty(); });
 
-    } else if (nRet == SQLITE_OK) {
-      // Copying pages completed successfully, but there is still more work to do
+      if (mCalls.empty()) {
+        return;
+      }
 
-    } else if ((nRet == SQLITE_BUSY || nRet == SQLITE_LOCKED) && tries < mnMaxRetryCount) {
-      // Database is locked, sleep for a bit
-      cout << "CppSQLite3DB::backupOrRestore: Database is locked." << endl;
+      call = move(mCalls.front());
+      mCalls.pop_front();
+    }
 
-      // Sleep fora bit to give thread holding the lock to finish
-      usleep(mnRetryTimeUs);
+    runCall(call);
+  }
+}
 
-      tries++;
-      continue;
+void CppSQLite3AsyncExecutor::runCall(Call &call)
+{
+  exception_ptr error;
 
-    } else {
-      nRet = sqlite3_backup_finish(pBackup);
-      const char *szError = sqlite3_errmsg(pTo);
-      throw CppSQLite3Exception(nRet, szError, DONT_DELETE_MSG);
+  try {
+    // Skip the lease for calls cancelled while queued
+    if (call.pCancel && call.pCancel->isCancelled()) {
+      throw CppSQLite3Exception(SQLITE_INTERRUPT, "Query cancelled", DONT_DELETE_MSG);
+    }
+
+    CppSQLite3Pool::Lease lease = (call.bWriter ? mPool.writer() : mPool.reader());
+
+    if (call.pCancel && !call.pCancel->attach(&lease.db())) {
+      throw CppSQLite3Exception(SQLITE_INTERRUPT, "Query cancelled", DONT_DELETE_MSG);
     }
+
+    try {
+      call.fnRun(lease.db());
+    } catch (...) {
+      if (call.pCancel) {
+        call.pCancel->attach(NULL);
+      }
+
+      throw;
+    }
+
+    if (call.pCancel) {
+      call.pCancel->attach(NULL);
+    }
+  } catch (...) {
+    error = current_exception();
   }
+
+  call.fnDone(error);
 }
 
-void CppSQLite3DB::setBusyTimeout(int nMillisecs)
+////////////////////////////////////////////////////////////////////////////////
+
+struct CppSQLite3SnapshotReader::Connections
 {
-  mnBusyTimeoutMs = nMillisecs;
-  sqlite3_busy_timeout(mpDB, mnBusyTimeoutMs);
-}
+    mutex mMutex;
+    list<CppSQLite3DB> dbs;
+};
 
-void CppSQLite3DB::setMaxRetryCount(int nMaxRetryCount)
+// The calling thread's connections, by reader. Those of readers still alive
+// are closed as the thread exits.
+struct CppSQLite3SnapshotReader::ThreadConnections
 {
-  mnMaxRetryCount = nMaxRetryCount;
-}
+    struct Entry
+    {
+        weak_ptr<Connections> pConnections;
+        CppSQLite3DB *pDB;
+    };
+
+    ~ThreadConnections()
+    {
+      for (auto &item : entries) {
+        release(item.second);
+      }
+    }
 
-void CppSQLite3DB::setRetryTimeUs(int nRetryTimeUs)
+    static void release(const Entry &entry)
+    {
+      shared_ptr<Connections> pConnections = entry.pConnections.lock();
+
+      if (!pConnections) {
+        return;
+      }
+
+      lock_guard<mutex> lock(pConnections->mMutex);
+
+      for (auto it = pConnections->dbs.begin(); it != pConnections->dbs.end(); ++it) {
+        if (&*it == entry.pDB) {
+          pConnections->dbs.erase(it);
+          break;
+        }
+      }
+    }
+
+    unordered_map<uint64_t, Entry> entries;
+};
+
+CppSQLite3SnapshotReader::CppSQLite3SnapshotReader(const string &szFile, const CppSQLite3OpenOptions &options,
+                                                   const Setup &fnSetup)
+  : mszFile(szFile),
+    mOptions(options),
+    mfnSetup(fnSetup),
+    mpConnections(make_shared<Connections>())
 {
-  mnRetryTimeUs = nRetryTimeUs;
+  static atomic<uint64_t> nNextId(1);
+  mnId = nNextId++;
+
+  // Fail here rather than in the first thread to read
+  connection();
 }
 
-sqlite3_stmt *CppSQLite3DB::compile(const string &szSQL) const
+CppSQLite3SnapshotReader::~CppSQLite3SnapshotReader()
 {
-  checkDB();
+  threadConnections().entries.erase(mnId);
 
-  const char *szTail = NULL;
-  sqlite3_stmt *pVM;
+  lock_guard<mutex> lock(mpConnections->mMutex);
+  mpConnections->dbs.clear();
+}
 
-  int nRet = sqlite3_prepare_v2(mpDB, szSQL.c_str(), -1, &pVM, &szTail);
+CppSQLite3DB &CppSQLite3SnapshotReader::connection()
+{
+  ThreadConnections &connections = threadConnections();
+  auto it = connections.entries.find(mnId);
 
-  if (nRet != SQLITE_OK) {
-    const char *szError = sqlite3_errmsg(mpDB);
-    throw CppSQLite3Exception(nRet, szError, false);
+  if (it != connections.entries.end()) {
+    return *it->second.pDB;
   }
 
-  return pVM;
-}
+  // Forget the connections of readers since destroyed
+  for (auto item = connections.entries.begin(); item != connections.entries.end(); ) {
+    if (item->second.pConnections.expired()) {
+      item = connections.entries.erase(item);
+    } else {
+      ++item;
+    }
+  }
 
-void CppSQLite3DB::rollback() const
-{
-  // Returns 0 when the given database connection
-  // is in the middle of a manually-initiated transaction
-  if (sqlite3_get_autocommit(mpDB) == 0) {
-    cout << "Rolling back db transaction." << endl;
+  CppSQLite3DB *pDB;
 
-    // Rollback the transaction that failed
-    char *szError = NULL;
-    int nRet2 = sqlite3_exec(mpDB, "ROLLBACK", 0, 0, &szError);
+  {
+    lock_guard<mutex> lock(mpConnections->mMutex);
+    mpConnections->dbs.emplace_back();
+    pDB = &mpConnections->dbs.back();
+  }
 
-    if (nRet2 != SQLITE_OK) {
-      sqlite3_free(szError);
+  ThreadConnections::Entry entry;
+  entry.pConnections = mpConnections;
+  entry.pDB = pDB;
+
+  try {
+    pDB->open(mszFile, mOptions);
+
+    if (mfnSetup) {
+      mfnSetup(*pDB);
     }
+  } catch (...) {
+    ThreadConnections::release(entry);
+    throw;
   }
+
+  connections.entries[mnId] = entry;
+  return *pDB;
+}
+
+int CppSQLite3SnapshotReader::connectionCount() const
+{
+  lock_guard<mutex> lock(mpConnections->mMutex);
+  return static_cast<int>(mpConnections->dbs.size());
+}
+
+CppSQLite3SnapshotReader::ThreadConnections &CppSQLite3SnapshotReader::threadConnections()
+{
+  static thread_local ThreadConnections connections;
+  return connections;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
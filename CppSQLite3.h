@@ -35,10 +35,35 @@
 #define _CppSQLite3_H_
 
 #include "sqlite3.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <streambuf>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <inttypes.h>
 
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define CPPSQLITE_COROUTINES
+#endif
+#endif
+
 #define CPPSQLITE_ERROR 10000
 
 namespace {
@@ -111,238 +136,2460 @@ class CppSQLite3Binary
     bool mbEncoded;
 };
 
-
-class CppSQLite3Query
+// Encoder and decoder for the format of sqlite3_encode_binary, as used by
+// CppSQLite3Binary, that write into caller buffers and use SSE2 or AVX2 where
+// the CPU has them. Output is identical to sqlite3_encode_binary.
+//
+// Build with CPPSQLITE_NO_SIMD defined to use only the scalar code.
+class CppSQLite3BinaryCodec
 {
   public:
-    CppSQLite3Query();
-    CppSQLite3Query(const CppSQLite3Query &rQuery);
-    CppSQLite3Query(sqlite3 *pDB, sqlite3_stmt *pVM, bool bEof, bool bOwnVM=true);
-    CppSQLite3Query &operator=(const CppSQLite3Query &rQuery);
-    ~CppSQLite3Query();
+    // Size of the buffer encode needs for nLen bytes, including the terminator
+    static size_t maxEncodedLength(size_t nLen);
 
-    int numFields() const;
+    // Adds the number of times each byte value occurs in pIn to anCounts
+    static void count(const unsigned char *pIn, size_t nLen, size_t anCounts[256]);
 
-    int fieldIndex(const std::string &szField) const;
-    std::string fieldName(int nCol) const;
+    // The offset sqlite3_encode_binary picks for nLen bytes with these counts
+    static unsigned char chooseOffset(const size_t anCounts[256], size_t nLen);
 
-    std::string fieldDeclType(int nCol) const;
-    int fieldDataType(int nCol) const;
+    // Encodes nLen bytes into pOut, which must hold maxEncodedLength(nLen)
+    // bytes, and returns the encoded length excluding the terminator
+    static size_t encode(const unsigned char *pIn, size_t nLen, unsigned char *pOut);
 
-    std::string fieldValue(int nField) const;
-    std::string fieldValue(const std::string &szField) const;
+    // As encode, with the nLen bytes of input at the start of pBuf, which
+    // must hold maxEncodedLength(nLen) bytes
+    static size_t encodeInPlace(unsigned char *pBuf, size_t nLen);
 
-    int getIntField(int nField, int nNullValue=0) const;
-    int getIntField(const std::string &szField, int nNullValue=0) const;
+    // Decodes nLen bytes of encoded text, or a NUL terminated string, into
+    // pOut, and returns the decoded length. pOut may be pIn, and otherwise
+    // needs nLen - 1 bytes. Throws if the text is not a valid encoding.
+    static size_t decode(const unsigned char *pIn, size_t nLen, unsigned char *pOut);
+    static size_t decode(const unsigned char *szIn, unsigned char *pOut);
+};
 
-    int64_t getInt64Field(int nField, int64_t nNullValue=0) const;
-    int64_t getInt64Field(const std::string &szField, int64_t nNullValue=0) const;
+// Encodes input that arrives in pieces. The offset has to be picked up front,
+// from CppSQLite3BinaryCodec::chooseOffset over the whole input to get the
+// same output as sqlite3_encode_binary, or from a sample of it.
+class CppSQLite3BinaryEncoder
+{
+  public:
+    explicit CppSQLite3BinaryEncoder(unsigned char nOffset);
 
-    double getFloatField(int nField, double fNullValue=0.0) const;
-    double getFloatField(const std::string &szField, double fNullValue=0.0) const;
+    // Encodes the next nLen bytes into pOut, which must hold 2 * nLen + 1
+    // bytes, and returns the number written
+    size_t update(const unsigned char *pIn, size_t nLen, unsigned char *pOut);
 
-    std::string getStringField(int nField, const std::string &szNullValue="") const;
-    std::string getStringField(const std::string &szField, const std::string &szNullValue="") const;
+    // Writes the rest of the output, at most 2 bytes including the terminator,
+    // and returns the number written excluding the terminator
+    size_t finish(unsigned char *pOut);
 
-    const unsigned char *getBlobField(int nField, int &nLen) const;
-    const unsigned char *getBlobField(const std::string &szField, int &nLen) const;
+  private:
+    unsigned char mnOffset;
+    bool mbStarted;
+};
 
-    bool fieldIsNull(int nField) const;
-    bool fieldIsNull(const std::string &szField) const;
+// Decodes encoded text that arrives in pieces
+class CppSQLite3BinaryDecoder
+{
+  public:
+    CppSQLite3BinaryDecoder();
 
-    bool eof() const;
+    // Decodes the next nLen bytes into pOut, which may be pIn and otherwise
+    // needs nLen bytes, and returns the number written. Throws on invalid text.
+    size_t update(const unsigned char *pIn, size_t nLen, unsigned char *pOut);
 
-    void nextRow();
+    // Throws if the text ended part way through
+    void finish();
 
-    void finalize();
+  private:
+    unsigned char mnOffset;
+    bool mbStarted;
+    bool mbEscape;
+};
 
-    void setMaxRetryCount(int nMaxRetryCount);
 
-    void setRetryTimeUs(int nRetryTimeUs);
+// Non-owning view of a run of bytes, such as a blob column value
+class CppSQLite3ByteView
+{
+  public:
+    CppSQLite3ByteView() : mpData(NULL), mnSize(0) {}
+    CppSQLite3ByteView(const unsigned char *pData, size_t nSize) : mpData(pData), mnSize(nSize) {}
+
+    const unsigned char *data() const { return mpData; }
+    size_t size() const { return mnSize; }
+    bool empty() const { return mnSize == 0; }
+
+    const unsigned char *begin() const { return mpData; }
+    const unsigned char *end() const { return mpData + mnSize; }
+
+    unsigned char operator[](size_t nIndex) const { return mpData[nIndex]; }
 
   private:
-    void checkVM() const;
+    const unsigned char *mpData;
+    size_t mnSize;
+};
 
-    void rollback() const;
 
-    void checkFieldIndex(int nCol) const;
+// Decides whether, and after how long a wait, an operation that failed with
+// SQLITE_BUSY or SQLITE_LOCKED is attempted again.
+//
+// Policies are shared between connections, queries and statements, so
+// implementations must be safe to call from several threads at once.
+class CppSQLite3RetryPolicy
+{
+  public:
+    // Special return values of nextDelayUs
+    static const int64_t YIELD = -1;
+    static const int64_t GIVE_UP = -2;
 
-    sqlite3 *mpDB;
-    sqlite3_stmt *mpVM;
-    bool mbEof;
-    int mnCols;
-    bool mbOwnVM;
+    virtual ~CppSQLite3RetryPolicy() {}
 
-    // How many times to retry after an SQLITE_LOCKED
-    int mnMaxRetryCount;
+    // Called when attempt nAttempt (1 for the first failure) of an operation
+    // failed with nErrCode, nElapsedUs after its first failure. Returns the
+    // number of microseconds to sleep before retrying, 0 to retry at once,
+    // YIELD to yield the thread first, or GIVE_UP.
+    virtual int64_t nextDelayUs(int nErrCode, int nAttempt, int64_t nElapsedUs) const = 0;
 
-    // How many useconds to sleep for before retrying on SQLITE_LOCKED
-    int mnRetryTimeUs;
+    // Five retries, 5ms apart
+    static const std::shared_ptr<const CppSQLite3RetryPolicy> &defaultPolicy();
 };
 
+// Retries up to nMaxRetries times, sleeping nDelayUs before each retry
+class CppSQLite3FixedRetry : public CppSQLite3RetryPolicy
+{
+  public:
+    CppSQLite3FixedRetry(int nMaxRetries, int64_t nDelayUs);
+
+    int64_t nextDelayUs(int nErrCode, int nAttempt, int64_t nElapsedUs) const;
 
-class CppSQLite3Table
+  private:
+    int mnMaxRetries;
+    int64_t mnDelayUs;
+};
+
+// Retries up to nMaxRetries times, doubling the delay from nBaseDelayUs up to
+// nMaxDelayUs. With jitter, each delay is drawn uniformly from zero to that
+// bound, so that contending threads spread out instead of retrying in step.
+class CppSQLite3ExponentialBackoff : public CppSQLite3RetryPolicy
 {
   public:
-    CppSQLite3Table();
-    CppSQLite3Table(const CppSQLite3Table &rTable);
-    CppSQLite3Table(char **paszResults, int nRows, int nCols);
-    ~CppSQLite3Table();
+    CppSQLite3ExponentialBackoff(int nMaxRetries, int64_t nBaseDelayUs, int64_t nMaxDelayUs, bool bJitter=true);
 
-    CppSQLite3Table &operator=(const CppSQLite3Table &rTable);
+    int64_t nextDelayUs(int nErrCode, int nAttempt, int64_t nElapsedUs) const;
 
-    int numFields() const;
+  private:
+    int mnMaxRetries;
+    int64_t mnBaseDelayUs;
+    int64_t mnMaxDelayUs;
+    bool mbJitter;
+};
 
-    int numRows() const;
+// Retries with the delays of another policy until nBudgetUs have passed
+// since the first failure, cutting the last delay short to fit the budget
+class CppSQLite3DeadlineRetry : public CppSQLite3RetryPolicy
+{
+  public:
+    // By default, jittered exponential backoff from 100us up to 50ms
+    explicit CppSQLite3DeadlineRetry(int64_t nBudgetUs,
+                                     const std::shared_ptr<const CppSQLite3RetryPolicy> &pDelays=nullptr);
 
-    std::string fieldName(int nCol);
+    int64_t nextDelayUs(int nErrCode, int nAttempt, int64_t nElapsedUs) const;
 
-    std::string fieldValue(int nField) const;
-    std::string fieldValue(const std::string &szField) const;
+  private:
+    int64_t mnBudgetUs;
+    std::shared_ptr<const CppSQLite3RetryPolicy> mpDelays;
+};
 
-    int getIntField(int nField, int nNullValue=0) const;
-    int getIntField(const std::string &szField, int nNullValue=0) const;
+// Retries nSpins times straight away, then nYields times after yielding the
+// thread, and never sleeps. Suits locks that are only ever held briefly.
+class CppSQLite3SpinYieldRetry : public CppSQLite3RetryPolicy
+{
+  public:
+    CppSQLite3SpinYieldRetry(int nSpins, int nYields);
 
-    double getFloatField(int nField, double fNullValue=0.0) const;
-    double getFloatField(const std::string &szField, double fNullValue=0.0) const;
+    int64_t nextDelayUs(int nErrCode, int nAttempt, int64_t nElapsedUs) const;
 
-    const std::string getStringField(int nField, const std::string &szNullValue="") const;
-    const std::string getStringField(const std::string &szField, const std::string &szNullValue="") const;
+  private:
+    int mnSpins;
+    int mnYields;
+};
 
-    bool fieldIsNull(int nField) const;
-    bool fieldIsNull(const std::string &szField) const;
 
-    void setRow(int nRow);
+// Something worth reporting that happened on a connection, such as a retry
+// after SQLITE_BUSY or the rollback of a failed transaction
+struct CppSQLite3LogEvent
+{
+    enum Level { LEVEL_DEBUG, LEVEL_INFO, LEVEL_WARNING, LEVEL_ERROR };
 
-    void finalize();
+    Level nLevel;
+
+    // SQLite result code that caused the event
+    int nErrCode;
+
+    // What happened, as a static string
+    const char *szMessage;
+
+    // Statement being run, or NULL. Only valid during CppSQLite3Logger::log.
+    const char *szSQL;
+
+    // Attempt number of a retried operation, 0 otherwise
+    int nRetry;
+
+    // Microseconds since the operation first failed
+    int64_t nElapsedUs;
+};
+
+// Receives the events of the connections it is installed on.
+//
+// log() is called on the thread that hit the event, often while another
+// connection holds the database lock, so it must be quick and must not
+// block. Nothing is logged, and no event is built, while no logger is set.
+class CppSQLite3Logger
+{
+  public:
+    virtual ~CppSQLite3Logger() {}
+
+    virtual void log(const CppSQLite3LogEvent &event) = 0;
+};
+
+// Keeps the last nCapacity events in memory, for a monitoring thread to
+// collect with events(). log() takes no lock and allocates nothing; once
+// the buffer is full the oldest events are overwritten. SQL text longer
+// than SQL_LENGTH bytes is truncated.
+class CppSQLite3RingBufferLogger : public CppSQLite3Logger
+{
+  public:
+    static const size_t SQL_LENGTH = 200;
+
+    // A copy of a logged event
+    struct Entry
+    {
+        // Position of the event among all events logged, from 0
+        uint64_t nSequence;
+        CppSQLite3LogEvent::Level nLevel;
+        int nErrCode;
+        const char *szMessage;
+        std::string szSQL;
+        int nRetry;
+        int64_t nElapsedUs;
+    };
+
+    explicit CppSQLite3RingBufferLogger(size_t nCapacity=1024);
+
+    void log(const CppSQLite3LogEvent &event);
+
+    // Buffered events with a sequence number of at least nFrom, oldest
+    // first. Events overwritten while being copied are left out.
+    std::vector<Entry> events(uint64_t nFrom=0) const;
+
+    // Number of events logged so far, including overwritten ones
+    uint64_t totalEvents() const { return mnNext.load(std::memory_order_acquire); }
+
+    size_t capacity() const { return mSlots.size(); }
 
   private:
+    // The SQL text is kept in words, NUL terminated and zero padded
+    static const size_t SQL_WORDS = (SQL_LENGTH + 1 + 7) / 8;
+
+    // Readers may copy a slot as it is written, and throw the copy away
+    // after, so every field is atomic and accessed relaxed; nVersion and
+    // fences order them
+    struct Slot
+    {
+        // 2 * (sequence + 1) once written, odd while a write is in progress
+        std::atomic<uint64_t> nVersion;
+        std::atomic<CppSQLite3LogEvent::Level> nLevel;
+        std::atomic<int> nErrCode;
+        std::atomic<const char*> szMessage;
+        std::atomic<uint64_t> anSQL[SQL_WORDS];
+        std::atomic<int> nRetry;
+        std::atomic<int64_t> nElapsedUs;
+    };
+
+    std::vector<Slot> mSlots;
+    std::atomic<uint64_t> mnNext;
+};
 
-    void checkResults() const;
+// One run of a statement, from its first step until it finished or was reset
+struct CppSQLite3StatementRun
+{
+    // SQL as prepared. Only valid during the call it is passed to.
+    const char *szSQL;
 
-    int mnRows;
-    int mnCols;
-    int mnCurrentRow;
-    char **mpaszResults;
+    int64_t nElapsedNs;
+
+    // Rows returned
+    int64_t nRows;
+
+    // sqlite3_stmt_status counters for the run
+    int64_t nFullScanSteps;
+    int64_t nSorts;
+    int64_t nAutoIndexes;
+    int64_t nVMSteps;
+    int64_t nReprepares;
 };
 
+// Totals for the runs of statements with the same normalized SQL
+struct CppSQLite3StatementProfile
+{
+    std::string szSQL;
+
+    int64_t nCalls;
+    int64_t nRows;
 
-class CppSQLite3Statement
+    int64_t nTotalNs;
+    int64_t nMaxNs;
+
+    // Estimated from a histogram, to within about 6%
+    int64_t nP50Ns;
+    int64_t nP99Ns;
+
+    int64_t nFullScanSteps;
+    int64_t nSorts;
+    int64_t nAutoIndexes;
+    int64_t nVMSteps;
+    int64_t nReprepares;
+};
+
+// Collects the statement runs of the connections it is installed on with
+// CppSQLite3DB::setProfiler, grouped by SQL text with literals replaced by
+// '?', comments dropped, whitespace collapsed and words lower cased.
+//
+// Runs are found through sqlite3_trace_v2 events and timed with
+// std::chrono::steady_clock, from a statement's first step to its profile
+// event, rather than with the time SQLite reports, which is in whole
+// milliseconds. The full scan, sort, autoindex and VM step counters of
+// profiled statements are reset after each run. Connections with no
+// profiler register no trace callback and pay nothing.
+//
+// A profiler may be shared by several connections on different threads.
+class CppSQLite3Profiler
 {
   public:
-    CppSQLite3Statement();
-    CppSQLite3Statement(const CppSQLite3Statement &rStatement);
-    CppSQLite3Statement(sqlite3 *pDB, sqlite3_stmt *pVM);
-    ~CppSQLite3Statement();
+    typedef std::function<void(const CppSQLite3StatementRun &run)> SlowQueryHandler;
 
-    CppSQLite3Statement &operator=(const CppSQLite3Statement &rStatement);
+    CppSQLite3Profiler();
 
-    int execDML() const;
+    // Calls fnHandler with every run that takes nThresholdNs or longer. It is
+    // called on the thread running the statement, while it is being stepped
+    // or reset, so it must not use that connection.
+    void setSlowQueryHandler(int64_t nThresholdNs, SlowQueryHandler fnHandler);
 
-    CppSQLite3Query execQuery() const;
+    // Totals so far, most total time first
+    std::vector<CppSQLite3StatementProfile> snapshot() const;
 
-    void bind(int nParam, const std::string &szValue);
-    void bind(int nParam, const int nValue);
-    void bind(int nParam, const int64_t nValue);
-    void bind(int nParam, const double dwValue);
-    void bind(int nParam, const unsigned char *blobValue, int nLen);
-    void bindNull(int nParam);
+    // snapshot() as a JSON array of objects with the field names of
+    // CppSQLite3StatementProfile, less their type prefix
+    std::string snapshotJSON() const;
 
     void reset();
 
-    void finalize();
-
-    void setMaxRetryCount(int nMaxRetryCount);
+    // Called for each finished run
+    void record(const CppSQLite3StatementRun &run);
 
-    void setRetryTimeUs(int nRetryTimeUs);
+    // The text runs of szSQL are grouped under
+    static std::string normalize(std::string_view szSQL);
 
   private:
-    void checkDB() const;
-    void checkVM() const;
+    // Latencies are counted in buckets of 1ns below 8ns, then 8 buckets for
+    // each power of two
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = SUB_BUCKETS + (63 - 3) * SUB_BUCKETS;
 
-    sqlite3 *mpDB;
-    sqlite3_stmt *mpVM;
+    struct Entry
+    {
+        CppSQLite3StatementProfile profile;
+        std::vector<int64_t> anHistogram;
+    };
 
-    // How many times to retry after an SQLITE_LOCKED
-    int mnMaxRetryCount;
+    static int bucket(int64_t nNs);
+    static int64_t percentile(const Entry &entry, double fFraction);
 
-    // How many useconds to sleep for before retrying on SQLITE_LOCKED
-    int mnRetryTimeUs;
+    mutable std::mutex mMutex;
+    std::unordered_map<std::string, Entry> mEntries;
+
+    std::atomic<int64_t> mnSlowThresholdNs;
+    std::shared_ptr<const SlowQueryHandler> mpSlowQueryHandler;
 };
 
+class CppSQLite3ProfilerHook;
 
-class CppSQLite3DB
+
+// Reads a result column as a T. Specialize for user types:
+//
+//   get(pVM, nCol) returns the value of column nCol of the current row.
+//   accepts(nType) says whether a value of SQLite storage class nType
+//   (SQLITE_INTEGER, SQLITE_TEXT, ...) can be read as a T.
+template<class T, class Enable=void>
+struct CppSQLite3ColumnTraits;
+
+// Every integer type, so that int64_t, sqlite3_int64 and long long all work
+// whichever of them are the same type. Values are converted with
+// static_cast, so those too wide for T are truncated.
+template<class T>
+struct CppSQLite3ColumnTraits<T, typename std::enable_if<std::is_integral<T>::value>::type>
 {
-  public:
-    CppSQLite3DB();
-    ~CppSQLite3DB();
+  static T get(sqlite3_stmt *pVM, int nCol) { return static_cast<T>(sqlite3_column_int64(pVM, nCol)); }
+  static bool accepts(int nType) { return nType == SQLITE_INTEGER || nType == SQLITE_FLOAT || nType == SQLITE_NULL; }
+};
 
-    void open(const std::string &szFile);
+template<>
+struct CppSQLite3ColumnTraits<double>
+{
+  static double get(sqlite3_stmt *pVM, int nCol) { return sqlite3_column_double(pVM, nCol); }
+  static bool accepts(int nType) { return nType == SQLITE_INTEGER || nType == SQLITE_FLOAT || nType == SQLITE_NULL; }
+};
 
-    void close();
+// Valid until the next row is stepped to, as with CppSQLite3Query::getStringView
+template<>
+struct CppSQLite3ColumnTraits<std::string_view>
+{
+  static std::string_view get(sqlite3_stmt *pVM, int nCol)
+  {
+    const char *szValue = reinterpret_cast<const char*>(sqlite3_column_text(pVM, nCol));
+    return std::string_view(szValue, szValue ? sqlite3_column_bytes(pVM, nCol) : 0);
+  }
 
-    bool tableExists(const std::string &szTable) const;
+  static bool accepts(int) { return true; }
+};
 
-    int execDML(const std::string &szSQL);
+template<>
+struct CppSQLite3ColumnTraits<std::string>
+{
+  static std::string get(sqlite3_stmt *pVM, int nCol) { return std::string(CppSQLite3ColumnTraits<std::string_view>::get(pVM, nCol)); }
+  static bool accepts(int) { return true; }
+};
 
-    CppSQLite3Query execQuery(const std::string &szSQL) const;
+// Valid until the next row is stepped to, as with CppSQLite3Query::getBlobView
+template<>
+struct CppSQLite3ColumnTraits<CppSQLite3ByteView>
+{
+  static CppSQLite3ByteView get(sqlite3_stmt *pVM, int nCol)
+  {
+    const unsigned char *pValue = static_cast<const unsigned char*>(sqlite3_column_blob(pVM, nCol));
+    return CppSQLite3ByteView(pValue, sqlite3_column_bytes(pVM, nCol));
+  }
 
-    int execScalar(const std::string &szSQL) const;
+  static bool accepts(int) { return true; }
+};
 
-    CppSQLite3Table getTable(const std::string &szSQL) const;
+// NULL reads as an empty optional
+template<class T>
+struct CppSQLite3ColumnTraits<std::optional<T> >
+{
+  static std::optional<T> get(sqlite3_stmt *pVM, int nCol)
+  {
+    if (sqlite3_column_type(pVM, nCol) == SQLITE_NULL) {
+      return std::nullopt;
+    }
 
-    CppSQLite3Statement compileStatement(const std::string &szSQL) const;
+    return CppSQLite3ColumnTraits<T>::get(pVM, nCol);
+  }
 
-    sqlite_int64 lastRowId() const;
+  static bool accepts(int nType) { return nType == SQLITE_NULL || CppSQLite3ColumnTraits<T>::accepts(nType); }
+};
 
-    void interrupt();
 
-    void setBusyTimeout(int nMillisecs);
+// Binds a T to a statement parameter. Specialize for user types:
+//
+//   bind(pVM, nParam, value) binds value to parameter nParam of pVM and
+//   returns the result of the sqlite3_bind_* call. Text and blobs are
+//   copied by SQLite, so values need not outlive the call.
+template<class T, class Enable=void>
+struct CppSQLite3BindTraits;
 
-    void setMaxRetryCount(int nMaxRetryCount);
+// Every integer type, including bool, long long and size_t, binds as an
+// SQLite integer. Unsigned values above INT64_MAX wrap to negative ones.
+template<class T>
+struct CppSQLite3BindTraits<T, typename std::enable_if<std::is_integral<T>::value>::type>
+{
+  static int bind(sqlite3_stmt *pVM, int nParam, T nValue)
+  {
+    return sqlite3_bind_int64(pVM, nParam, static_cast<sqlite3_int64>(nValue));
+  }
+};
 
-    void setRetryTimeUs(int nRetryTimeUs);
+template<>
+struct CppSQLite3BindTraits<double>
+{
+  static int bind(sqlite3_stmt *pVM, int nParam, double dValue) { return sqlite3_bind_double(pVM, nParam, dValue); }
+};
 
-    static const char *SQLiteVersion() { return SQLITE_VERSION; }
+template<>
+struct CppSQLite3BindTraits<std::string_view>
+{
+  static int bind(sqlite3_stmt *pVM, int nParam, std::string_view szValue)
+  {
+    // A NULL pointer would bind NULL rather than an empty string
+    const char *szData = (szValue.data() ? szValue.data() : "");
+    return sqlite3_bind_text64(pVM, nParam, szData, szValue.size(), SQLITE_TRANSIENT, SQLITE_UTF8);
+  }
+};
 
-    // Backup DB to the file target
-    //
-    // Contents of the file target are overwritten
-    void backup(const std::string &target);
+template<>
+struct CppSQLite3BindTraits<std::string>
+{
+  static int bind(sqlite3_stmt *pVM, int nParam, const std::string &szValue)
+  {
+    return sqlite3_bind_text64(pVM, nParam, szValue.data(), szValue.size(), SQLITE_TRANSIENT, SQLITE_UTF8);
+  }
+};
 
-    // Restore from a backup DB in file target
-    //
-    // Contents of the local database mpDB are overwritten
-    void restore(const std::string &target);
+// NULL binds NULL
+template<>
+struct CppSQLite3BindTraits<const char*>
+{
+  static int bind(sqlite3_stmt *pVM, int nParam, const char *szValue)
+  {
+    return sqlite3_bind_text(pVM, nParam, szValue, -1, SQLITE_TRANSIENT);
+  }
+};
 
-  private:
-    CppSQLite3DB(const CppSQLite3DB &db);
-    CppSQLite3DB &operator=(const CppSQLite3DB &db);
+// String literals and char arrays decay to this
+template<>
+struct CppSQLite3BindTraits<char*> : CppSQLite3BindTraits<const char*>
+{
+};
 
-    sqlite3_stmt *compile(const std::string &szSQL) const;
+template<>
+struct CppSQLite3BindTraits<CppSQLite3ByteView>
+{
+  static int bind(sqlite3_stmt *pVM, int nParam, CppSQLite3ByteView blobValue)
+  {
+    if (!blobValue.data()) {
+      // A NULL pointer would bind NULL rather than an empty blob
+      return sqlite3_bind_zeroblob(pVM, nParam, 0);
+    }
+
+    return sqlite3_bind_blob64(pVM, nParam, blobValue.data(), blobValue.size(), SQLITE_TRANSIENT);
+  }
+};
 
-    // Backup or restore the local DB to target.
-    //
-    // Copies all pages in the database with a single sqlite3_backup_step command
-    // Supports backup to or from in-memory databases
-    void backupOrRestore(const std::string &target, bool isBackup);
+template<>
+struct CppSQLite3BindTraits<std::nullptr_t>
+{
+  static int bind(sqlite3_stmt *pVM, int nParam, std::nullptr_t) { return sqlite3_bind_null(pVM, nParam); }
+};
 
-    void checkDB() const;
+// An empty optional binds NULL
+template<class T>
+struct CppSQLite3BindTraits<std::optional<T> >
+{
+  static int bind(sqlite3_stmt *pVM, int nParam, const std::optional<T> &value)
+  {
+    if (!value) {
+      return sqlite3_bind_null(pVM, nParam);
+    }
 
-    void rollback() const;
+    return CppSQLite3BindTraits<T>::bind(pVM, nParam, *value);
+  }
+};
 
-    sqlite3 *mpDB;
 
-    // How long before timing out most operations
-    int mnBusyTimeoutMs;
+// Maps result column names to column indexes.
+//
+// Built once per prepared statement and kept with it, so that name lookups
+// cost a hash probe instead of a scan over sqlite3_column_name. Where names
+// repeat, the first column with the name wins. CppSQLite3Statement keeps
+// one for its parameter names too.
+class CppSQLite3ColumnMap
+{
+  public:
+    CppSQLite3ColumnMap();
 
-    // How many times to retry after an SQLITE_LOCKED
-    int mnMaxRetryCount;
+    // Rebuilds the map from the result columns of pVM
+    void build(sqlite3_stmt *pVM);
 
-    // How many useconds to sleep for before retrying on SQLITE_LOCKED
-    int mnRetryTimeUs;
+    // Rebuilds the map from nCols column names
+    void build(const char *const *paszNames, int nCols);
+
+    // Whether the map describes pVM as it is currently compiled
+    bool builtFor(sqlite3_stmt *pVM) const;
+
+    // Index of the column named szName, or -1 if there is none
+    int find(std::string_view szName) const;
+
+    void clear();
+
+  private:
+    static uint32_t hash(std::string_view szName);
+
+    void insert(std::string_view szName, int nCol);
+
+    // All names back to back; name n spans mOffsets[n] to mOffsets[n + 1]
+    std::string mNames;
+    std::vector<uint32_t> mOffsets;
+    std::vector<uint32_t> mHashes;
+
+    // Open addressed table of column index + 1, 0 for an empty slot
+    std::vector<int> mSlots;
+
+    sqlite3_stmt *mpVM;
+
+    // SQLITE_STMTSTATUS_REPREPARE count of mpVM when the map was built
+    int mnReprepares;
 };
 
+
+template<class... T>
+class CppSQLite3Rows;
+
+class CppSQLite3ColumnBatch;
+
+
+// LRU cache of prepared statements, keyed by SQL text.
+//
+// Idle statements are kept reset with their bindings cleared. A statement
+// handed out by acquire() belongs to the caller until it is passed back to
+// release(), which is what CppSQLite3Query::finalize and
+// CppSQLite3Statement::finalize do instead of calling sqlite3_finalize.
+class CppSQLite3StatementCache
+{
+  public:
+    CppSQLite3StatementCache(sqlite3 *pDB, int nCapacity);
+    ~CppSQLite3StatementCache();
+
+    // Returns an idle statement for szSQL, or NULL on a miss. pColumns is set
+    // to the column map kept with the statement, if any.
+    sqlite3_stmt *acquire(const std::string &szSQL, std::shared_ptr<CppSQLite3ColumnMap> &pColumns);
+
+    // Whether a statement freshly prepared from szSQL may be released into the
+    // cache. Only single statements whose text matches szSQL exactly qualify.
+    bool cacheable(const std::string &szSQL, sqlite3_stmt *pVM) const;
+
+    // Resets pVM and keeps it, along with its column map, for reuse,
+    // finalizing it if it cannot be kept. Returns the result of sqlite3_reset.
+    int release(sqlite3_stmt *pVM, const std::shared_ptr<CppSQLite3ColumnMap> &pColumns=nullptr);
+
+    // Finalizes all idle statements
+    void clear();
+
+    // Clears the cache and detaches it from the connection. Statements
+    // released after this are finalized.
+    void close();
+
+    void setCapacity(int nCapacity);
+
+    int capacity() const { return mnCapacity; }
+    int size() const { return static_cast<int>(mIdle.size()); }
+
+    int64_t hits() const { return mnHits; }
+    int64_t misses() const { return mnMisses; }
+    int64_t evictions() const { return mnEvictions; }
+    int64_t invalidations() const { return mnInvalidations; }
+
+  private:
+    CppSQLite3StatementCache(const CppSQLite3StatementCache &cache);
+    CppSQLite3StatementCache &operator=(const CppSQLite3StatementCache &cache);
+
+    struct Entry
+    {
+      std::string szSQL;
+      sqlite3_stmt *pVM;
+      std::shared_ptr<CppSQLite3ColumnMap> pColumns;
+    };
+
+    typedef std::list<Entry> IdleList;
+
+    void evict(size_t nSize);
+
+    sqlite3 *mpDB;
+    int mnCapacity;
+
+    // Most recently used at the front
+    IdleList mIdle;
+    std::unordered_map<std::string, IdleList::iterator> mIndex;
+
+    int64_t mnHits;
+    int64_t mnMisses;
+    int64_t mnEvictions;
+    int64_t mnInvalidations;
+};
+
+
+class CppSQLite3Query
+{
+  public:
+    CppSQLite3Query();
+
+    // Queries own their VM, so they can be moved but not copied. A
+    // moved-from query is at eof and may only be assigned to or destroyed.
+    CppSQLite3Query(CppSQLite3Query &&rQuery) noexcept;
+    CppSQLite3Query(const CppSQLite3Query &rQuery) = delete;
+    CppSQLite3Query(sqlite3 *pDB, sqlite3_stmt *pVM, bool bEof, bool bOwnVM=true,
+                    const std::shared_ptr<CppSQLite3StatementCache> &pCache=nullptr,
+                    const std::shared_ptr<CppSQLite3ColumnMap> &pColumns=nullptr);
+    CppSQLite3Query &operator=(CppSQLite3Query &&rQuery) noexcept;
+    CppSQLite3Query &operator=(const CppSQLite3Query &rQuery) = delete;
+    ~CppSQLite3Query() noexcept;
+
+    int numFields() const;
+
+    // Resolving names once and reading fields by index avoids the lookup on
+    // every row
+    int fieldIndex(std::string_view szField) const;
+    std::string fieldName(int nCol) const;
+
+    std::string fieldDeclType(int nCol) const;
+    int fieldDataType(int nCol) const;
+
+    std::string fieldValue(int nField) const;
+    std::string fieldValue(const std::string &szField) const;
+
+    int getIntField(int nField, int nNullValue=0) const;
+    int getIntField(const std::string &szField, int nNullValue=0) const;
+
+    int64_t getInt64Field(int nField, int64_t nNullValue=0) const;
+    int64_t getInt64Field(const std::string &szField, int64_t nNullValue=0) const;
+
+    double getFloatField(int nField, double fNullValue=0.0) const;
+    double getFloatField(const std::string &szField, double fNullValue=0.0) const;
+
+    std::string getStringField(int nField, const std::string &szNullValue="") const;
+    std::string getStringField(const std::string &szField, const std::string &szNullValue="") const;
+
+    const unsigned char *getBlobField(int nField, int &nLen) const;
+    const unsigned char *getBlobField(const std::string &szField, int &nLen) const;
+
+    // Non-owning accessors. The returned views point into SQLite's copy of the
+    // current row and stay valid until the next call to nextRow() or
+    // finalize(), or until the query is destroyed, whichever comes first.
+    // Text views are not NUL terminated and may contain embedded NULs.
+    std::string_view getStringView(int nField, std::string_view szNullValue=std::string_view()) const;
+    std::string_view getStringView(const std::string &szField, std::string_view szNullValue=std::string_view()) const;
+
+    CppSQLite3ByteView getBlobView(int nField) const;
+    CppSQLite3ByteView getBlobView(const std::string &szField) const;
+
+    // Valid until the query is finalized or destroyed
+    std::string_view fieldNameView(int nCol) const;
+
+    bool fieldIsNull(int nField) const;
+    bool fieldIsNull(const std::string &szField) const;
+
+    bool eof() const;
+
+    // Invalidates any views returned for the current row
+    void nextRow();
+
+    void finalize();
+
+    // Deprecated in favour of setRetryPolicy. Each replaces the retry
+    // policy with a CppSQLite3FixedRetry built from its value and the
+    // other's last one.
+    void setMaxRetryCount(int nMaxRetryCount);
+
+    void setRetryTimeUs(int nRetryTimeUs);
+
+    // Policy nextRow() follows when the database is busy or locked
+    void setRetryPolicy(const std::shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy);
+
+    // Receives retries and rollbacks in nextRow(), or nullptr for none
+    void setLogger(const std::shared_ptr<CppSQLite3Logger> &pLogger);
+
+    // Iterates the remaining rows as std::tuple<T...>, reading column n of
+    // each row as the nth type through CppSQLite3ColumnTraits:
+    //
+    //   for (auto [id, name] : q.as<int64_t, std::string_view>()) { ... }
+    //
+    // The column count, and the storage class of each column in the current
+    // row, are checked once here. Rows after that are read without checks,
+    // so a later row whose value cannot be read as the requested type is
+    // converted by SQLite's usual rules.
+    template<class... T>
+    CppSQLite3Rows<T...> as();
+
+    // Reads the current row and those after it, up to nRows in all, into
+    // batch, replacing its previous rows, and leaves the query on the next
+    // unread row. Returns the number of rows read, 0 once at eof.
+    int fetchBatch(int nRows, CppSQLite3ColumnBatch &batch);
+
+  private:
+    template<class... T>
+    friend class CppSQLite3Rows;
+
+    friend class CppSQLite3ColumnarTable;
+
+    void checkVM() const;
+
+    // Rolls back the open transaction after an nErrCode failure
+    void rollback(int nErrCode) const;
+
+    void checkFieldIndex(int nCol) const;
+
+    sqlite3 *mpDB;
+    sqlite3_stmt *mpVM;
+    bool mbEof;
+    int mnCols;
+    bool mbOwnVM;
+
+    // Cache the VM is returned to on finalize, if it came from one
+    std::shared_ptr<CppSQLite3StatementCache> mpCache;
+
+    // Column name lookup, shared with the statement cache or CppSQLite3Statement
+    // that owns the VM and built on first use
+    mutable std::shared_ptr<CppSQLite3ColumnMap> mpColumns;
+
+    // Last values given to the deprecated setMaxRetryCount and
+    // setRetryTimeUs, kept only for building their CppSQLite3FixedRetry.
+    // Retries follow mpRetryPolicy alone.
+    int mnMaxRetryCount;
+    int mnRetryTimeUs;
+
+    std::shared_ptr<const CppSQLite3RetryPolicy> mpRetryPolicy;
+
+    std::shared_ptr<CppSQLite3Logger> mpLogger;
+};
+
+
+// Range over the rows of a CppSQLite3Query, returned by CppSQLite3Query::as
+template<class... T>
+class CppSQLite3Rows
+{
+  public:
+    typedef std::tuple<T...> value_type;
+
+    class iterator
+    {
+      public:
+        iterator() : mpQuery(NULL) {}
+        explicit iterator(CppSQLite3Query *pQuery) : mpQuery(pQuery->mbEof ? NULL : pQuery) {}
+
+        value_type operator*() const { return read(std::index_sequence_for<T...>()); }
+
+        iterator &operator++()
+        {
+          mpQuery->nextRow();
+
+          if (mpQuery->mbEof) {
+            mpQuery = NULL;
+          }
+
+          return *this;
+        }
+
+        bool operator==(const iterator &it) const { return mpQuery == it.mpQuery; }
+        bool operator!=(const iterator &it) const { return mpQuery != it.mpQuery; }
+
+      private:
+        template<size_t... I>
+        value_type read(std::index_sequence<I...>) const
+        {
+          sqlite3_stmt *pVM = mpQuery->mpVM;
+          return value_type(CppSQLite3ColumnTraits<T>::get(pVM, static_cast<int>(I))...);
+        }
+
+        // NULL once the last row has been passed
+        CppSQLite3Query *mpQuery;
+    };
+
+    explicit CppSQLite3Rows(CppSQLite3Query *pQuery) : mpQuery(pQuery) {}
+
+    iterator begin() const { return iterator(mpQuery); }
+    iterator end() const { return iterator(); }
+
+  private:
+    CppSQLite3Query *mpQuery;
+};
+
+template<class... T>
+CppSQLite3Rows<T...> CppSQLite3Query::as()
+{
+  checkVM();
+
+  if (static_cast<int>(sizeof...(T)) > mnCols) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Row type has more fields than the query", DONT_DELETE_MSG);
+  }
+
+  if (!mbEof) {
+    int nCol = 0;
+    bool bAccepted = (CppSQLite3ColumnTraits<T>::accepts(sqlite3_column_type(mpVM, nCol++)) && ...);
+
+    if (!bAccepted) {
+      throw CppSQLite3Exception(CPPSQLITE_ERROR, "Field type does not match row type", DONT_DELETE_MSG);
+    }
+  }
+
+  return CppSQLite3Rows<T...>(this);
+}
+
+
+class CppSQLite3Table
+{
+  public:
+    CppSQLite3Table();
+    CppSQLite3Table(CppSQLite3Table &&rTable) noexcept;
+    CppSQLite3Table(const CppSQLite3Table &rTable) = delete;
+    CppSQLite3Table(char **paszResults, int nRows, int nCols);
+    ~CppSQLite3Table() noexcept;
+
+    CppSQLite3Table &operator=(CppSQLite3Table &&rTable) noexcept;
+    CppSQLite3Table &operator=(const CppSQLite3Table &rTable) = delete;
+
+    int numFields() const;
+
+    int numRows() const;
+
+    int fieldIndex(std::string_view szField) const;
+
+    std::string fieldName(int nCol);
+
+    std::string fieldValue(int nField) const;
+    std::string fieldValue(const std::string &szField) const;
+
+    int getIntField(int nField, int nNullValue=0) const;
+    int getIntField(const std::string &szField, int nNullValue=0) const;
+
+    double getFloatField(int nField, double fNullValue=0.0) const;
+    double getFloatField(const std::string &szField, double fNullValue=0.0) const;
+
+    const std::string getStringField(int nField, const std::string &szNullValue="") const;
+    const std::string getStringField(const std::string &szField, const std::string &szNullValue="") const;
+
+    bool fieldIsNull(int nField) const;
+    bool fieldIsNull(const std::string &szField) const;
+
+    void setRow(int nRow);
+
+    void finalize();
+
+  private:
+
+    void checkResults() const;
+
+    int mnRows;
+    int mnCols;
+    int mnCurrentRow;
+    char **mpaszResults;
+
+    // Built from the header row on first use
+    mutable std::shared_ptr<CppSQLite3ColumnMap> mpColumns;
+};
+
+
+// Random access result table read with sqlite3_step.
+//
+// Offers the CppSQLite3Table interface, but rather than a malloc'd string
+// per value as sqlite3_get_table produces, each column keeps its values in
+// an array of 8 byte cells (integers and floats in their native types) plus
+// a byte per cell for the storage class. Text and blob values live back to
+// back in a heap shared by all columns.
+class CppSQLite3ColumnarTable
+{
+  public:
+    CppSQLite3ColumnarTable();
+
+    // Reads the current and all remaining rows of rQuery
+    explicit CppSQLite3ColumnarTable(CppSQLite3Query &rQuery);
+
+    int numFields() const;
+
+    int numRows() const;
+
+    int fieldIndex(std::string_view szField) const;
+
+    std::string fieldName(int nCol) const;
+
+    // Storage class of the field in the current row
+    int fieldDataType(int nField) const;
+
+    std::string fieldValue(int nField) const;
+    std::string fieldValue(const std::string &szField) const;
+
+    int getIntField(int nField, int nNullValue=0) const;
+    int getIntField(const std::string &szField, int nNullValue=0) const;
+
+    int64_t getInt64Field(int nField, int64_t nNullValue=0) const;
+    int64_t getInt64Field(const std::string &szField, int64_t nNullValue=0) const;
+
+    double getFloatField(int nField, double fNullValue=0.0) const;
+    double getFloatField(const std::string &szField, double fNullValue=0.0) const;
+
+    const std::string getStringField(int nField, const std::string &szNullValue="") const;
+    const std::string getStringField(const std::string &szField, const std::string &szNullValue="") const;
+
+    // Views are valid until the table is finalized or destroyed. Text views
+    // are NUL terminated.
+    std::string_view getStringView(int nField, std::string_view szNullValue=std::string_view()) const;
+    std::string_view getStringView(const std::string &szField, std::string_view szNullValue=std::string_view()) const;
+
+    CppSQLite3ByteView getBlobView(int nField) const;
+    CppSQLite3ByteView getBlobView(const std::string &szField) const;
+
+    bool fieldIsNull(int nField) const;
+    bool fieldIsNull(const std::string &szField) const;
+
+    void setRow(int nRow);
+
+    void finalize();
+
+  private:
+    struct Column
+    {
+      // int64_t, the bits of a double, or the heap offset of text or a blob
+      std::vector<int64_t> anValues;
+      std::vector<unsigned char> anTypes;
+    };
+
+    void load(sqlite3_stmt *pVM);
+
+    void checkField(int nField) const;
+
+    // Text or blob at heap offset nOffset
+    std::string_view heapValue(int64_t nOffset) const;
+
+    int mnRows;
+    int mnCols;
+    int mnCurrentRow;
+
+    std::vector<std::string> mNames;
+    std::vector<Column> mColumns;
+
+    // Each value is stored as a 4 byte length, the bytes, and a NUL
+    std::vector<char> mHeap;
+
+    CppSQLite3ColumnMap mColumnMap;
+};
+
+
+// Rows of a query stored column by column, as filled by
+// CppSQLite3Query::fetchBatch.
+//
+// INTEGER and FLOAT columns are contiguous arrays of int64_t or double,
+// ready for vectorized loops. TEXT and BLOB columns hold an offset and a
+// length per row into an arena shared by all columns; text is followed by
+// a NUL. Every column also has a bitmap with bit n%64 of word n/64 set
+// when row n is NULL, and NULL rows hold 0 in the arrays.
+//
+// A column is stored as the storage class of its first non-NULL value
+// (SQLITE_NULL until there is one) unless setColumnType chose otherwise.
+// Later values of other classes are converted by SQLite's usual rules.
+// Types persist across fetches, as does allocated memory, so refilling a
+// batch of the same size does not allocate.
+class CppSQLite3ColumnBatch
+{
+  public:
+    CppSQLite3ColumnBatch();
+
+    // Forgets the rows and column types, keeping the memory
+    void reset();
+
+    // Store column nCol as SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or
+    // SQLITE_BLOB whatever its values. Rows already fetched read as 0.
+    void setColumnType(int nCol, int nType);
+
+    int numRows() const { return mnRows; }
+
+    int numFields() const { return static_cast<int>(mColumns.size()); }
+
+    int columnType(int nCol) const;
+
+    bool isNull(int nCol, int nRow) const;
+    const uint64_t *nullBitmap(int nCol) const;
+
+    // Throw unless the column is stored as SQLITE_INTEGER or SQLITE_FLOAT
+    // respectively
+    const int64_t *int64Column(int nCol) const;
+    const double *doubleColumn(int nCol) const;
+
+    // Throw unless the column is stored as SQLITE_TEXT or SQLITE_BLOB
+    const int64_t *offsetColumn(int nCol) const;
+    const int32_t *lengthColumn(int nCol) const;
+
+    const char *arena() const { return mArena.data(); }
+
+    // Valid until the batch is refilled
+    std::string_view stringValue(int nCol, int nRow) const;
+    CppSQLite3ByteView blobValue(int nCol, int nRow) const;
+
+  private:
+    friend class CppSQLite3Query;
+
+    struct Column
+    {
+        Column() : nType(SQLITE_NULL) {}
+
+        int nType;
+        std::vector<uint64_t> anNulls;
+        std::vector<int64_t> anInts;
+        std::vector<double> adFloats;
+        std::vector<int64_t> anOffsets;
+        std::vector<int32_t> anLengths;
+    };
+
+    // Empties the batch to take up to nRows rows of nCols columns
+    void start(int nCols, int nRows);
+
+    // Appends the current row of pVM
+    void append(sqlite3_stmt *pVM);
+
+    // Makes room in the arrays for rColumn's type for nRows rows, and zeroes
+    // the first nFill
+    static void size(Column &rColumn, int nRows, int nFill);
+
+    // Column nCol, checking it is stored as nType1 or nType2
+    const Column &column(int nCol, int nType1, int nType2) const;
+
+    void checkField(int nCol) const;
+    void checkRow(int nRow) const;
+
+    std::vector<Column> mColumns;
+    std::vector<char> mArena;
+    int mnRows;
+
+    // Rows the arrays have room for
+    int mnCapacity;
+};
+
+
+// Whether SQLite copies a text or blob value bound to a statement, or
+// reads it where it is
+enum CppSQLite3BindLifetime
+{
+  // Copied when bound (SQLITE_TRANSIENT)
+  CPPSQLITE_BIND_TRANSIENT,
+
+  // Read in place (SQLITE_STATIC), so the value must stay valid and
+  // unchanged until the parameter is rebound, the bindings are cleared or
+  // the statement is finalized
+  CPPSQLITE_BIND_STATIC
+};
+
+// One parameter's values for every row of CppSQLite3Statement::executeMany.
+//
+// Points at the caller's array of values, and optionally at a NULL bitmap
+// laid out as in CppSQLite3ColumnBatch (bit n%64 of word n/64 set when row
+// n is NULL). Nothing is copied.
+//
+// A column built from a vector knows its length, and executeMany throws if
+// it holds fewer than nRows values. One built from a bare pointer does not,
+// so the array must hold at least nRows values.
+class CppSQLite3ParamColumn
+{
+  public:
+    CppSQLite3ParamColumn(const int64_t *panValues, const uint64_t *pNulls=NULL)
+      : mnType(SQLITE_INTEGER), mpValues(panValues), mpNulls(pNulls), mnValues(SIZE_MAX) {}
+    CppSQLite3ParamColumn(const double *padValues, const uint64_t *pNulls=NULL)
+      : mnType(SQLITE_FLOAT), mpValues(padValues), mpNulls(pNulls), mnValues(SIZE_MAX) {}
+    CppSQLite3ParamColumn(const std::string_view *pValues, const uint64_t *pNulls=NULL)
+      : mnType(SQLITE_TEXT), mpValues(pValues), mpNulls(pNulls), mnValues(SIZE_MAX) {}
+    CppSQLite3ParamColumn(const CppSQLite3ByteView *pValues, const uint64_t *pNulls=NULL)
+      : mnType(SQLITE_BLOB), mpValues(pValues), mpNulls(pNulls), mnValues(SIZE_MAX) {}
+
+    template<class T>
+    CppSQLite3ParamColumn(const std::vector<T> &values, const uint64_t *pNulls=NULL)
+      : CppSQLite3ParamColumn(values.data(), pNulls)
+    {
+      mnValues = values.size();
+    }
+
+  private:
+    friend class CppSQLite3Statement;
+
+    int mnType;
+    const void *mpValues;
+    const uint64_t *mpNulls;
+
+    // Values available, or SIZE_MAX when not known
+    size_t mnValues;
+};
+
+// How CppSQLite3Statement::executeMany runs
+struct CppSQLite3ExecuteManyOptions
+{
+    CppSQLite3ExecuteManyOptions();
+
+    // Run all rows in one transaction, if none is open already
+    bool bTransaction;
+
+    // Bind text and blobs with SQLITE_STATIC rather than having SQLite copy
+    // them. The values must then outlive the call.
+    bool bStatic;
+
+    // Skip rows that fail and carry on, rather than throwing at the first
+    // failure after rolling back the transaction executeMany began. Some
+    // errors, such as SQLITE_FULL, roll back the transaction themselves;
+    // executeMany then throws anyway, as the earlier rows are lost.
+    bool bContinueOnError;
+};
+
+// Outcome of CppSQLite3Statement::executeMany
+struct CppSQLite3ExecuteManyResult
+{
+    // Rows executed successfully, and the number of rows they changed
+    int64_t nRows;
+    int64_t nChanges;
+
+    // Rows that failed, and the first of them, its result code and message.
+    // Only ever set with bContinueOnError.
+    int64_t nFailed;
+    int64_t nFirstFailedRow;
+    int nFirstErrCode;
+    std::string szFirstError;
+};
+
+
+class CppSQLite3Statement
+{
+  public:
+    CppSQLite3Statement();
+
+    // Statements own their VM, so they can be moved but not copied
+    CppSQLite3Statement(CppSQLite3Statement &&rStatement) noexcept;
+    CppSQLite3Statement(const CppSQLite3Statement &rStatement) = delete;
+    CppSQLite3Statement(sqlite3 *pDB, sqlite3_stmt *pVM,
+                        const std::shared_ptr<CppSQLite3StatementCache> &pCache=nullptr,
+                        const std::shared_ptr<CppSQLite3ColumnMap> &pColumns=nullptr);
+    ~CppSQLite3Statement() noexcept;
+
+    CppSQLite3Statement &operator=(CppSQLite3Statement &&rStatement) noexcept;
+    CppSQLite3Statement &operator=(const CppSQLite3Statement &rStatement) = delete;
+
+    int execDML() const;
+
+    CppSQLite3Query execQuery() const;
+
+    // Executes the statement nRows times, binding columns[n] at row r to
+    // parameter n + 1 for the rth execution. Bindings are cleared afterwards.
+    CppSQLite3ExecuteManyResult executeMany(size_t nRows, const std::vector<CppSQLite3ParamColumn> &columns,
+                                            const CppSQLite3ExecuteManyOptions &options=CppSQLite3ExecuteManyOptions());
+
+    void bind(int nParam, const std::string &szValue);
+    void bind(int nParam, const char *szValue);
+    void bind(int nParam, const int nValue);
+    void bind(int nParam, const int64_t nValue);
+    void bind(int nParam, const double dwValue);
+    void bind(int nParam, const unsigned char *blobValue, int nLen);
+    void bindNull(int nParam);
+
+    // Text and blobs of any size, with their length given rather than
+    // found by strlen, so text may contain NULs
+    void bind(int nParam, std::string_view szValue, CppSQLite3BindLifetime nLifetime=CPPSQLITE_BIND_TRANSIENT);
+    void bind(int nParam, CppSQLite3ByteView blobValue, CppSQLite3BindLifetime nLifetime=CPPSQLITE_BIND_TRANSIENT);
+
+    // As above, handing the value over to SQLite, which calls xDestroy on
+    // its data when done with it. xDestroy is called even if binding fails,
+    // but never for NULL data, which binds an empty value.
+    void bind(int nParam, std::string_view szValue, void (*xDestroy)(void*));
+    void bind(int nParam, CppSQLite3ByteView blobValue, void (*xDestroy)(void*));
+
+    // A blob of nBytes zeros, to be filled in place later through
+    // incremental blob I/O without building the value in memory first
+    void bindZeroBlob(int nParam, int64_t nBytes);
+
+    // Binds params to parameters 1, 2, ... in order, each through the
+    // CppSQLite3BindTraits of its type, so types without a bind() overload
+    // can be bound by specializing the traits
+    template<class... Params>
+    void bindAll(const Params&... params);
+
+    // Binds value to the parameter named szName, prefix included, as in
+    // bind(":id", nId)
+    template<class T>
+    void bind(std::string_view szName, const T &value);
+
+    // Index of the parameter named szName, prefix included. Names are
+    // mapped on first use and the map kept until the statement is
+    // finalized. Throws if there is no such parameter.
+    int paramIndex(std::string_view szName) const;
+
+    void clearBindings();
+
+    void reset();
+
+    void finalize();
+
+    // Deprecated in favour of setRetryPolicy. Each replaces the retry
+    // policy with a CppSQLite3FixedRetry built from its value and the
+    // other's last one.
+    void setMaxRetryCount(int nMaxRetryCount);
+
+    void setRetryTimeUs(int nRetryTimeUs);
+
+    // Policy execQuery() follows when the database is busy or locked, and
+    // which it passes on to the query it returns
+    void setRetryPolicy(const std::shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy);
+
+    // Receives retries in execQuery(), and is passed on to its queries
+    void setLogger(const std::shared_ptr<CppSQLite3Logger> &pLogger);
+
+  private:
+    void checkDB() const;
+    void checkVM() const;
+
+    // Throws for a failed sqlite3_bind_* call
+    void checkBind(int nRet) const;
+
+    sqlite3 *mpDB;
+    sqlite3_stmt *mpVM;
+
+    // Cache the VM is returned to on finalize, if it came from one
+    std::shared_ptr<CppSQLite3StatementCache> mpCache;
+
+    // Column name lookup handed to every query this statement executes
+    mutable std::shared_ptr<CppSQLite3ColumnMap> mpColumns;
+
+    // Parameter name lookup, built by the first paramIndex()
+    mutable std::shared_ptr<CppSQLite3ColumnMap> mpParams;
+
+    // Last values given to the deprecated setMaxRetryCount and
+    // setRetryTimeUs, kept only for building their CppSQLite3FixedRetry.
+    // Retries follow mpRetryPolicy alone.
+    int mnMaxRetryCount;
+    int mnRetryTimeUs;
+
+    std::shared_ptr<const CppSQLite3RetryPolicy> mpRetryPolicy;
+
+    std::shared_ptr<CppSQLite3Logger> mpLogger;
+};
+
+
+// Reads and writes one blob value in place, a chunk at a time, so that
+// large values never have to be held in memory whole. Opened with
+// CppSQLite3DB::openBlob.
+//
+// A blob keeps the size it was opened with: writes cannot extend it, so
+// space is made beforehand, for example with bindZeroBlob. The handle
+// expires, and further reads and writes throw SQLITE_ABORT, if the row is
+// changed or deleted by other means.
+class CppSQLite3Blob
+{
+  public:
+    CppSQLite3Blob();
+    CppSQLite3Blob(CppSQLite3Blob &&rBlob) noexcept;
+    CppSQLite3Blob(const CppSQLite3Blob &rBlob) = delete;
+    ~CppSQLite3Blob() noexcept;
+
+    CppSQLite3Blob &operator=(CppSQLite3Blob &&rBlob) noexcept;
+    CppSQLite3Blob &operator=(const CppSQLite3Blob &rBlob) = delete;
+
+    bool isOpen() const { return mpBlob != NULL; }
+
+    bool isWritable() const { return mbWritable; }
+
+    int size() const;
+
+    // Position the next read or write starts at
+    int tell() const { return mnPos; }
+    void seek(int nOffset);
+
+    // Reads up to nBytes from the current position, and returns the number
+    // read, which is 0 at the end of the blob
+    int read(void *pBuffer, int nBytes);
+
+    // Writes nBytes at the current position, which must leave room for them
+    void write(const void *pData, int nBytes);
+
+    // Reads or writes exactly nBytes at nOffset, without moving the position
+    void readAt(int nOffset, void *pBuffer, int nBytes) const;
+    void writeAt(int nOffset, const void *pData, int nBytes);
+
+    // Moves to the same column of row nRowId, which is faster than opening a
+    // new handle. The position goes back to 0.
+    void reopen(sqlite3_int64 nRowId);
+
+    void close();
+
+  private:
+    friend class CppSQLite3DB;
+
+    CppSQLite3Blob(sqlite3 *pDB, sqlite3_blob *pBlob, bool bWritable);
+
+    void checkBlob() const;
+
+    sqlite3 *mpDB;
+    sqlite3_blob *mpBlob;
+    bool mbWritable;
+    int mnSize;
+    int mnPos;
+};
+
+// Buffered std::streambuf over a CppSQLite3Blob, for streaming blobs through
+// iostreams. Reading and writing start at the blob's current position.
+// Writes are flushed by sync(), seeking, reading, reopen() and destruction.
+//
+// Move to another row with reopen() here rather than on the blob: writes
+// still buffered would otherwise land in the new row, at whatever position
+// the blob is at when they are flushed.
+class CppSQLite3BlobStreambuf : public std::streambuf
+{
+  public:
+    explicit CppSQLite3BlobStreambuf(CppSQLite3Blob &blob, size_t nBufferSize=65536);
+    ~CppSQLite3BlobStreambuf();
+
+    // Writes out buffered data, throwing if that fails, then reopens the
+    // blob on row nRowId as CppSQLite3Blob::reopen does
+    void reopen(sqlite3_int64 nRowId);
+
+  protected:
+    int_type underflow();
+    int_type overflow(int_type c);
+    int sync();
+    pos_type seekoff(off_type nOffset, std::ios_base::seekdir nDir, std::ios_base::openmode nMode);
+    pos_type seekpos(pos_type nPos, std::ios_base::openmode nMode);
+
+  private:
+    // Writes out the put area, and leaves it empty. False on failure.
+    bool flushPut();
+
+    // Discards the get area, moving the blob back to the first unread byte
+    void dropGet();
+
+    CppSQLite3Blob &mBlob;
+    std::vector<char> mBuffer;
+};
+
+
+// How CppSQLite3DB::backup and restore copy a database
+struct CppSQLite3BackupOptions
+{
+    // Copies everything in one step, as backup(target) does
+    CppSQLite3BackupOptions();
+
+    // Pages copied per step, or -1 for all of them at once. The source is
+    // only read locked during a step, so smaller steps let writers on other
+    // connections in between. If they change the database, copying starts
+    // over.
+    int nPagesPerStep;
+
+    // Pause between steps. With none, the thread still yields.
+    int64_t nStepDelayUs;
+
+    // Upper bound on pages copied per second, or 0 for none
+    int64_t nMaxPagesPerSecond;
+
+    // Called after each step that leaves pages to copy, with the pages left
+    // and the pages in the source. Returning false cancels the copy, leaving
+    // the destination as it was.
+    std::function<bool(int nRemaining, int nTotal)> fnProgress;
+
+    // Journal mode to give the backup file before copying, such as "WAL",
+    // or empty to leave it as it is. Not used by restore.
+    std::string szJournalMode;
+};
+
+// How CppSQLite3DB::open opens a connection and tunes it. Pragmas left
+// unset keep SQLite's defaults; those that are set run in one batch as the
+// connection opens.
+struct CppSQLite3OpenOptions
+{
+    // Read-write, creating the file if need be, with nothing tuned, as
+    // open(szFile) does
+    CppSQLite3OpenOptions();
+
+    // Many concurrent readers: WAL, synchronous NORMAL, a 256MB memory map,
+    // a 64MB page cache and temporary tables in memory
+    static CppSQLite3OpenOptions readHeavy();
+
+    // Loading large amounts of data: the rollback journal kept in memory,
+    // no syncs, a 256MB page cache and temporary tables in memory. A crash
+    // or power loss during the load can corrupt the database, so keep this
+    // for files that can be rebuilt.
+    static CppSQLite3OpenOptions bulkLoad();
+
+    // Transactions that must survive power loss: WAL, synchronous FULL and
+    // a 16MB page cache
+    static CppSQLite3OpenOptions durableOLTP();
+
+    // Files that never change while open: read-only and immutable, with no
+    // mutex, the whole file memory mapped as far as SQLITE_MAX_MMAP_SIZE
+    // allows, a 1MB page cache and temporary tables in memory.
+    // Connections read pages from the map, which the OS page cache shares
+    // between them, instead of copying them into caches of their own.
+    static CppSQLite3OpenOptions snapshot();
+
+    // One of the presets above by name: "read-heavy", "bulk-load",
+    // "durable-OLTP" or "snapshot". Throws for any other name.
+    static CppSQLite3OpenOptions preset(const std::string &szName);
+
+    // SQLITE_OPEN_READONLY in place of SQLITE_OPEN_READWRITE
+    bool bReadOnly;
+
+    // SQLITE_OPEN_CREATE, ignored when read-only
+    bool bCreate;
+
+    // SQLITE_OPEN_NOMUTEX, for connections only ever used by one thread at
+    // a time, or SQLITE_OPEN_FULLMUTEX. With neither, SQLite's threading
+    // mode decides.
+    bool bNoMutex;
+    bool bFullMutex;
+
+    // SQLITE_OPEN_URI, so the file may be a file: URI with query parameters
+    bool bUri;
+
+    // SQLITE_OPEN_SHAREDCACHE
+    bool bSharedCache;
+
+    // Opens the file through a URI with immutable=1, so SQLite takes no
+    // locks and never looks for a journal. The file must not change while
+    // the connection is open: changes would be missed or read as
+    // corruption.
+    bool bImmutable;
+
+    // Name of the VFS to open the file with, or empty for the default
+    std::string szVfs;
+
+    // PRAGMA mmap_size, in bytes
+    std::optional<int64_t> nMmapSize;
+
+    // PRAGMA cache_size: pages if positive, KiB if negative
+    std::optional<int> nCacheSize;
+
+    // PRAGMA page_size, which only changes a database with no tables yet,
+    // or at the next VACUUM if it is not in WAL mode
+    std::optional<int> nPageSize;
+
+    // PRAGMA journal_mode, synchronous and temp_store values, such as
+    // "WAL", "NORMAL" and "MEMORY", or empty to leave them be
+    std::string szJournalMode;
+    std::string szSynchronous;
+    std::string szTempStore;
+
+    // Busy timeout to set in place of the connection's current one
+    std::optional<int> nBusyTimeoutMs;
+};
+
+
+class CppSQLite3DB
+{
+  public:
+    CppSQLite3DB();
+    ~CppSQLite3DB();
+
+    void open(const std::string &szFile);
+
+    void open(const std::string &szFile, const CppSQLite3OpenOptions &options);
+
+    void close();
+
+    bool tableExists(const std::string &szTable) const;
+
+    int execDML(const std::string &szSQL);
+
+    CppSQLite3Query execQuery(const std::string &szSQL) const;
+
+    // As above, but following pRetryPolicy instead of the connection's
+    // policy when the database is busy or locked
+    int execDML(const std::string &szSQL, const std::shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy);
+
+    CppSQLite3Query execQuery(const std::string &szSQL,
+                              const std::shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy) const;
+
+    int execScalar(const std::string &szSQL) const;
+
+    // Runs szSQL with params bound to its parameters in order, through
+    // CppSQLite3BindTraits, and returns the first column of the first row
+    // through CppSQLite3ColumnTraits, stepping a cached statement once.
+    // Throws if there is no row.
+    template<class T, class... Params>
+    T scalar(const std::string &szSQL, const Params&... params) const;
+
+    // As scalar, but empty if there is no row or the value is NULL
+    template<class T, class... Params>
+    std::optional<T> scalarOpt(const std::string &szSQL, const Params&... params) const;
+
+    CppSQLite3Table getTable(const std::string &szSQL) const;
+
+    // Like getTable, but stepping the query and storing values natively
+    CppSQLite3ColumnarTable getColumnarTable(const std::string &szSQL) const;
+
+    CppSQLite3Statement compileStatement(const std::string &szSQL) const;
+
+    // Opens the blob in szColumn of row nRowId of szTable in database szDB
+    // for incremental I/O
+    CppSQLite3Blob openBlob(const std::string &szTable, const std::string &szColumn, sqlite3_int64 nRowId,
+                            bool bWritable=false, const std::string &szDB="main") const;
+
+    sqlite_int64 lastRowId() const;
+
+    // False while a transaction started with BEGIN is open
+    bool isAutoCommit() const;
+
+    void interrupt();
+
+    void setBusyTimeout(int nMillisecs);
+
+    // Deprecated in favour of setRetryPolicy. Each replaces the retry
+    // policy with a CppSQLite3FixedRetry built from its value and the
+    // other's last one.
+    void setMaxRetryCount(int nMaxRetryCount);
+
+    void setRetryTimeUs(int nRetryTimeUs);
+
+    // Policy followed when the database is busy or locked, which queries and
+    // statements inherit when they are created. nullptr disables retries.
+    void setRetryPolicy(const std::shared_ptr<const CppSQLite3RetryPolicy> &pRetryPolicy);
+
+    const std::shared_ptr<const CppSQLite3RetryPolicy> &retryPolicy() const { return mpRetryPolicy; }
+
+    // Receives the connection's retries and rollbacks, and those of the
+    // queries and statements created after it is set. nullptr, the default,
+    // logs nothing.
+    void setLogger(const std::shared_ptr<CppSQLite3Logger> &pLogger);
+
+    const std::shared_ptr<CppSQLite3Logger> &logger() const { return mpLogger; }
+
+    // Records every statement run on the connection in pProfiler, including
+    // those of queries and statements already created. nullptr, the default,
+    // turns profiling off.
+    void setProfiler(const std::shared_ptr<CppSQLite3Profiler> &pProfiler);
+
+    const std::shared_ptr<CppSQLite3Profiler> &profiler() const { return mpProfiler; }
+
+    // Number of prepared statements kept for reuse by execQuery, execDML and
+    // compileStatement. 0 disables the cache.
+    void setStatementCacheSize(int nStatements);
+
+    // Finalizes every idle statement held by the cache
+    void clearStatementCache();
+
+    const CppSQLite3StatementCache &statementCache() const;
+
+    static const char *SQLiteVersion() { return SQLITE_VERSION; }
+
+    // Backup DB to the file target
+    //
+    // Contents of the file target are overwritten
+    void backup(const std::string &target);
+
+    // Restore from a backup DB in file target
+    //
+    // Contents of the local database mpDB are overwritten
+    void restore(const std::string &target);
+
+    // Incremental versions of the above. Return false if options.fnProgress
+    // cancelled the copy.
+    bool backup(const std::string &target, const CppSQLite3BackupOptions &options);
+    bool restore(const std::string &target, const CppSQLite3BackupOptions &options);
+
+  private:
+    CppSQLite3DB(const CppSQLite3DB &db);
+    CppSQLite3DB &operator=(const CppSQLite3DB &db);
+
+    // Prepares szSQL, reusing a cached statement if there is one. bCached is
+    // set when the statement should be released to mpCache rather than
+    // finalized, and pColumns to the column map cached with it.
+    sqlite3_stmt *compile(const std::string &szSQL, bool &bCached,
+                          std::shared_ptr<CppSQLite3ColumnMap> &pColumns) const;
+
+    // Steps a cached statement to completion and releases it
+    int execDML(sqlite3_stmt *pVM, const std::shared_ptr<CppSQLite3ColumnMap> &pColumns,
+                const CppSQLite3RetryPolicy *pRetryPolicy);
+
+    // Runs szSQL with params bound and reads its first column into value,
+    // left empty if the value is NULL and bNullEmpty. False if no row.
+    template<class T, class... Params>
+    bool readScalar(std::optional<T> &value, bool bNullEmpty, const std::string &szSQL,
+                    const Params&... params) const;
+
+    // Throws for a failed bind of a scalar query's parameter
+    void checkBind(int nRet) const;
+
+    // Steps a scalar query, retrying as the retry policy says. False if it
+    // returned no row.
+    bool stepScalar(sqlite3_stmt *pVM) const;
+
+    // Returns a compiled statement to the cache, or finalizes it
+    void release(sqlite3_stmt *pVM, bool bCached, const std::shared_ptr<CppSQLite3ColumnMap> &pColumns) const;
+
+    // Backup or restore the local DB to target.
+    //
+    // Copies options.nPagesPerStep pages per sqlite3_backup_step command
+    // Supports backup to or from in-memory databases
+    bool backupOrRestore(const std::string &target, bool isBackup, const CppSQLite3BackupOptions &options);
+
+    void checkDB() const;
+
+    // Registers or removes the trace callback feeding mpProfiler
+    void installProfiler();
+
+    // Rolls back the open transaction after an nErrCode failure
+    void rollback(int nErrCode) const;
+
+    sqlite3 *mpDB;
+
+    // How long before timing out most operations
+    int mnBusyTimeoutMs;
+
+    // Last values given to the deprecated setMaxRetryCount and
+    // setRetryTimeUs, kept only for building their CppSQLite3FixedRetry.
+    // Retries follow mpRetryPolicy alone.
+    int mnMaxRetryCount;
+    int mnRetryTimeUs;
+
+    std::shared_ptr<const CppSQLite3RetryPolicy> mpRetryPolicy;
+
+    std::shared_ptr<CppSQLite3Logger> mpLogger;
+
+    std::shared_ptr<CppSQLite3Profiler> mpProfiler;
+
+    // Context of the trace callback while profiling
+    std::shared_ptr<CppSQLite3ProfilerHook> mpProfilerHook;
+
+    // Capacity of the prepared statement cache
+    int mnStatementCacheSize;
+
+    std::shared_ptr<CppSQLite3StatementCache> mpCache;
+};
+
+// Holds a transaction open for its lifetime, rolling it back on destruction
+// unless commit() succeeded.
+//
+// DEFERRED takes locks as statements need them, so a transaction that reads
+// and then writes can fail with SQLITE_BUSY when another connection wrote
+// in between, and retrying cannot help. Transactions that will write should
+// be IMMEDIATE, which takes the write lock up front, waiting on it by the
+// connection's retry policy.
+//
+// The BEGIN, COMMIT and ROLLBACK statements come from the connection's
+// statement cache.
+class CppSQLite3Transaction
+{
+  public:
+    enum Mode { DEFERRED, IMMEDIATE, EXCLUSIVE };
+
+    explicit CppSQLite3Transaction(CppSQLite3DB &db, Mode nMode=DEFERRED);
+    CppSQLite3Transaction(const CppSQLite3Transaction &rTransaction) = delete;
+    ~CppSQLite3Transaction() noexcept;
+
+    CppSQLite3Transaction &operator=(const CppSQLite3Transaction &rTransaction) = delete;
+
+    // Throws if the commit fails, leaving the transaction open
+    void commit();
+
+    void rollback();
+
+    bool isActive() const { return mbActive; }
+
+  private:
+    CppSQLite3DB &mDB;
+    bool mbActive;
+};
+
+// Holds a savepoint for its lifetime, rolling back to it on destruction
+// unless release() succeeded. Savepoints nest, inside a transaction or each
+// other; outside any, the first one begins a deferred transaction.
+//
+// Guards release in the reverse order they were created, so they can share
+// one name, and with it the cached statements.
+class CppSQLite3Savepoint
+{
+  public:
+    explicit CppSQLite3Savepoint(CppSQLite3DB &db, const std::string &szName="cppsqlite3_savepoint");
+    CppSQLite3Savepoint(const CppSQLite3Savepoint &rSavepoint) = delete;
+    ~CppSQLite3Savepoint() noexcept;
+
+    CppSQLite3Savepoint &operator=(const CppSQLite3Savepoint &rSavepoint) = delete;
+
+    // Keeps the changes made since the savepoint, as part of the enclosing
+    // transaction or savepoint, if any
+    void release();
+
+    // Undoes the changes made since the savepoint, and releases it
+    void rollback();
+
+    bool isActive() const { return mbActive; }
+
+  private:
+    CppSQLite3DB &mDB;
+    std::string mszName;
+    bool mbActive;
+};
+
+// Inserts many rows through a single prepared statement.
+//
+// Rows are grouped into transactions of nBatchSize rows, unless a
+// transaction is already open on the database when a batch starts, in which
+// case the rows simply become part of it. The statement is reset and its
+// bindings cleared after every row.
+class CppSQLite3BulkInserter
+{
+  public:
+    CppSQLite3BulkInserter(CppSQLite3DB &db, const std::string &szSQL, int nBatchSize=10000);
+
+    // Commits any rows still pending
+    ~CppSQLite3BulkInserter();
+
+    // Statement to bind the next row's values to before calling insert()
+    CppSQLite3Statement &statement() { return mStatement; }
+
+    // Inserts a row using the values currently bound to statement().
+    //
+    // If the insert fails, the batch it belongs to is rolled back before the
+    // exception is rethrown.
+    void insert();
+
+    // Calls fnBindRow(statement(), *it) for every element of [first, last)
+    // and inserts it. Returns the number of rows inserted.
+    template<class Iterator, class Binder>
+    int64_t insert(Iterator first, Iterator last, Binder fnBindRow);
+
+    // Calls fnNextRow(statement()) until it returns false, inserting a row
+    // after every call that returns true. Returns the number of rows inserted.
+    template<class Source>
+    int64_t insertFrom(Source fnNextRow);
+
+    // Commits the current batch
+    void flush();
+
+    // Rows inserted and committed or pending in the current batch
+    int64_t rowCount() const { return mnRows; }
+
+    // Time since construction, up to the last flush once nothing is pending
+    double elapsedSeconds() const;
+
+    double rowsPerSecond() const;
+
+  private:
+    CppSQLite3BulkInserter(const CppSQLite3BulkInserter &inserter);
+    CppSQLite3BulkInserter &operator=(const CppSQLite3BulkInserter &inserter);
+
+    void rollback();
+
+    CppSQLite3DB &mDB;
+    CppSQLite3Statement mStatement;
+    int mnBatchSize;
+
+    // Rows inserted since the current batch began
+    int mnBatchRows;
+
+    // Whether the current batch issued its own BEGIN
+    bool mbOwnTransaction;
+
+    int64_t mnRows;
+
+    std::chrono::steady_clock::time_point mStart;
+    std::chrono::steady_clock::time_point mLastFlush;
+};
+
+template<class Iterator, class Binder>
+int64_t CppSQLite3BulkInserter::insert(Iterator first, Iterator last, Binder fnBindRow)
+{
+  int64_t nRows = 0;
+
+  for (; first != last; ++first) {
+    fnBindRow(mStatement, *first);
+    insert();
+    nRows++;
+  }
+
+  return nRows;
+}
+
+template<class Source>
+int64_t CppSQLite3BulkInserter::insertFrom(Source fnNextRow)
+{
+  int64_t nRows = 0;
+
+  while (fnNextRow(mStatement)) {
+    insert();
+    nRows++;
+  }
+
+  return nRows;
+}
+
+// Wait and utilization figures for one kind of pooled connection
+struct CppSQLite3PoolStats
+{
+    int nConnections;
+
+    // Connections leased right now
+    int nInUse;
+
+    // Leases handed out, and how many of them had to wait for a connection
+    uint64_t nLeases;
+    uint64_t nWaits;
+
+    // Total and longest time spent waiting for a connection
+    int64_t nWaitUs;
+    int64_t nMaxWaitUs;
+
+    // Fraction of the connections' time spent leased since the pool opened
+    double fUtilization;
+};
+
+// Owns one writer and nReaders reader connections to the same database
+// file, and leases them to threads one at a time.
+//
+// The file is switched to WAL journaling, so readers do not block the writer
+// or each other and reads scale across threads, while writes are
+// serialized through the single writer instead of contending for the
+// database lock. Reader connections are opened with PRAGMA query_only.
+// With no readers, reader() leases the writer.
+//
+// The pool must outlive the leases it hands out.
+class CppSQLite3Pool
+{
+  public:
+    // Called on every connection once it is open, before it is first leased,
+    // to set pragmas, the busy timeout, the statement cache size and so on
+    typedef std::function<void(CppSQLite3DB &db, bool bWriter)> Setup;
+
+    // Gives its thread exclusive use of a pooled connection, and returns it
+    // to the pool when destroyed
+    class Lease
+    {
+      public:
+        Lease();
+        Lease(Lease &&rLease);
+        Lease &operator=(Lease &&rLease);
+        ~Lease();
+
+        CppSQLite3DB &db() const { return *mpDB; }
+        CppSQLite3DB &operator*() const { return *mpDB; }
+        CppSQLite3DB *operator->() const { return mpDB; }
+
+        bool isWriter() const { return mbWriter; }
+
+        // Returns the connection to the pool early
+        void release();
+
+      private:
+        friend class CppSQLite3Pool;
+
+        Lease(CppSQLite3Pool *pPool, CppSQLite3DB *pDB, bool bWriter);
+        Lease(const Lease &rLease);
+        Lease &operator=(const Lease &rLease);
+
+        CppSQLite3Pool *mpPool;
+        CppSQLite3DB *mpDB;
+        bool mbWriter;
+        std::chrono::steady_clock::time_point mLeased;
+    };
+
+    CppSQLite3Pool(const std::string &szFile, int nReaders, const Setup &fnSetup=nullptr);
+    ~CppSQLite3Pool();
+
+    // Lease the writer or a reader, waiting up to nTimeoutUs for one to be
+    // returned (forever if negative). Throws if none became free in time.
+    Lease writer(int64_t nTimeoutUs=-1);
+    Lease reader(int64_t nTimeoutUs=-1);
+
+    CppSQLite3PoolStats writerStats() const;
+    CppSQLite3PoolStats readerStats() const;
+
+  private:
+    CppSQLite3Pool(const CppSQLite3Pool &pool);
+    CppSQLite3Pool &operator=(const CppSQLite3Pool &pool);
+
+    // Bookkeeping for the writer or for the readers
+    struct Role
+    {
+        std::condition_variable cvFree;
+        std::vector<CppSQLite3DB*> idle;
+        int nConnections;
+        int nInUse;
+        uint64_t nLeases;
+        uint64_t nWaits;
+        int64_t nWaitUs;
+        int64_t nMaxWaitUs;
+
+        // Leased time of returned leases, and the sum of the lease times of
+        // those still out, in microseconds since the pool opened
+        int64_t nBusyUs;
+        int64_t nLeasedAtUs;
+    };
+
+    Lease acquire(Role &role, bool bWriter, int64_t nTimeoutUs);
+    void release(CppSQLite3DB *pDB, bool bWriter, std::chrono::steady_clock::time_point leased);
+    CppSQLite3PoolStats stats(const Role &role) const;
+    int64_t sinceOpenUs(std::chrono::steady_clock::time_point when) const;
+
+    std::vector<std::unique_ptr<CppSQLite3DB> > mConnections;
+
+    mutable std::mutex mMutex;
+    Role mWriter;
+    Role mReaders;
+
+    std::chrono::steady_clock::time_point mOpened;
+};
+
+// How CppSQLite3WriteQueue groups requests into transactions
+struct CppSQLite3WriteQueueOptions
+{
+    CppSQLite3WriteQueueOptions();
+
+    // Most requests committed together
+    size_t nMaxBatchRequests;
+
+    // Most bytes committed together, by the submitters' estimates
+    size_t nMaxBatchBytes;
+
+    // How long a batch is held open for more requests once the queue runs
+    // dry. 0, the default, commits as soon as it does, which still groups
+    // whatever arrives while the previous batch commits.
+    int nMaxDelayUs;
+};
+
+struct CppSQLite3WriteQueueStats
+{
+    // Requests committed, and failed or rolled back
+    uint64_t nCommitted;
+    uint64_t nFailed;
+
+    // Transactions committed, and the most requests in one
+    uint64_t nBatches;
+    uint64_t nLargestBatch;
+};
+
+// Owns a writer connection and runs the writes that any thread submits to
+// it on a thread of its own, many to a transaction, so that they share one
+// commit and one sync instead of paying for their own.
+//
+// Submitting takes no lock unless the writer thread is asleep. Batches are
+// IMMEDIATE transactions, and each request runs in a savepoint: one that
+// throws is rolled back alone and its future gets the exception, while the
+// rest of the batch carries on. A request's future is fulfilled once its
+// batch has committed, or gets the exception if the commit failed or an
+// error rolled the whole transaction back.
+//
+// The file is switched to WAL journaling, as by CppSQLite3Pool.
+class CppSQLite3WriteQueue
+{
+  public:
+    // Makes the request's changes and returns the number of rows changed,
+    // which becomes the value of its future
+    typedef std::function<int(CppSQLite3DB &db)> Write;
+
+    typedef std::function<void(CppSQLite3Statement &stmt)> Bind;
+
+    typedef std::function<void(CppSQLite3DB &db)> Setup;
+
+    explicit CppSQLite3WriteQueue(const std::string &szFile,
+                                  const CppSQLite3WriteQueueOptions &options=CppSQLite3WriteQueueOptions(),
+                                  const Setup &fnSetup=nullptr);
+
+    // Runs the requests already submitted, then closes the connection
+    ~CppSQLite3WriteQueue();
+
+    CppSQLite3WriteQueue(const CppSQLite3WriteQueue &rQueue) = delete;
+    CppSQLite3WriteQueue &operator=(const CppSQLite3WriteQueue &rQueue) = delete;
+
+    // Queues fnWrite to run on the writer connection. nBytes estimates the
+    // data it writes, for nMaxBatchBytes.
+    std::future<int> submit(Write fnWrite, size_t nBytes=0);
+
+    // Queues a run of szSQL, with parameters bound by fnBind
+    std::future<int> submit(const std::string &szSQL, Bind fnBind=nullptr);
+
+    // Runs the requests already submitted and stops the writer thread.
+    // Submitting afterwards throws.
+    void close();
+
+    CppSQLite3WriteQueueStats stats() const;
+
+  private:
+    struct Request
+    {
+        std::atomic<Request*> pNext;
+        Write fnWrite;
+        size_t nBytes;
+        std::promise<int> result;
+    };
+
+    // Intrusive multi-producer, single-consumer queue after Dmitry Vyukov.
+    // Producers swap themselves into mpHead; only the writer thread pops.
+    void push(Request *pRequest);
+
+    // NULL when empty, or for a moment while a push is half done
+    Request *pop();
+
+    void run();
+    void runBatch(Request *pFirst);
+
+    // Sleeps until a request is queued, the queue is closed, or until
+    // deadline if one is given. False if nothing was queued.
+    bool waitForRequest(const std::chrono::steady_clock::time_point *pDeadline);
+
+    CppSQLite3DB mDB;
+    CppSQLite3WriteQueueOptions mOptions;
+
+    std::atomic<Request*> mpHead;
+    Request *mpTail;
+    Request mStub;
+
+    // Requests pushed and not yet popped
+    std::atomic<int64_t> mnQueued;
+
+    // Submits past the closed check that may not have pushed yet
+    std::atomic<int> mnSubmitting;
+
+    std::atomic<bool> mbClosed;
+    std::atomic<bool> mbSleeping;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+
+    std::atomic<uint64_t> mnCommitted;
+    std::atomic<uint64_t> mnFailed;
+    std::atomic<uint64_t> mnBatches;
+    std::atomic<uint64_t> mnLargestBatch;
+
+    std::thread mThread;
+};
+
+// Lets the caller of an asynchronous query stop it, before it starts or
+// while it runs, by interrupting the connection running it. Its result then
+// gets an SQLITE_INTERRUPT exception.
+class CppSQLite3CancelToken
+{
+  public:
+    CppSQLite3CancelToken();
+
+    CppSQLite3CancelToken(const CppSQLite3CancelToken &token) = delete;
+    CppSQLite3CancelToken &operator=(const CppSQLite3CancelToken &token) = delete;
+
+    void cancel();
+
+    bool isCancelled() const;
+
+  private:
+    friend class CppSQLite3AsyncExecutor;
+
+    // Names the connection the query is about to run on, or NULL once it
+    // has finished. False if the token was cancelled first.
+    bool attach(CppSQLite3DB *pDB);
+
+    mutable std::mutex mMutex;
+    bool mbCancelled;
+    CppSQLite3DB *mpDB;
+};
+
+// Result of an asynchronous call, made on a worker thread and handed over
+// once the worker has returned its connection to the pool
+template<class R>
+class CppSQLite3AsyncResult
+{
+  public:
+    template<class F>
+    void run(F &fn, CppSQLite3DB &db) { mValue.emplace(fn(db)); }
+
+    void fulfil(std::promise<R> &result) { result.set_value(std::move(*mValue)); }
+
+    R take() { return std::move(*mValue); }
+
+  private:
+    std::optional<R> mValue;
+};
+
+template<>
+class CppSQLite3AsyncResult<void>
+{
+  public:
+    template<class F>
+    void run(F &fn, CppSQLite3DB &db) { fn(db); }
+
+    void fulfil(std::promise<void> &result) { result.set_value(); }
+
+    void take() {}
+};
+
+#ifdef CPPSQLITE_COROUTINES
+template<class R>
+class CppSQLite3Awaitable;
+#endif
+
+// Runs queries for threads that must not block, such as event loops, on
+// worker threads of its own, each of which leases a connection from a pool
+// for the length of a call. Submitting only queues the call and returns a
+// future for its result, or under C++20 an awaitable.
+//
+// Calls start in the order they were submitted, as workers and connections
+// become free. Reads lease a reader and writes the writer, so writes run
+// one at a time; nThreads beyond the pool's connections only wait.
+//
+// The pool must outlive the executor.
+class CppSQLite3AsyncExecutor
+{
+  public:
+    // Runs fnResume on the caller's event loop
+    typedef std::function<void(std::function<void()> fnResume)> Post;
+
+    // Gets each chunk of a streamed query, and returns false to stop it
+    typedef std::function<bool(const CppSQLite3ColumnBatch &batch)> Chunk;
+
+    // Coroutines awaiting a call resume through fnPost if it is given, and
+    // otherwise on the worker thread that ran the call
+    CppSQLite3AsyncExecutor(CppSQLite3Pool &pool, int nThreads, const Post &fnPost=nullptr);
+
+    // Runs the calls already submitted, then stops the workers
+    ~CppSQLite3AsyncExecutor();
+
+    CppSQLite3AsyncExecutor(const CppSQLite3AsyncExecutor &executor) = delete;
+    CppSQLite3AsyncExecutor &operator=(const CppSQLite3AsyncExecutor &executor) = delete;
+
+    // Queues fn(db) to run on a reader, or on the writer if bWriter, and
+    // returns its result or exception through the future. fn is copied.
+    template<class F>
+    auto submit(F fn, bool bWriter=false, const std::shared_ptr<CppSQLite3CancelToken> &pCancel=nullptr)
+      -> std::future<std::decay_t<decltype(fn(std::declval<CppSQLite3DB&>()))> >;
+
+    // Reads every row of szSQL on a reader
+    std::future<CppSQLite3ColumnarTable> query(const std::string &szSQL,
+                                               const std::shared_ptr<CppSQLite3CancelToken> &pCancel=nullptr);
+
+    // Runs szSQL on the writer and returns the number of rows changed
+    std::future<int> execDML(const std::string &szSQL,
+                             const std::shared_ptr<CppSQLite3CancelToken> &pCancel=nullptr);
+
+    // Reads the rows of szSQL on a reader, nChunkRows at a time, and calls
+    // fnChunk with each chunk on the worker thread, until the rows run out
+    // or fnChunk returns false. The future gets the number of rows read.
+    std::future<int64_t> stream(const std::string &szSQL, int nChunkRows, Chunk fnChunk,
+                                const std::shared_ptr<CppSQLite3CancelToken> &pCancel=nullptr);
+
+#ifdef CPPSQLITE_COROUTINES
+    // As submit(), for co_await. The call is queued when the coroutine
+    // suspends on it.
+    template<class F>
+    auto async(F fn, bool bWriter=false, const std::shared_ptr<CppSQLite3CancelToken> &pCancel=nullptr)
+      -> CppSQLite3Awaitable<std::decay_t<decltype(fn(std::declval<CppSQLite3DB&>()))> >;
+#endif
+
+    // Runs the calls already submitted and stops the workers. Submitting
+    // afterwards throws.
+    void close();
+
+  private:
+#ifdef CPPSQLITE_COROUTINES
+    template<class R>
+    friend class CppSQLite3Awaitable;
+#endif
+
+    typedef std::function<void(CppSQLite3DB &db)> Run;
+
+    // Gets the exception fnRun threw, or NULL
+    typedef std::function<void(std::exception_ptr error)> Done;
+
+    struct Call
+    {
+        bool bWriter;
+        std::shared_ptr<CppSQLite3CancelToken> pCancel;
+        Run fnRun;
+        Done fnDone;
+    };
+
+    // Queues a call. Its fnDone runs once the connection is back in the pool.
+    void dispatch(bool bWriter, const std::shared_ptr<CppSQLite3CancelToken> &pCancel, Run fnRun, Done fnDone);
+
+    void resume(std::function<void()> fnResume);
+
+    void run();
+    void runCall(Call &call);
+
+    CppSQLite3Pool &mPool;
+    Post mfnPost;
+
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<Call> mCalls;
+    bool mbClosed;
+
+    std::vector<std::thread> mThreads;
+};
+
+// Serves a database file that never changes, such as reference data built
+// once and shipped, to any number of threads. Each thread gets a connection
+// of its own, opened with CppSQLite3OpenOptions::snapshot(), so lookups
+// share nothing but the OS page cache and scale with the threads.
+//
+// A thread's connection closes when the thread exits or the reader is
+// destroyed, whichever comes first. The reader must outlive its use.
+class CppSQLite3SnapshotReader
+{
+  public:
+    // Called on every connection once it is open
+    typedef std::function<void(CppSQLite3DB &db)> Setup;
+
+    explicit CppSQLite3SnapshotReader(const std::string &szFile,
+                                      const CppSQLite3OpenOptions &options=CppSQLite3OpenOptions::snapshot(),
+                                      const Setup &fnSetup=nullptr);
+    ~CppSQLite3SnapshotReader();
+
+    CppSQLite3SnapshotReader(const CppSQLite3SnapshotReader &reader) = delete;
+    CppSQLite3SnapshotReader &operator=(const CppSQLite3SnapshotReader &reader) = delete;
+
+    // The calling thread's connection, opened on its first call
+    CppSQLite3DB &connection();
+
+    // Connections open, one per thread that has called connection()
+    int connectionCount() const;
+
+  private:
+    struct Connections;
+    struct ThreadConnections;
+
+    static ThreadConnections &threadConnections();
+
+    std::string mszFile;
+    CppSQLite3OpenOptions mOptions;
+    Setup mfnSetup;
+
+    // Tells the thread-local connections of this reader from those of one
+    // destroyed before it at the same address
+    uint64_t mnId;
+
+    std::shared_ptr<Connections> mpConnections;
+};
+
+template<class F>
+auto CppSQLite3AsyncExecutor::submit(F fn, bool bWriter, const std::shared_ptr<CppSQLite3CancelToken> &pCancel)
+  -> std::future<std::decay_t<decltype(fn(std::declval<CppSQLite3DB&>()))> >
+{
+  typedef std::decay_t<decltype(fn(std::declval<CppSQLite3DB&>()))> R;
+
+  std::shared_ptr<CppSQLite3AsyncResult<R> > pResult = std::make_shared<CppSQLite3AsyncResult<R> >();
+  std::shared_ptr<std::promise<R> > pPromise = std::make_shared<std::promise<R> >();
+  std::future<R> result = pPromise->get_future();
+
+  dispatch(bWriter, pCancel,
+           [pResult, fn](CppSQLite3DB &db) mutable { pResult->run(fn, db); },
+           [pResult, pPromise](std::exception_ptr error) {
+             if (error) {
+               pPromise->set_exception(error);
+             } else {
+               pResult->fulfil(*pPromise);
+             }
+           });
+
+  return result;
+}
+
+#ifdef CPPSQLITE_COROUTINES
+// Returned by CppSQLite3AsyncExecutor::async(). Awaiting it queues the call
+// and suspends the coroutine until the call has run.
+template<class R>
+class CppSQLite3Awaitable
+{
+  public:
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle);
+
+    R await_resume();
+
+  private:
+    friend class CppSQLite3AsyncExecutor;
+
+    struct State
+    {
+        CppSQLite3AsyncResult<R> result;
+        std::exception_ptr error;
+    };
+
+    CppSQLite3Awaitable(CppSQLite3AsyncExecutor *pExecutor, bool bWriter,
+                        const std::shared_ptr<CppSQLite3CancelToken> &pCancel,
+                        std::function<R(CppSQLite3DB &db)> fn)
+      : mpExecutor(pExecutor), mbWriter(bWriter), mpCancel(pCancel), mfn(std::move(fn)),
+        mpState(std::make_shared<State>()) {}
+
+    CppSQLite3AsyncExecutor *mpExecutor;
+    bool mbWriter;
+    std::shared_ptr<CppSQLite3CancelToken> mpCancel;
+    std::function<R(CppSQLite3DB &db)> mfn;
+    std::shared_ptr<State> mpState;
+};
+
+template<class R>
+void CppSQLite3Awaitable<R>::await_suspend(std::coroutine_handle<> handle)
+{
+  // The coroutine may resume, and destroy this, before dispatch() returns
+  std::shared_ptr<State> pState = mpState;
+  std::function<R(CppSQLite3DB &db)> fn = mfn;
+  CppSQLite3AsyncExecutor *pExecutor = mpExecutor;
+
+  pExecutor->dispatch(mbWriter, mpCancel,
+                      [pState, fn](CppSQLite3DB &db) mutable { pState->result.run(fn, db); },
+                      [pState, pExecutor, handle](std::exception_ptr error) {
+                        pState->error = error;
+                        pExecutor->resume([handle]() { handle.resume(); });
+                      });
+}
+
+template<class R>
+R CppSQLite3Awaitable<R>::await_resume()
+{
+  if (mpState->error) {
+    std::rethrow_exception(mpState->error);
+  }
+
+  return mpState->result.take();
+}
+
+template<class F>
+auto CppSQLite3AsyncExecutor::async(F fn, bool bWriter, const std::shared_ptr<CppSQLite3CancelToken> &pCancel)
+  -> CppSQLite3Awaitable<std::decay_t<decltype(fn(std::declval<CppSQLite3DB&>()))> >
+{
+  typedef std::decay_t<decltype(fn(std::declval<CppSQLite3DB&>()))> R;
+  return CppSQLite3Awaitable<R>(this, bWriter, pCancel, std::function<R(CppSQLite3DB &db)>(std::move(fn)));
+}
+#endif
+
+template<class... Params>
+void CppSQLite3Statement::bindAll(const Params&... params)
+{
+  checkVM();
+  int nParam = 0;
+  (checkBind(CppSQLite3BindTraits<std::decay_t<Params> >::bind(mpVM, ++nParam, params)), ...);
+}
+
+template<class T>
+void CppSQLite3Statement::bind(std::string_view szName, const T &value)
+{
+  checkBind(CppSQLite3BindTraits<std::decay_t<T> >::bind(mpVM, paramIndex(szName), value));
+}
+
+template<class T, class... Params>
+T CppSQLite3DB::scalar(const std::string &szSQL, const Params&... params) const
+{
+  std::optional<T> value;
+
+  if (!readScalar(value, false, szSQL, params...)) {
+    throw CppSQLite3Exception(CPPSQLITE_ERROR, "Invalid scalar query", DONT_DELETE_MSG);
+  }
+
+  return std::move(*value);
+}
+
+template<class T, class... Params>
+std::optional<T> CppSQLite3DB::scalarOpt(const std::string &szSQL, const Params&... params) const
+{
+  std::optional<T> value;
+  readScalar(value, true, szSQL, params...);
+  return value;
+}
+
+template<class T, class... Params>
+bool CppSQLite3DB::readScalar(std::optional<T> &value, bool bNullEmpty, const std::string &szSQL,
+                              const Params&... params) const
+{
+  static_assert(!std::is_same<T, std::string_view>::value && !std::is_same<T, CppSQLite3ByteView>::value,
+                "A scalar is read after its statement is reset, so must own its value");
+
+  bool bCached;
+  std::shared_ptr<CppSQLite3ColumnMap> pColumns;
+  sqlite3_stmt *pVM = compile(szSQL, bCached, pColumns);
+  bool bRow;
+
+  try {
+    int nParam = 0;
+    (checkBind(CppSQLite3BindTraits<std::decay_t<Params> >::bind(pVM, ++nParam, params)), ...);
+
+    bRow = stepScalar(pVM);
+
+    if (bRow && !(bNullEmpty && sqlite3_column_type(pVM, 0) == SQLITE_NULL)) {
+      value = CppSQLite3ColumnTraits<T>::get(pVM, 0);
+    }
+  } catch (...) {
+    release(pVM, bCached, pColumns);
+    throw;
+  }
+
+  release(pVM, bCached, pColumns);
+  return bRow;
+}
+
 inline void CppSQLite3Query::checkVM() const
 {
   if (mpVM == NULL) {
@@ -0,0 +1,495 @@
+/*
+ * CppSQLite
+ * Developed by Rob Groves <rob.groves@btinternet.com>
+ * Maintained by NeoSmart Technologies <http://neosmart.net/>
+ * See LICENSE comment in CppSQLite3.h for copyright and license info
+*/
+
+// Benchmarks for the wrapper's hot paths. Most benchmarks that touch a
+// database run against an in-memory one (storage:0) and a file (storage:1);
+// the threaded lookups need a file. Items per second for those add up
+// across threads.
+// Data comes from a fixed seed, so runs are comparable across releases:
+//
+//   cppsqlite_bench --benchmark_out=results.json --benchmark_out_format=json
+
+#include "CppSQLite3.h"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// The encode.c functions kept in CppSQLite3.cpp, as the reference for the codec
+int sqlite3_encode_binary(const unsigned char *in, int n, unsigned char *out);
+int sqlite3_decode_binary(const unsigned char *in, unsigned char *out);
+
+namespace
+{
+  const int ROWS = 10000;
+  const unsigned int SEED = 42;
+
+  enum Storage { MEMORY = 0, DISK = 1 };
+
+  string dbFile(int nStorage, const char *szName)
+  {
+    return (nStorage == MEMORY ? string(":memory:") : string("cppsqlite_bench_") + szName + ".db");
+  }
+
+  void openFresh(CppSQLite3DB &db, int nStorage, const char *szName)
+  {
+    string szFile = dbFile(nStorage, szName);
+
+    if (nStorage == DISK) {
+      remove(szFile.c_str());
+      remove((szFile + "-journal").c_str());
+    }
+
+    db.open(szFile);
+    db.execDML("create table emp(empno integer primary key, empname text, salary real, dept int);");
+  }
+
+  void closeAndRemove(CppSQLite3DB &db, int nStorage, const char *szName)
+  {
+    db.close();
+
+    if (nStorage == DISK) {
+      remove(dbFile(nStorage, szName).c_str());
+    }
+  }
+
+  struct Employee
+  {
+    int64_t nEmpNo;
+    string szName;
+    double fSalary;
+    int64_t nDept;
+  };
+
+  const vector<Employee> &employees()
+  {
+    static const vector<Employee> rows = []() {
+      mt19937 rng(SEED);
+      vector<Employee> result;
+
+      for (int i = 0; i < ROWS; i++) {
+        result.push_back({i + 1, "Empname" + to_string(rng() % 1000000), 20000.0 + rng() % 80000,
+                          static_cast<int64_t>(rng() % 50)});
+      }
+
+      return result;
+    }();
+
+    return rows;
+  }
+
+  void populate(CppSQLite3DB &db)
+  {
+    CppSQLite3BulkInserter inserter(db, "insert into emp values (?, ?, ?, ?);", ROWS);
+
+    for (const Employee &e : employees()) {
+      CppSQLite3Statement &stmt = inserter.statement();
+      stmt.bind(1, e.nEmpNo);
+      stmt.bind(2, e.szName);
+      stmt.bind(3, e.fSalary);
+      stmt.bind(4, e.nDept);
+      inserter.insert();
+    }
+
+    inserter.flush();
+  }
+
+  // Binary payloads: "random" has an escape every 85 bytes or so, "text" is
+  // printable and needs none
+  vector<unsigned char> payload(bool bRandom, size_t nLen)
+  {
+    mt19937 rng(SEED);
+    vector<unsigned char> data(nLen);
+
+    for (unsigned char &c : data) {
+      c = static_cast<unsigned char>(bRandom ? rng() : 'a' + rng() % 26);
+    }
+
+    return data;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Queries
+////////////////////////////////////////////////////////////////////////////////
+
+static void BM_PointLookupExecQuery(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "lookup");
+  populate(db);
+  mt19937 rng(SEED);
+  char szSQL[128];
+
+  for (auto _ : state) {
+    snprintf(szSQL, sizeof szSQL, "select empname from emp where empno = %d;", static_cast<int>(rng() % ROWS) + 1);
+    CppSQLite3Query q = db.execQuery(szSQL);
+    benchmark::DoNotOptimize(q.getStringView(0));
+  }
+
+  closeAndRemove(db, state.range(0), "lookup");
+}
+BENCHMARK(BM_PointLookupExecQuery)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+static void BM_PointLookupStatement(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "lookup");
+  populate(db);
+  CppSQLite3Statement stmt = db.compileStatement("select empname from emp where empno = ?;");
+  mt19937 rng(SEED);
+
+  for (auto _ : state) {
+    stmt.bind(1, static_cast<int>(rng() % ROWS) + 1);
+    CppSQLite3Query q = stmt.execQuery();
+    benchmark::DoNotOptimize(q.getStringView(0));
+    q.finalize();
+    stmt.reset();
+  }
+
+  stmt.finalize();
+  closeAndRemove(db, state.range(0), "lookup");
+}
+BENCHMARK(BM_PointLookupStatement)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+static void BM_ScanFieldsByIndex(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "scan");
+  populate(db);
+
+  for (auto _ : state) {
+    CppSQLite3Query q = db.execQuery("select empno, empname, salary, dept from emp;");
+
+    for (; !q.eof(); q.nextRow()) {
+      benchmark::DoNotOptimize(q.getInt64Field(0));
+      benchmark::DoNotOptimize(q.getStringField(1));
+      benchmark::DoNotOptimize(q.getFloatField(2));
+      benchmark::DoNotOptimize(q.getInt64Field(3));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * ROWS);
+  closeAndRemove(db, state.range(0), "scan");
+}
+BENCHMARK(BM_ScanFieldsByIndex)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+static void BM_ScanFieldsByName(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "scan");
+  populate(db);
+
+  for (auto _ : state) {
+    CppSQLite3Query q = db.execQuery("select empno, empname, salary, dept from emp;");
+
+    for (; !q.eof(); q.nextRow()) {
+      benchmark::DoNotOptimize(q.getInt64Field("empno"));
+      benchmark::DoNotOptimize(q.getStringField("empname"));
+      benchmark::DoNotOptimize(q.getFloatField("salary"));
+      benchmark::DoNotOptimize(q.getInt64Field("dept"));
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * ROWS);
+  closeAndRemove(db, state.range(0), "scan");
+}
+BENCHMARK(BM_ScanFieldsByName)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+static void BM_GetTable(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "table");
+  populate(db);
+
+  for (auto _ : state) {
+    CppSQLite3Table t = db.getTable("select empno, empname, salary, dept from emp;");
+    benchmark::DoNotOptimize(t.numRows());
+  }
+
+  state.SetItemsProcessed(state.iterations() * ROWS);
+  closeAndRemove(db, state.range(0), "table");
+}
+BENCHMARK(BM_GetTable)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+////////////////////////////////////////////////////////////////////////////////
+// Bulk inserts. Each iteration loads ROWS rows into an empty table.
+////////////////////////////////////////////////////////////////////////////////
+
+static void BM_InsertExecDMLTransaction(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "insert");
+  char szSQL[256];
+
+  for (auto _ : state) {
+    db.execDML("delete from emp;");
+    db.execDML("begin transaction;");
+
+    for (const Employee &e : employees()) {
+      snprintf(szSQL, sizeof szSQL, "insert into emp values (%lld, '%s', %f, %lld);",
+               static_cast<long long>(e.nEmpNo), e.szName.c_str(), e.fSalary, static_cast<long long>(e.nDept));
+      db.execDML(szSQL);
+    }
+
+    db.execDML("commit transaction;");
+  }
+
+  state.SetItemsProcessed(state.iterations() * ROWS);
+  closeAndRemove(db, state.range(0), "insert");
+}
+BENCHMARK(BM_InsertExecDMLTransaction)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+static void BM_InsertStatementTransaction(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "insert");
+  CppSQLite3Statement stmt = db.compileStatement("insert into emp values (?, ?, ?, ?);");
+
+  for (auto _ : state) {
+    db.execDML("delete from emp;");
+    db.execDML("begin transaction;");
+
+    for (const Employee &e : employees()) {
+      stmt.bind(1, e.nEmpNo);
+      stmt.bind(2, e.szName);
+      stmt.bind(3, e.fSalary);
+      stmt.bind(4, e.nDept);
+      stmt.execDML();
+      stmt.reset();
+    }
+
+    db.execDML("commit transaction;");
+  }
+
+  state.SetItemsProcessed(state.iterations() * ROWS);
+  stmt.finalize();
+  closeAndRemove(db, state.range(0), "insert");
+}
+BENCHMARK(BM_InsertStatementTransaction)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+static void BM_InsertBulkInserter(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "insert");
+
+  for (auto _ : state) {
+    db.execDML("delete from emp;");
+    populate(db);
+  }
+
+  state.SetItemsProcessed(state.iterations() * ROWS);
+  closeAndRemove(db, state.range(0), "insert");
+}
+BENCHMARK(BM_InsertBulkInserter)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+static void BM_InsertExecuteMany(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "insert");
+  CppSQLite3Statement stmt = db.compileStatement("insert into emp values (?, ?, ?, ?);");
+
+  vector<int64_t> anEmpNo;
+  vector<string_view> aszName;
+  vector<double> afSalary;
+  vector<int64_t> anDept;
+
+  for (const Employee &e : employees()) {
+    anEmpNo.push_back(e.nEmpNo);
+    aszName.push_back(e.szName);
+    afSalary.push_back(e.fSalary);
+    anDept.push_back(e.nDept);
+  }
+
+  vector<CppSQLite3ParamColumn> columns = {anEmpNo, aszName, afSalary, anDept};
+  CppSQLite3ExecuteManyOptions options;
+  options.bStatic = true;
+
+  for (auto _ : state) {
+    db.execDML("delete from emp;");
+    benchmark::DoNotOptimize(stmt.executeMany(ROWS, columns, options));
+  }
+
+  state.SetItemsProcessed(state.iterations() * ROWS);
+  stmt.finalize();
+  closeAndRemove(db, state.range(0), "insert");
+}
+BENCHMARK(BM_InsertExecuteMany)->ArgName("storage")->Arg(MEMORY)->Arg(DISK);
+
+////////////////////////////////////////////////////////////////////////////////
+// Binary encoding. Arguments are whether the data is random, and its length.
+////////////////////////////////////////////////////////////////////////////////
+
+static void BM_EncodeReference(benchmark::State &state)
+{
+  vector<unsigned char> data = payload(state.range(0) != 0, state.range(1));
+  vector<unsigned char> encoded(CppSQLite3BinaryCodec::maxEncodedLength(data.size()));
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(sqlite3_encode_binary(data.data(), static_cast<int>(data.size()), encoded.data()));
+  }
+
+  state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_EncodeReference)->ArgNames({"random", "bytes"})->ArgsProduct({{0, 1}, {4 << 10, 4 << 20}});
+
+static void BM_EncodeCodec(benchmark::State &state)
+{
+  vector<unsigned char> data = payload(state.range(0) != 0, state.range(1));
+  vector<unsigned char> encoded(CppSQLite3BinaryCodec::maxEncodedLength(data.size()));
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(CppSQLite3BinaryCodec::encode(data.data(), data.size(), encoded.data()));
+  }
+
+  state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_EncodeCodec)->ArgNames({"random", "bytes"})->ArgsProduct({{0, 1}, {4 << 10, 4 << 20}});
+
+static void BM_DecodeReference(benchmark::State &state)
+{
+  vector<unsigned char> data = payload(state.range(0) != 0, state.range(1));
+  vector<unsigned char> encoded(CppSQLite3BinaryCodec::maxEncodedLength(data.size()));
+  CppSQLite3BinaryCodec::encode(data.data(), data.size(), encoded.data());
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(sqlite3_decode_binary(encoded.data(), data.data()));
+  }
+
+  state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_DecodeReference)->ArgNames({"random", "bytes"})->ArgsProduct({{0, 1}, {4 << 10, 4 << 20}});
+
+static void BM_DecodeCodec(benchmark::State &state)
+{
+  vector<unsigned char> data = payload(state.range(0) != 0, state.range(1));
+  vector<unsigned char> encoded(CppSQLite3BinaryCodec::maxEncodedLength(data.size()));
+  size_t nEncoded = CppSQLite3BinaryCodec::encode(data.data(), data.size(), encoded.data());
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(CppSQLite3BinaryCodec::decode(encoded.data(), nEncoded, data.data()));
+  }
+
+  state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_DecodeCodec)->ArgNames({"random", "bytes"})->ArgsProduct({{0, 1}, {4 << 10, 4 << 20}});
+
+////////////////////////////////////////////////////////////////////////////////
+// Backup of a populated database to a file
+////////////////////////////////////////////////////////////////////////////////
+
+static void BM_Backup(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  openFresh(db, state.range(0), "backup_src");
+  populate(db);
+
+  CppSQLite3BackupOptions options;
+  options.nPagesPerStep = static_cast<int>(state.range(1));
+  string szTarget = "cppsqlite_bench_backup.db";
+  int64_t nBytes = db.execScalar("select page_count * page_size from pragma_page_count, pragma_page_size;");
+
+  for (auto _ : state) {
+    db.backup(szTarget, options);
+  }
+
+  state.SetBytesProcessed(state.iterations() * nBytes);
+  remove(szTarget.c_str());
+  closeAndRemove(db, state.range(0), "backup_src");
+}
+BENCHMARK(BM_Backup)->ArgNames({"storage", "pages"})->ArgsProduct({{MEMORY, DISK}, {-1, 64}});
+
+////////////////////////////////////////////////////////////////////////////////
+// Point lookups from many threads, each on a connection of its own, into a
+// snapshot (read-only, immutable, memory mapped) and into an ordinary file
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  // Built on first use and removed at exit
+  struct SharedFile
+  {
+    SharedFile()
+      : szFile("cppsqlite_bench_shared.db")
+    {
+      remove(szFile.c_str());
+      CppSQLite3DB db;
+      db.open(szFile);
+      db.execDML("create table emp(empno integer primary key, empname text, salary real, dept int);");
+      populate(db);
+    }
+
+    ~SharedFile()
+    {
+      remove(szFile.c_str());
+    }
+
+    string szFile;
+  };
+
+  const string &sharedFile()
+  {
+    static SharedFile file;
+    return file.szFile;
+  }
+
+  CppSQLite3SnapshotReader &snapshotReader()
+  {
+    static CppSQLite3SnapshotReader reader(sharedFile());
+    return reader;
+  }
+
+  void lookups(benchmark::State &state, CppSQLite3DB &db)
+  {
+    CppSQLite3Statement stmt = db.compileStatement("select empname from emp where empno = ?;");
+    mt19937 rng(SEED + state.thread_index());
+
+    for (auto _ : state) {
+      stmt.bind(1, static_cast<int>(rng() % ROWS) + 1);
+      CppSQLite3Query q = stmt.execQuery();
+      benchmark::DoNotOptimize(q.getStringView(0));
+      q.finalize();
+      stmt.reset();
+    }
+
+    stmt.finalize();
+    state.SetItemsProcessed(state.iterations());
+  }
+
+  // 1, 2, 4, ... threads up to the number of cores
+  void threadCounts(benchmark::internal::Benchmark *pBenchmark)
+  {
+    int nCores = max(1, static_cast<int>(thread::hardware_concurrency()));
+
+    for (int nThreads = 1; nThreads < nCores; nThreads *= 2) {
+      pBenchmark->Threads(nThreads);
+    }
+
+    pBenchmark->Threads(nCores);
+  }
+}
+
+static void BM_SnapshotLookup(benchmark::State &state)
+{
+  lookups(state, snapshotReader().connection());
+}
+BENCHMARK(BM_SnapshotLookup)->Apply(threadCounts)->UseRealTime();
+
+static void BM_SharedFileLookup(benchmark::State &state)
+{
+  CppSQLite3DB db;
+  db.open(sharedFile());
+  lookups(state, db);
+}
+BENCHMARK(BM_SharedFileLookup)->Apply(threadCounts)->UseRealTime();
+
+BENCHMARK_MAIN();